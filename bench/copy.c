@@ -0,0 +1,172 @@
+/* Benchmark of the `cat` and `cp` internal commands: compares the copy engine
+of copy.c, used in the shell process, with the coreutils binaries launched
+like call_external_cmd does.
+
+Usage: copy DIR [SIZE_MIB [NB_FILES]]
+Creates in DIR a file of SIZE_MIB mebibytes (default 256) and NB_FILES small
+files of 4 KiB (default 1000), then measures:
+- `cp BIG DIR/copy`: file to file;
+- `cat BIG | reader`: file to a pipe, drained by another process;
+- `cat SMALL >> DIR/out` for every small file: the typical loop body, where
+  launching a process costs more than the copy itself.
+The throughputs are in MiB/s, and in files/s for the small files. The files
+are removed at the end.
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copy.h"
+
+volatile sig_atomic_t g_sig_received = 0; // defined by fsh.c in the shell
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs an external command with its stdout on `out` (if not -1), and waits
+void run_external(char **argv, int out) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (out != -1) posix_spawn_file_actions_adddup2(&actions, out, 1);
+  int pid, status;
+  if (posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ) != 0) {
+    perror("posix_spawnp");
+    exit(EXIT_FAILURE);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  waitpid(pid, &status, 0);
+}
+
+// Copies `src` into a new `dst`, like the internal `cp`
+void builtin_cp(char *src, char *dst) {
+  int in = open(src, O_RDONLY);
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (in == -1 || out == -1 || copy_fd(in, out) == -1) {
+    perror("copy_fd");
+    exit(EXIT_FAILURE);
+  }
+  close(in);
+  close(out);
+}
+
+// Starts a process that reads and discards everything from a pipe
+// @return the write end of the pipe
+int start_reader(int *pid) {
+  int p[2];
+  if (pipe(p) == -1) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  if ((*pid = fork()) == 0) {
+    close(p[1]);
+    char buf[COPY_BUF_SIZE];
+    while (read(p[0], buf, sizeof(buf)) > 0);
+    _exit(EXIT_SUCCESS); // without flushing the output of the parent
+  }
+  close(p[0]);
+  return p[1];
+}
+
+void make_file(char *path, size_t size) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  char buf[1 << 16];
+  memset(buf, 'x', sizeof(buf));
+  for (size_t done = 0; done < size; done += sizeof(buf)) {
+    size_t len = size - done < sizeof(buf) ? size - done : sizeof(buf);
+    if (fd == -1 || write(fd, buf, len) != (ssize_t) len) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+  }
+  close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    dprintf(2, "usage: copy DIR [SIZE_MIB [NB_FILES]]\n");
+    return EXIT_FAILURE;
+  }
+  char *dir = argv[1];
+  size_t size = (argc > 2 ? strtoul(argv[2], NULL, 10) : 256) << 20;
+  int nb_files = argc > 3 ? atoi(argv[3]) : 1000;
+  double mib = size / (double) (1 << 20), start, ext, fsh;
+  int i, out, pid, status;
+
+  mkdir(dir, 0755);
+  char big[strlen(dir) + 32], copy[strlen(dir) + 32], small[strlen(dir) + 32];
+  char append[strlen(dir) + 32];
+  sprintf(big, "%s/big", dir);
+  sprintf(copy, "%s/copy", dir);
+  sprintf(append, "%s/out", dir);
+  make_file(big, size);
+  for (i = 0; i < nb_files; i++) {
+    sprintf(small, "%s/small%d", dir, i);
+    make_file(small, 4096);
+  }
+
+  printf("%-22s %14s %14s %8s\n", "", "coreutils", "fsh", "speedup");
+
+  start = now();
+  run_external((char *[]) { "cp", big, copy, NULL }, -1);
+  ext = mib / (now() - start);
+  unlink(copy);
+  start = now();
+  builtin_cp(big, copy);
+  fsh = mib / (now() - start);
+  unlink(copy);
+  printf("%-22s %9.0f MiB/s %9.0f MiB/s %7.1fx\n", "cp (file to file)", ext, fsh, fsh / ext);
+
+  out = start_reader(&pid);
+  start = now();
+  run_external((char *[]) { "cat", big, NULL }, out);
+  close(out);
+  waitpid(pid, &status, 0);
+  ext = mib / (now() - start);
+  out = start_reader(&pid);
+  start = now();
+  int in = open(big, O_RDONLY);
+  copy_fd(in, out);
+  close(in);
+  close(out);
+  waitpid(pid, &status, 0);
+  fsh = mib / (now() - start);
+  printf("%-22s %9.0f MiB/s %9.0f MiB/s %7.1fx\n", "cat (file to pipe)", ext, fsh, fsh / ext);
+
+  out = open(append, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+  start = now();
+  for (i = 0; i < nb_files; i++) {
+    sprintf(small, "%s/small%d", dir, i);
+    run_external((char *[]) { "cat", small, NULL }, out);
+  }
+  ext = nb_files / (now() - start);
+  start = now();
+  for (i = 0; i < nb_files; i++) {
+    sprintf(small, "%s/small%d", dir, i);
+    in = open(small, O_RDONLY);
+    copy_fd(in, out);
+    close(in);
+  }
+  fsh = nb_files / (now() - start);
+  close(out);
+  printf("%-22s %9.0f file/s %8.0f file/s %7.1fx\n", "cat >> (4 KiB files)", ext, fsh, fsh / ext);
+
+  unlink(big);
+  unlink(append);
+  for (i = 0; i < nb_files; i++) {
+    sprintf(small, "%s/small%d", dir, i);
+    unlink(small);
+  }
+  rmdir(dir);
+  return EXIT_SUCCESS;
+}
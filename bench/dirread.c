@@ -0,0 +1,151 @@
+/* Benchmark of the directory readers: compares the opendir/readdir loop used by
+fsh before with `struct dir_reader` (getdents64 in a large buffer).
+
+Usage: dirread DIR [COUNT]
+If COUNT is given, DIR is created and filled with COUNT empty files first.
+
+For each reader, prints the number of getdents64 calls per entry (counted by
+tracing a child process with ptrace) and the number of entries read per second.
+*/
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirreader.h"
+
+#define NB_RUNS 5
+
+char *g_ext = "txt";
+
+// The loop of exec_for_aux before the getdents64 reader
+long count_readdir(char *dir_name) {
+  DIR *dirp = opendir(dir_name);
+  if (!dirp) {
+    perror("opendir");
+    exit(EXIT_FAILURE);
+  }
+  long count = 0;
+  int ext_len = strlen(g_ext), file_len;
+  struct dirent *dentry;
+  while ((dentry = readdir(dirp))) {
+    if (strcmp(dentry->d_name, ".") == 0 || strcmp(dentry->d_name, "..") == 0)
+      continue;
+    if (dentry->d_name[0] == '.') continue;
+    file_len = strlen(dentry->d_name);
+    if (ext_len >= file_len) continue;
+    char *ext_start = dentry->d_name + file_len - ext_len - 1;
+    if (*ext_start != '.' || strcmp(ext_start + 1, g_ext) != 0) continue;
+    count++;
+  }
+  closedir(dirp);
+  return count;
+}
+
+long count_getdents(char *dir_name) {
+  struct cmd_for cmd_for = { .filter_ext = g_ext };
+  struct dir_reader reader;
+  if (dir_reader_init(&reader, DIR_READER_BUF_SIZE, &cmd_for) == -1 ||
+      dir_reader_open(&reader, AT_FDCWD, dir_name) == -1) {
+    perror("dir_reader");
+    exit(EXIT_FAILURE);
+  }
+  long count = 0;
+  struct dir_entry entry;
+  while (dir_reader_next(&reader, &entry) == 1) count++;
+  dir_reader_free(&reader);
+  return count;
+}
+
+// Counts the getdents64 calls made by `reader` in a traced child process
+long count_syscalls(long (*reader)(char *), char *dir_name) {
+  int pid = fork(), wstat;
+  if (pid == 0) {
+    ptrace(PTRACE_TRACEME, 0, 0, 0);
+    raise(SIGSTOP);
+    reader(dir_name);
+    _exit(EXIT_SUCCESS);
+  }
+  waitpid(pid, &wstat, 0);
+  if (ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD) == -1) {
+    kill(pid, SIGKILL);
+    waitpid(pid, &wstat, 0);
+    return -1;
+  }
+
+  long nb_calls = 0;
+  struct __ptrace_syscall_info info;
+  while (1) {
+    ptrace(PTRACE_SYSCALL, pid, 0, 0);
+    waitpid(pid, &wstat, 0);
+    if (WIFEXITED(wstat) || WIFSIGNALED(wstat)) break;
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+        info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr == SYS_getdents64)
+      nb_calls++;
+  }
+  return nb_calls;
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(char *label, long (*reader)(char *), char *dir_name) {
+  long nb_calls = count_syscalls(reader, dir_name);
+  long nb_entries = 0;
+  double start = now();
+  for (int i = 0; i < NB_RUNS; i++) nb_entries += reader(dir_name);
+  double elapsed = now() - start;
+
+  nb_entries /= NB_RUNS;
+  printf("%-9s %ld entries, ", label, nb_entries);
+  if (nb_calls >= 0) {
+    printf("%ld getdents64 calls (%.6f per entry), ", nb_calls,
+           nb_entries ? (double) nb_calls / nb_entries : 0);
+  } else {
+    printf("getdents64 calls unknown (ptrace unavailable), ");
+  }
+  printf("%.2f M entries/s\n", nb_entries * NB_RUNS / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    dprintf(2, "usage: %s DIR [COUNT]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (argc == 3) {
+    long count = strtol(argv[2], NULL, 10);
+    char name[32];
+    if (mkdir(argv[1], 0777) == -1) {
+      perror("mkdir");
+      return EXIT_FAILURE;
+    }
+    int dirfd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    for (long i = 0; i < count; i++) {
+      snprintf(name, sizeof(name), i % 2 ? "f%ld.txt" : "f%ld.c", i);
+      int fd = openat(dirfd, name, O_WRONLY | O_CREAT, 0666);
+      if (fd == -1) {
+        perror("openat");
+        return EXIT_FAILURE;
+      }
+      close(fd);
+    }
+    close(dirfd);
+  }
+
+  run("readdir", count_readdir, argv[1]);
+  run("getdents", count_getdents, argv[1]);
+  return EXIT_SUCCESS;
+}
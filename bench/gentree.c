@@ -0,0 +1,150 @@
+/* Generator of synthetic directory trees, to measure the recursive `for` loops
+on reproducible tree shapes (see bench/traverse.c).
+
+Usage: gentree [OPTION...] DIR
+Creates DIR (which may already exist) and fills it with a tree of directories:
+  -f FANOUT  number of subdirectories of each directory (default 4)
+  -d DEPTH   number of levels of subdirectories below DIR (default 4)
+  -n FILES   mean number of files in each directory (default 32)
+  -D DIST    distribution of the number of files of a directory: `fixed`,
+             `uniform` (between 0 and 2 * FILES) or `exp` (exponential, a few
+             directories have most of the files) (default uniform)
+  -e EXTS    comma separated extensions of the files, picked at random
+             (default c,h,txt,md)
+  -l PCT     percentage of the files that are symbolic links to a file of
+             the same directory (default 5)
+  -p PCT     percentage of the files that are FIFOs (default 1)
+  -s SEED    seed of the pseudo-random generator (default 1)
+The same options always give the same tree. Prints the number of entries
+created, by type, as `dirs N files N symlinks N fifos N entries N`.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_EXTS 32
+
+int g_fanout = 4, g_depth = 4, g_files = 32, g_link_pct = 5, g_fifo_pct = 1;
+char *g_dist = "uniform";
+char *g_exts[MAX_EXTS];
+int g_nb_exts = 0;
+unsigned long long g_seed = 1;
+long g_nb_dirs = 0, g_nb_files = 0, g_nb_links = 0, g_nb_fifos = 0;
+
+// xorshift64*, so that the trees do not depend on the libc
+unsigned long long next_random(void) {
+  g_seed ^= g_seed >> 12;
+  g_seed ^= g_seed << 25;
+  g_seed ^= g_seed >> 27;
+  return g_seed * 0x2545F4914F6CDD1DULL;
+}
+
+// A random number in [0, n)
+int random_below(int n) {
+  return n > 0 ? (int) (next_random() % n) : 0;
+}
+
+// The number of files of the next directory, according to -D
+int draw_nb_files(void) {
+  if (strcmp(g_dist, "fixed") == 0) return g_files;
+  if (strcmp(g_dist, "exp") == 0) {
+    double u = (next_random() >> 11) * (1.0 / (1ULL << 53)); // in [0, 1)
+    return (int) (-log(1 - u) * g_files);
+  }
+  return random_below(2 * g_files + 1);
+}
+
+void fail(char *what) {
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+// Fills the directory `dir_fd` and its subdirectories down to `depth` levels
+void gen_dir(int dir_fd, int depth) {
+  char name[64], target[64];
+  int nb_files = draw_nb_files(), last_file = -1;
+
+  for (int i = 0; i < nb_files; i++) {
+    char *ext = g_exts[random_below(g_nb_exts)];
+    snprintf(name, sizeof(name), "f%d.%s", i, ext);
+    int kind = random_below(100);
+    if (kind < g_link_pct && last_file != -1) {
+      snprintf(target, sizeof(target), "f%d.%s", last_file, g_exts[0]);
+      if (symlinkat(target, dir_fd, name) == -1 && errno != EEXIST) fail("symlinkat");
+      g_nb_links++;
+    } else if (kind >= g_link_pct && kind < g_link_pct + g_fifo_pct) {
+      if (mknodat(dir_fd, name, S_IFIFO | 0644, 0) == -1 && errno != EEXIST) fail("mknodat");
+      g_nb_fifos++;
+    } else {
+      int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+      if (fd == -1) fail("openat");
+      close(fd);
+      g_nb_files++;
+      // the links point to a file that exists with the first extension
+      if (strcmp(ext, g_exts[0]) == 0) last_file = i;
+    }
+  }
+
+  if (depth == 0) return;
+  for (int i = 0; i < g_fanout; i++) {
+    snprintf(name, sizeof(name), "d%d", i);
+    if (mkdirat(dir_fd, name, 0755) == -1 && errno != EEXIST) fail("mkdirat");
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) fail("openat");
+    g_nb_dirs++;
+    gen_dir(fd, depth - 1);
+    close(fd);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char default_exts[] = "c,h,txt,md"; // modified by strtok
+  char *exts = default_exts;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:d:n:D:e:l:p:s:")) != -1) {
+    switch (opt) {
+      case 'f': g_fanout = atoi(optarg); break;
+      case 'd': g_depth = atoi(optarg); break;
+      case 'n': g_files = atoi(optarg); break;
+      case 'D': g_dist = optarg; break;
+      case 'e': exts = optarg; break;
+      case 'l': g_link_pct = atoi(optarg); break;
+      case 'p': g_fifo_pct = atoi(optarg); break;
+      case 's': g_seed = strtoull(optarg, NULL, 10) | 1; break; // never 0
+      default:
+        dprintf(2, "usage: gentree [-f FANOUT] [-d DEPTH] [-n FILES] [-D fixed|uniform|exp]\n"
+                   "               [-e EXTS] [-l PCT] [-p PCT] [-s SEED] DIR\n");
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    dprintf(2, "gentree: missing directory\n");
+    return EXIT_FAILURE;
+  }
+  if (strcmp(g_dist, "fixed") && strcmp(g_dist, "uniform") && strcmp(g_dist, "exp")) {
+    dprintf(2, "gentree: unknown distribution %s\n", g_dist);
+    return EXIT_FAILURE;
+  }
+
+  for (char *ext = strtok(exts, ","); ext && g_nb_exts < MAX_EXTS; ext = strtok(NULL, ",")) {
+    g_exts[g_nb_exts++] = ext;
+  }
+  if (!g_nb_exts) g_exts[g_nb_exts++] = "txt";
+
+  if (mkdir(argv[optind], 0755) == -1 && errno != EEXIST) fail("mkdir");
+  int root = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root == -1) fail("open");
+  gen_dir(root, g_depth);
+  close(root);
+
+  printf("dirs %ld files %ld symlinks %ld fifos %ld entries %ld\n", g_nb_dirs,
+         g_nb_files, g_nb_links, g_nb_fifos,
+         g_nb_dirs + g_nb_files + g_nb_links + g_nb_fifos);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+/* Throughput of the parsing of very long lines, like the ones generated by
+scripts that give thousands of paths to a single command. The benchmark is
+linked with the objects of the shell (all but fsh.o, whose globals are defined
+here), and calls parse directly.
+
+Usage: longline [MIO...]
+For each size in MiB (default 1, 4 and 16) and each corpus, parses a line of
+that size again and again for about 0.5s, and prints one JSON object per line:
+  {"bench":"plain","mib":4,"iters":N,"mib_per_s":X,"args_per_s":Y}
+
+The corpora are commands with a single long list of arguments:
+- plain: paths without special characters;
+- vars: paths containing variables (`$F/src/$D.c`), that are compiled;
+- quoted: paths with spaces, single and double quotes and backslashes.
+The copy of the line before each parse (parse modifies it) is measured too,
+it is negligible.
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "cmd_types.h"
+#include "parsing.h"
+
+// globals of fsh.c
+char *g_cwd;
+char *g_prev_wd;
+char *g_home;
+int g_prev_ret_val;
+int g_interactive;
+volatile sig_atomic_t g_sig_received = 0;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Generates a line of about `size` bytes of the corpus `kind` in `line`
+// @return the number of arguments of the command
+long gen_line(char *line, size_t size, char *kind) {
+  char *head = line + sprintf(line, "cmd");
+  char *end = line + size - 128;
+  long nb_args = 0;
+  while (head < end) {
+    long i = nb_args++;
+    if (strcmp(kind, "plain") == 0) {
+      head += sprintf(head, " /usr/src/project/module%ld/file%ld.c", i % 97, i);
+    } else if (strcmp(kind, "vars") == 0) {
+      head += sprintf(head, " $F/module%ld/$D%ld.c", i % 97, i);
+    } else {
+      switch (i % 3) {
+        case 0: head += sprintf(head, " '/usr/src/my project/file %ld.c'", i); break;
+        case 1: head += sprintf(head, " \"/usr/src/$F dir/file%ld.c\"", i); break;
+        default: head += sprintf(head, " /usr/src/escaped\\ name/file%ld.c", i); break;
+      }
+    }
+  }
+  return nb_args;
+}
+
+// Parses the line of `size` MiB of the corpus `kind` for about 0.5s
+void measure(char *kind, int mib) {
+  size_t size = (size_t) mib << 20;
+  char *corpus = malloc(size), *line = malloc(size);
+  struct arena arena = { 0 };
+  if (!corpus || !line) {
+    perror("longline");
+    exit(EXIT_FAILURE);
+  }
+  long nb_args = gen_line(corpus, size, kind);
+  size_t len = strlen(corpus) + 1;
+
+  long iters = 0;
+  double start = now(), elapsed;
+  do {
+    memcpy(line, corpus, len);
+    if (!parse(line, &arena)) {
+      dprintf(2, "longline: the %s corpus does not parse\n", kind);
+      exit(EXIT_FAILURE);
+    }
+    arena_reset(&arena);
+    iters++;
+    elapsed = now() - start;
+  } while (elapsed < 0.5);
+
+  printf("{\"bench\":\"%s\",\"mib\":%d,\"iters\":%ld,\"mib_per_s\":%.1f,\"args_per_s\":%.0f}\n",
+         kind, mib, iters, (double) len * iters / elapsed / (1 << 20),
+         nb_args * iters / elapsed);
+  fflush(stdout);
+  arena_free(&arena);
+  free(corpus);
+  free(line);
+}
+
+int main(int argc, char *argv[]) {
+  char *kinds[] = { "plain", "vars", "quoted" };
+  int default_sizes[] = { 1, 4, 16 };
+  int nb_sizes = argc > 1 ? argc - 1 : 3;
+
+  for (int i = 0; i < nb_sizes; i++) {
+    int mib = argc > 1 ? atoi(argv[i + 1]) : default_sizes[i];
+    if (mib <= 0) {
+      dprintf(2, "usage: longline [MIO...]\n");
+      return EXIT_FAILURE;
+    }
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(char *); k++) measure(kinds[k], mib);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,221 @@
+/* Microbenchmarks of the hot paths of the shell that do not fork: parsing,
+expansion of the arguments and dispatch of internal commands. The benchmark is
+linked with the objects of the shell (all but fsh.o, whose globals are defined
+here), and with malloc, calloc and realloc wrapped (-Wl,--wrap) to count the
+allocations made by the shell. Allocations made inside the libc (strdup...)
+are not counted.
+
+Usage: micro [FILTER]
+Runs the benchmarks whose name contains FILTER (all by default), each for about
+0.2s, and prints one JSON object per benchmark and per line:
+  {"bench":"parse_pipeline","iters":N,"ns_per_op":X,"allocs_per_op":Y,"bytes_per_op":Z}
+
+The corpora are generated: a pipeline of 64 commands, 16 nested `if` and `for`
+commands, and a command with 64 arguments containing 2 variables each. The
+syntax tree has no free_cmd, it lives in an arena that is reset after each op,
+which is counted in the parse benchmarks (as is the copy of the line, modified
+by parse).
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cmd_types.h"
+#include "commands.h"
+#include "execution.h"
+#include "parsing.h"
+
+// globals of fsh.c
+char *g_cwd;
+char *g_prev_wd;
+char *g_home;
+int g_prev_ret_val;
+int g_interactive;
+volatile sig_atomic_t g_sig_received = 0;
+
+// Counters of the allocations
+size_t g_nb_allocs = 0;
+size_t g_alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  g_nb_allocs++;
+  g_alloc_bytes += size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  g_nb_allocs++;
+  g_alloc_bytes += nmemb * size;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  g_nb_allocs++;
+  g_alloc_bytes += size;
+  return __real_realloc(ptr, size);
+}
+
+#define LINE_CAP 8192
+
+// State of the benchmarks, prepared by setup
+char g_pipeline[LINE_CAP];
+char g_nested[LINE_CAP];
+char g_args[LINE_CAP];
+char g_line[LINE_CAP]; // copy of a corpus given to parse
+char g_dep_str[LINE_CAP];
+char *g_vars[128];
+struct arena g_tree = { 0 };
+struct cmd_simple *g_args_cmd; // the parsed g_args, for the expansion
+int g_null_fd;
+
+// Writes the `depth` nested commands of the nested corpus at `head`
+char *gen_nested(char *head, int depth) {
+  if (depth == 0) return head + sprintf(head, "return 0");
+  head += sprintf(head, "if return 0 { for F in . -e c { ");
+  head = gen_nested(head, depth - 1);
+  return head + sprintf(head, " } } else { return 1 }");
+}
+
+// Generates the corpora
+void setup(void) {
+  char *head = g_pipeline;
+  for (int i = 0; i < 64; i++) {
+    head += sprintf(head, "%scmd%d -a %d", i ? " | " : "", i, i);
+  }
+  gen_nested(g_nested, 16);
+  head = g_args + sprintf(g_args, "cmd");
+  char *dep = g_dep_str;
+  for (int i = 0; i < 64; i++) {
+    head += sprintf(head, " $F/dir%d/$D.c", i);
+    dep += sprintf(dep, "$F/dir%d/$D.c", i);
+  }
+
+  g_vars['F'] = "/usr/local/src/project";
+  g_vars['D'] = "module";
+  g_cwd = "/";
+  g_null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (register_internal_commands() == -1 || g_null_fd == -1) {
+    perror("micro");
+    exit(EXIT_FAILURE);
+  }
+
+  char *corpora[] = { g_pipeline, g_nested, g_args };
+  struct cmd *cmd = NULL;
+  for (int i = 0; i < 3; i++) {
+    strcpy(g_line, corpora[i]);
+    arena_reset(&g_tree);
+    if (!(cmd = parse(g_line, &g_tree))) {
+      dprintf(2, "micro: corpus %d does not parse\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  g_args_cmd = cmd->detail; // g_tree is kept for the expansion benchmarks
+}
+
+struct arena g_parse_arena = { 0 };
+
+void parse_corpus(char *corpus) {
+  strcpy(g_line, corpus);
+  if (!parse(g_line, &g_parse_arena)) exit(EXIT_FAILURE);
+  arena_reset(&g_parse_arena);
+}
+
+void bench_parse_pipeline(void) { parse_corpus(g_pipeline); }
+void bench_parse_nested(void) { parse_corpus(g_nested); }
+void bench_parse_args(void) { parse_corpus(g_args); }
+
+void bench_replace_variables(void) {
+  struct arena_mark mark = arena_mark(&g_scratch);
+  if (!replace_variables(g_dep_str, g_vars, &g_scratch)) exit(EXIT_FAILURE);
+  arena_release(&g_scratch, mark);
+}
+
+// The expansion of every argument of a command, as in exec_simple_cmd
+void bench_expand_template(void) {
+  struct arena_mark mark = arena_mark(&g_scratch);
+  for (int i = 0; i < g_args_cmd->argc; i++) {
+    if (!expand_template(g_args_cmd->argv[i], &g_args_cmd->templates[i], g_vars, &g_scratch))
+      exit(EXIT_FAILURE);
+  }
+  arena_release(&g_scratch, mark);
+}
+
+// Lookup and call of an internal command without redirection
+void bench_dispatch_builtin(void) {
+  char *argv[] = { "return", "3", NULL };
+  int redir[3] = { -2, -2, -2 };
+  if (call_command_and_wait(2, argv, redir) != 3) exit(EXIT_FAILURE);
+}
+
+// Same, with the output redirected (saved and restored around the command)
+void bench_dispatch_redir(void) {
+  char *argv[] = { "pwd", NULL };
+  int redir[3] = { -2, g_null_fd, -2 };
+  if (call_command_and_wait(1, argv, redir) != 0) exit(EXIT_FAILURE);
+}
+
+struct bench {
+  char *name;
+  void (*run)(void);
+};
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs `bench` enough times to last about 0.2s, and prints its results
+void measure(struct bench *bench) {
+  long iters = 1, i;
+  double start, elapsed;
+  size_t allocs, bytes;
+
+  for (i = 0; i < 1000; i++) bench->run(); // warm up
+  while (1) {
+    allocs = g_nb_allocs;
+    bytes = g_alloc_bytes;
+    start = now();
+    for (i = 0; i < iters; i++) bench->run();
+    elapsed = now() - start;
+    if (elapsed >= 0.2 || iters >= (1L << 40)) break;
+    // aim at 0.25s from the last measure, without growing too fast
+    long next = elapsed > 0 ? iters * 0.25 / elapsed : iters * 100;
+    iters = next > iters * 100 ? iters * 100 : next > iters ? next : iters * 2;
+  }
+  printf("{\"bench\":\"%s\",\"iters\":%ld,\"ns_per_op\":%.1f,"
+         "\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}\n",
+         bench->name, iters, elapsed * 1e9 / iters,
+         (double) (g_nb_allocs - allocs) / iters,
+         (double) (g_alloc_bytes - bytes) / iters);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench benches[] = {
+    { "parse_pipeline", bench_parse_pipeline },
+    { "parse_nested", bench_parse_nested },
+    { "parse_args", bench_parse_args },
+    { "replace_variables", bench_replace_variables },
+    { "expand_template", bench_expand_template },
+    { "dispatch_builtin", bench_dispatch_builtin },
+    { "dispatch_redir", bench_dispatch_redir },
+  };
+  char *filter = argc > 1 ? argv[1] : "";
+
+  setup();
+  for (size_t i = 0; i < sizeof(benches) / sizeof(struct bench); i++) {
+    if (strstr(benches[i].name, filter)) measure(&benches[i]);
+  }
+  return EXIT_SUCCESS;
+}
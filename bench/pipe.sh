@@ -0,0 +1,53 @@
+#!/bin/sh
+# Benchmark of the capacity of the pipes of fsh pipelines (FSH_PIPE_SIZE):
+# measures the throughput of `head -c SIZE /dev/zero | cat | ... | wc -c` with
+# different numbers of `cat` stages, for each capacity.
+#
+# Usage: bench/pipe.sh [FSH [MIB [STAGES...]]]
+# FSH is the shell to run (default ./fsh), MIB the amount of data in mebibytes
+# (default 1024), and STAGES the numbers of `cat` stages (default 1 2 4 8). The
+# capacities tested are in PIPE_SIZES (default "default 256K 1M auto"). Each
+# pipeline is run REPEAT times (default 3) in the same shell, so that the
+# automatic mode can adapt, and the mean throughput is printed in MiB/s.
+
+fsh=${1:-./fsh}
+mib=${2:-1024}
+[ $# -gt 2 ] && shift 2 || set -- 1 2 4 8
+sizes=${PIPE_SIZES:-default 256K 1M auto}
+repeat=${REPEAT:-3}
+
+now() {
+  date +%s%N
+}
+
+printf '%8s' stages
+for size in $sizes; do printf ' %10s' "$size"; done
+printf '\n'
+
+for stages in "$@"; do
+  # /bin/cat rather than cat, which is an internal command of fsh
+  line="head -c ${mib}M /dev/zero"
+  i=0
+  while [ $i -lt "$stages" ]; do
+    line="$line | /bin/cat"
+    i=$((i + 1))
+  done
+  line="$line | wc -c >| /dev/null"
+
+  printf '%8s' "$stages"
+  for size in $sizes; do
+    [ "$size" = default ] && size=
+    script=
+    i=0
+    while [ $i -lt "$repeat" ]; do
+      script="$script$line
+"
+      i=$((i + 1))
+    done
+    start=$(now)
+    printf '%s' "$script" | FSH_PIPE_SIZE=$size "$fsh" > /dev/null 2>&1
+    end=$(now)
+    printf ' %10d' $((mib * repeat * 1000000000 / (end - start)))
+  done
+  printf '\n'
+done
@@ -0,0 +1,100 @@
+/* Benchmark of the launch of external commands: compares the fork + execvp
+used by call_external_cmd before with posix_spawnp, for a shell whose heap has
+different sizes.
+
+Usage: spawn [COUNT [SIZE_MIB...]]
+Runs `true` COUNT times (default 200) with each method, after allocating and
+touching a heap of each SIZE_MIB mebibytes (default 0 64 256 1024), and prints
+the mean latency of a launch (from the start of the launch to the end of the
+wait) in microseconds.
+*/
+
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+char *g_argv[] = { "true", NULL };
+
+// The launch of call_external_cmd before posix_spawnp
+void launch_fork(void) {
+  int pid, status;
+  switch (pid = fork()) {
+    case -1:
+      perror("fork");
+      exit(EXIT_FAILURE);
+    case 0:
+      struct sigaction sa = { 0 };
+      sa.sa_handler = SIG_DFL;
+      sigaction(SIGTERM, &sa, NULL);
+      execvp(g_argv[0], g_argv);
+      exit(EXIT_FAILURE);
+    default:
+      waitpid(pid, &status, 0);
+  }
+}
+
+void launch_spawn(void) {
+  posix_spawnattr_t attr;
+  sigset_t sigdef;
+  int pid, status;
+
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigdef);
+  sigaddset(&sigdef, SIGTERM);
+  posix_spawnattr_setsigdefault(&attr, &sigdef);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+  if (posix_spawnp(&pid, g_argv[0], NULL, &attr, g_argv, environ) != 0) {
+    perror("posix_spawnp");
+    exit(EXIT_FAILURE);
+  }
+  posix_spawnattr_destroy(&attr);
+  waitpid(pid, &status, 0);
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Mean latency of a launch in microseconds
+double measure(void (*launch)(void), int count) {
+  double start = now();
+  for (int i = 0; i < count; i++) launch();
+  return (now() - start) / count * 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  int count = argc > 1 ? atoi(argv[1]) : 200;
+  char *default_sizes[] = { "0", "64", "256", "1024" };
+  char **sizes = argc > 2 ? argv + 2 : default_sizes;
+  int nb_sizes = argc > 2 ? argc - 2 : 4;
+
+  // Ignore SIGTERM like fsh does, so that both methods have to restore it
+  struct sigaction sa = { 0 };
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("%10s %12s %12s %8s\n", "heap (MiB)", "fork (us)", "spawn (us)", "speedup");
+  for (int i = 0; i < nb_sizes; i++) {
+    size_t size = strtoul(sizes[i], NULL, 10) << 20;
+    char *heap = size ? malloc(size) : NULL;
+    if (size && !heap) {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+    // Touch every page so that it is really mapped, as a long-lived heap is
+    if (heap) memset(heap, 1, size);
+
+    double fork_us = measure(launch_fork, count);
+    double spawn_us = measure(launch_spawn, count);
+    printf("%10s %12.1f %12.1f %7.1fx\n", sizes[i], fork_us, spawn_us, fork_us / spawn_us);
+    free(heap);
+  }
+  return EXIT_SUCCESS;
+}
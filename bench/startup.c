@@ -0,0 +1,64 @@
+/* Benchmark of the startup of the shell in its non-interactive modes: measures
+the latency from the launch of a shell to the end of its first command, for
+fsh and other shells.
+
+Usage: startup [COUNT [SHELL...]]
+Runs `SHELL -c 'cd .'` and `SHELL FILE`, where FILE is a script containing
+`cd .` (an internal command in every shell), COUNT times each (default 500),
+for each SHELL (default ./fsh, dash and bash), and prints the mean latency of
+a run in microseconds (launch with posix_spawnp, then wait).
+*/
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Mean latency of a run of argv in microseconds, or -1 if it can not be run
+double measure(char **argv, int count) {
+  int pid, status;
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0) return -1;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+  }
+  return (now() - start) / count * 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  int count = argc > 1 ? atoi(argv[1]) : 500;
+  char *default_shells[] = { "./fsh", "dash", "bash" };
+  char **shells = argc > 2 ? argv + 2 : default_shells;
+  int nb_shells = argc > 2 ? argc - 2 : 3;
+
+  char script[] = "/tmp/fsh-startup-XXXXXX";
+  int fd = mkstemp(script);
+  if (fd == -1 || write(fd, "cd .\n", 5) != 5) {
+    perror("mkstemp");
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  printf("%-12s %12s %12s\n", "shell", "-c (us)", "script (us)");
+  for (int i = 0; i < nb_shells; i++) {
+    double c_us = measure((char *[]) { shells[i], "-c", "cd .", NULL }, count);
+    double script_us = measure((char *[]) { shells[i], script, NULL }, count);
+    if (c_us < 0 || script_us < 0) {
+      printf("%-12s %12s %12s\n", shells[i], "failed", "failed");
+    } else {
+      printf("%-12s %12.1f %12.1f\n", shells[i], c_us, script_us);
+    }
+  }
+  unlink(script);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/* End-to-end benchmark of the recursive `for` loops of fsh against find, and
+fd if it is installed, doing the same work on a tree (made by bench/gentree.c).
+
+Usage: traverse DIR [JOBS [FSH]]
+Runs each scenario REPEAT times (environment variable, default 3) with each
+tool, and prints for each the number of entries handled, the mean time, the
+entries handled per second, the processes created per second (from the
+`processes` counter of /proc/stat, without the tool itself), and the peak RSS
+in KiB of the largest process of the tool (from wait4, which includes the
+descendants that it waited for). The scenarios are:
+  all     every entry, with a metadata request for each (`ftype`, or find
+          `-printf %M`, as fd can not do it, it only prints the paths)
+  ext     the regular files with the extension `c` (-e c -t f)
+  exec    the same files, with an external command run for each
+  exec-p  the same, with JOBS commands at once (default 4): -p JOBS, or find
+          with `xargs -P`
+Every command prints one line per entry, which are counted. FSH is the shell
+to measure (default ./fsh); the commands of find and fd are run with `sh -c`.
+*/
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_CAP 1024
+
+struct scenario {
+  char *name;
+  char *fsh; // formats of the commands, given DIR (and JOBS for exec-p)
+  char *find;
+  char *fd;
+};
+
+struct scenario g_scenarios[] = {
+  { "all", "for F in %s -r { ftype $F }",
+    "find %s -mindepth 1 -printf '%%M\\n'",
+    "%s -u . %s" },
+  { "ext", "for F in %s -r -e c -t f { ftype $F.c }",
+    "find %s -type f -name '*.c' -printf '%%M\\n'",
+    "%s -u -t f -e c . %s" },
+  { "exec", "for F in %s -r -e c -t f { /bin/echo $F.c }",
+    "find %s -type f -name '*.c' -exec /bin/echo {} \\;",
+    "%s -u -t f -e c -j 1 -x /bin/echo {} \\; . %s" },
+  { "exec-p", "for F in %s -r -e c -t f -p %d { /bin/echo $F.c }",
+    "find %s -type f -name '*.c' -print0 | xargs -0 -n 1 -P %d /bin/echo",
+    "%s -u -t f -e c -j %d -x /bin/echo {} \\; . %s" },
+};
+
+struct result {
+  long entries;
+  double seconds;
+  long forks;
+  long max_rss;
+};
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The number of processes created since the boot
+long nb_processes(void) {
+  char line[256];
+  long n = -1;
+  FILE *stat = fopen("/proc/stat", "r");
+  if (!stat) return -1;
+  while (fgets(line, sizeof(line), stat)) {
+    if (sscanf(line, "processes %ld", &n) == 1) break;
+  }
+  fclose(stat);
+  return n;
+}
+
+// Runs argv with its output counted in `res`, returns -1 if it failed
+int run(char **argv, struct result *res) {
+  int p[2], pid, status;
+  if (pipe(p) == -1) return -1;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, p[1], 1);
+  posix_spawn_file_actions_addclose(&actions, p[0]);
+  posix_spawn_file_actions_addclose(&actions, p[1]);
+
+  long forks = nb_processes();
+  double start = now();
+  int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(p[1]);
+  if (err) {
+    close(p[0]);
+    return -1;
+  }
+
+  char buf[64 * 1024];
+  ssize_t n;
+  while ((n = read(p[0], buf, sizeof(buf))) > 0) {
+    for (char *c = buf; (c = memchr(c, '\n', buf + n - c)); c++) res->entries++;
+  }
+  close(p[0]);
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) == -1) return -1;
+  res->seconds += now() - start;
+  res->forks += nb_processes() - forks - 1;
+  if (usage.ru_maxrss > res->max_rss) res->max_rss = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+void print_result(char *scenario, char *tool, struct result *res, int repeat) {
+  if (res->seconds <= 0) {
+    printf("%-8s %-6s %10s\n", scenario, tool, "failed");
+    return;
+  }
+  printf("%-8s %-6s %10ld %10.3f %12.0f %10.0f %10ld\n", scenario, tool,
+         res->entries / repeat, res->seconds / repeat,
+         res->entries / res->seconds, res->forks / res->seconds, res->max_rss);
+}
+
+// Measures the command `cmd`, ran with `sh -c` unless `fsh` is given
+void measure(char *scenario, char *tool, char *fsh, char *cmd, int repeat) {
+  struct result res = { 0 };
+  char *argv[] = { fsh ? fsh : "sh", "-c", cmd, NULL };
+  for (int i = 0; i < repeat; i++) {
+    if (run(argv, &res) == -1) {
+      res.seconds = 0;
+      break;
+    }
+  }
+  print_result(scenario, tool, &res, repeat);
+}
+
+// The path of fd, installed as `fdfind` by some distributions, or NULL
+char *find_fd(void) {
+  static char path[LINE_CAP];
+  char *names[] = { "fd", "fdfind" };
+  char *env = getenv("PATH");
+  if (!env) return NULL;
+  for (int i = 0; i < 2; i++) {
+    for (char *dir = env, *end; *dir; dir = *end ? end + 1 : end) {
+      end = strchrnul(dir, ':');
+      snprintf(path, sizeof(path), "%.*s/%s", (int) (end - dir), dir, names[i]);
+      if (access(path, X_OK) == 0) return path;
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    dprintf(2, "usage: traverse DIR [JOBS [FSH]]\n");
+    return EXIT_FAILURE;
+  }
+  char *dir = argv[1];
+  int jobs = argc > 2 ? atoi(argv[2]) : 4;
+  char *fsh = argc > 3 ? argv[3] : "./fsh";
+  char *repeat_env = getenv("REPEAT");
+  int repeat = repeat_env && atoi(repeat_env) > 0 ? atoi(repeat_env) : 3;
+  char *fd = find_fd();
+  char cmd[LINE_CAP];
+
+  printf("%-8s %-6s %10s %10s %12s %10s %10s\n", "scenario", "tool", "entries",
+         "seconds", "entries/s", "forks/s", "rss (KiB)");
+  for (size_t i = 0; i < sizeof(g_scenarios) / sizeof(struct scenario); i++) {
+    struct scenario *s = &g_scenarios[i];
+    int parallel = strcmp(s->name, "exec-p") == 0;
+
+    // parallel loops need the jobs first, see the formats
+    if (parallel) snprintf(cmd, sizeof(cmd), s->fsh, dir, jobs);
+    else snprintf(cmd, sizeof(cmd), s->fsh, dir);
+    measure(s->name, "fsh", fsh, cmd, repeat);
+
+    if (parallel) snprintf(cmd, sizeof(cmd), s->find, dir, jobs);
+    else snprintf(cmd, sizeof(cmd), s->find, dir);
+    measure(s->name, "find", NULL, cmd, repeat);
+
+    if (!fd) {
+      printf("%-8s %-6s %10s\n", s->name, "fd", "missing");
+      continue;
+    }
+    if (parallel) snprintf(cmd, sizeof(cmd), s->fd, fd, jobs, dir);
+    else snprintf(cmd, sizeof(cmd), s->fd, fd, dir);
+    measure(s->name, "fd", NULL, cmd, repeat);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+#ifndef FSH_ARENA_H
+#define FSH_ARENA_H
+
+#include <stddef.h>
+
+// Default size of the blocks of an arena
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  char data[];
+};
+
+// A zero-initialized `struct arena` is an empty arena, ready to be used
+struct arena {
+  struct arena_block *first;
+  struct arena_block *cur; // NULL before the first allocation
+  size_t pos; // position of the next allocation in `cur`
+};
+
+// A position in an arena, to free everything allocated after it at once
+struct arena_mark {
+  struct arena_block *block;
+  size_t pos;
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_zalloc(struct arena *arena, size_t size);
+struct arena_mark arena_mark(struct arena *arena);
+void arena_release(struct arena *arena, struct arena_mark mark);
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+
+#endif
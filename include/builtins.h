@@ -0,0 +1,14 @@
+#ifndef FSH_BUILTINS_H
+#define FSH_BUILTINS_H
+
+// Signature of the internal commands, and of the functions exported by the
+// shared objects loaded with `enable -f`
+typedef int (*cmd_func)(int argc, char **argv);
+
+int builtin_register(char *name, cmd_func func, void *handle);
+cmd_func builtin_lookup(char *name);
+int builtin_load(char *lib, char *name);
+int builtin_unload(char *name);
+void builtin_print(void);
+
+#endif
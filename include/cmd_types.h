@@ -1,11 +1,14 @@
 #ifndef FSH_TYPES
 #define FSH_TYPES
 
+#include <time.h>
+
 enum cmd_type {
   CMD_EMPTY, // MUST be number 0
   CMD_SIMPLE,
   CMD_IF_ELSE,
-  CMD_FOR
+  CMD_FOR,
+  CMD_TIME
 };
 
 enum redir_type {
@@ -18,7 +21,8 @@ enum redir_type {
 enum next_type {
   NEXT_NONE, // MUST be number 0
   NEXT_PIPE,
-  NEXT_SEMICOLON
+  NEXT_SEMICOLON,
+  NEXT_BACKGROUND // the pipeline ending with this command is run in background
 };
 
 struct cmd {
@@ -28,14 +32,32 @@ struct cmd {
   struct cmd *next; // only has meaning if next_type is not NEXT_NONE
 };
 
+// A piece of an argument: the value of the variable `var`, or if `var` is 0,
+// the `len` characters at `start`
+struct arg_segment {
+  char var;
+  int len;
+  char *start;
+};
+
+// An argument compiled into segments by the parser. An argument without
+// variables has no segments, and one that can not be compiled (see
+// compile_template) has -1 segments.
+struct arg_template {
+  int nb_segments;
+  struct arg_segment *segments;
+};
+
 struct cmd_simple {
   int argc;
   char **argv;
+  struct arg_template *templates; // one for each argument
   char *in;
   enum redir_type out_type;
   char *out; // only has meaning if out_type is not REDIR_NONE
   enum redir_type err_type;
   char *err; // only has meaning if err_type is not REDIR_NONE
+  struct arg_template redir_templates[3]; // for in, out and err
 };
 
 struct cmd_if_else {
@@ -44,15 +66,43 @@ struct cmd_if_else {
   struct cmd *cmd_else;
 };
 
+enum pred_type {
+  PRED_SIZE,
+  PRED_MTIME,
+  PRED_NEWER,
+  PRED_PERM,
+  PRED_USER
+};
+
+// A metadata predicate of a for loop, with the meaning it has in find (see
+// predicate.c)
+struct for_pred {
+  enum pred_type type;
+  int cmp; // -1, 0 or 1 for -N, N and +N (-perm: -MODE, MODE and /MODE)
+  long long value; // size in units, age in days, mode or uid
+  long long unit; // bytes per unit of -size
+  char *ref; // reference file of -newer
+  struct timespec time; // set by pred_prepare: the mtime of ref, or the
+                        // start of the loop for -mtime
+};
+
 struct cmd_for {
   char var_name;
-  char *dir_name;
+  int nb_dirs;
+  char **dir_names; // NULL-terminated
   int list_all;
   int recursive;
   char *filter_ext;
   char filter_type;
   int parallel;
+  int nb_preds;
+  struct for_pred *preds; // -size, -mtime, -newer, -perm and -user, all ANDed
   struct cmd *body;
 };
 
+struct cmd_time {
+  int per_stage; // -s
+  struct cmd *body; // the rest of the chain after `time`
+};
+
 #endif
@@ -1,6 +1,8 @@
 #ifndef FSH_CMD
 #define FSH_CMD
 
+int register_internal_commands(void);
 int call_command_and_wait(int argc, char **argv, int redir[3]);
+int call_command_last(int argc, char **argv, int redir[3]);
 
 #endif
@@ -0,0 +1,10 @@
+#ifndef FSH_COPY_H
+#define FSH_COPY_H
+
+// Size of the buffer of the read/write loop, when no system call can copy
+// between the two descriptors directly
+#define COPY_BUF_SIZE (128 * 1024)
+
+int copy_fd(int in, int out);
+
+#endif
@@ -1,8 +1,14 @@
 #ifndef FSH_DEBUG
 #define FSH_DEBUG
 
+#include <stdio.h>
+
 #include "cmd_types.h"
 
+void print_cmd_node(FILE *out, struct cmd *cmd);
+void print_cmd_full(FILE *out, struct cmd *cmd);
+void print_pipeline(FILE *out, struct cmd *cmd);
+void print_cmd_aux(FILE *out, struct cmd *cmd);
 void print_cmd(struct cmd *cmd);
 
 #endif
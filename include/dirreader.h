@@ -0,0 +1,43 @@
+#ifndef FSH_DIRREADER_H
+#define FSH_DIRREADER_H
+
+#include "cmd_types.h"
+
+// Size of the buffer used by the readers of the shell
+#define DIR_READER_BUF_SIZE (256 * 1024)
+
+// An entry of a directory, read in place in the buffer of a `struct dir_reader`
+struct dir_entry {
+  char *name; // points inside the buffer, only valid until the next read
+  int name_len;
+  unsigned char d_type;
+  int ext_match; // whether the name ends with `.EXT` (always 1 without -e)
+};
+
+struct dir_reader {
+  int fd;
+  char *buf;
+  int buf_size;
+  int pos;
+  int end;
+  long offset; // position of the next record in the directory (see d_off)
+  long nb_reads; // number of getdents64 calls, for statistics
+  long nb_entries; // entries read since the directory was opened
+  long nb_filtered; // entries skipped by -e since the directory was opened
+
+  // filters applied on the raw buffer
+  int list_all;
+  char *filter_ext;
+  int ext_len;
+  int keep_dirs; // directories must be kept even if they fail -e (for -r)
+  int resolve_types; // DT_UNKNOWN entries must be stat'ed (for -t and -r)
+};
+
+int dir_reader_init(struct dir_reader *reader, int buf_size, struct cmd_for *cmd_for);
+int dir_reader_open(struct dir_reader *reader, int dirfd, char *path);
+int dir_reader_next(struct dir_reader *reader, struct dir_entry *entry);
+int dir_reader_seek(struct dir_reader *reader, long offset);
+void dir_reader_close(struct dir_reader *reader);
+void dir_reader_free(struct dir_reader *reader);
+
+#endif
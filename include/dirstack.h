@@ -0,0 +1,44 @@
+#ifndef FSH_DIRSTACK_H
+#define FSH_DIRSTACK_H
+
+#include "arena.h"
+#include "cmd_types.h"
+#include "dirreader.h"
+
+// Default maximum number of directories kept open by a `struct dir_stack`,
+// can be overridden with FSH_MAX_DIR_FDS
+#define DIR_STACK_MAX_FDS 64
+
+struct dir_frame {
+  struct dir_reader reader; // its directory is closed if the frame was evicted
+  int path_len; // length of the path of the directory in the path buffer
+  int ext_match; // whether the directory itself passed -e
+};
+
+struct dir_stack {
+  struct dir_frame *frames;
+  int depth;
+  int cap;
+  int first_open; // frames below this index have their directory closed
+  int max_fds;
+
+  char **spare_bufs; // buffers of the closed frames, ready to be reused
+  int nb_spares;
+
+  // path of the current entry, built incrementally
+  char *path;
+  int path_len;
+  int path_cap;
+
+  struct dir_reader model; // filters copied in the reader of every frame
+  struct arena *arena; // where the frames, buffers and path are allocated
+};
+
+int dir_stack_init(struct dir_stack *stack, struct cmd_for *cmd_for, char *root,
+                   struct arena *arena);
+int dir_stack_next(struct dir_stack *stack, struct dir_entry *entry);
+int dir_stack_push(struct dir_stack *stack, int ext_match);
+int dir_stack_pop(struct dir_stack *stack);
+void dir_stack_close(struct dir_stack *stack);
+
+#endif
@@ -1,9 +1,22 @@
 #ifndef FSH_EXECUTION_H
 #define FSH_EXECUTION_H
 
+#include <sys/resource.h>
+
+#include "arena.h"
 #include "cmd_types.h"
 
+extern struct arena g_scratch;
+
+void raise_sigint();
+int max_or_neg(int a, int b);
 int wait_cmd(int pid);
+int wait_cmd_usage(int pid, struct rusage *usage);
+int same_type(char filter_type, char file_type);
+char *replace_variables(char *dependent_str, char **vars, struct arena *arena);
+char *expand_template(char *arg, struct arg_template *tpl, char **vars, struct arena *arena);
+int exec_chain(struct cmd *cmd_chain, char **vars, int last);
 int exec_cmd_chain(struct cmd *cmd_chain, char **vars);
+int exec_cmd_chain_last(struct cmd *cmd_chain, char **vars);
 
 #endif
@@ -7,6 +7,7 @@ extern char *g_cwd;
 extern char *g_prev_wd;
 extern char *g_home;
 extern int g_prev_ret_val;
+extern int g_interactive;
 extern volatile sig_atomic_t g_sig_received;
 
 #endif
@@ -0,0 +1,9 @@
+#ifndef FSH_JOBSERVER_H
+#define FSH_JOBSERVER_H
+
+void jobserver_init(void);
+int jobserver_fd(void);
+int jobserver_acquire(char *token);
+void jobserver_release(char token);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef FSH_LEXER_H
+#define FSH_LEXER_H
+
+#include "arena.h"
+
+enum token_kind {
+  TOK_WORD, // a word without quotes nor escapes, which can be a keyword
+  TOK_QUOTED, // a word with quotes or escapes, never a keyword nor an operator
+  TOK_PIPE, // |
+  TOK_SEMICOLON, // ;
+  TOK_AMPERSAND, // &
+  TOK_LBRACE, // {
+  TOK_RBRACE, // }
+  TOK_REDIR // <, >, >>, >|, 2>, 2>> or 2>|
+};
+
+struct token {
+  enum token_kind kind;
+  char *text; // without its quotes and escapes, null-terminated in the line
+  int start; // position of the token in the line, in bytes
+  int len; // length of the token in the line, quotes and escapes included
+  // For a word in which some `$` are quoted: whether the `$` at each position
+  // of the text starts a variable. NULL when every `$` of the text does.
+  char *var_mask;
+};
+
+struct token_list {
+  struct token *tokens;
+  int nb;
+  int cap;
+};
+
+int lex(char *line, struct arena *arena, struct token_list *out);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef FSH_METADATA_H
+#define FSH_METADATA_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Maximum number of requests handled by one call to meta_stat_batch
+#define META_BATCH_SIZE 64
+
+struct meta_request {
+  int dirfd;
+  const char *name; // relative to dirfd
+  struct statx stx;
+  int error; // 0 on success, the errno of statx otherwise
+};
+
+int meta_stat_batch(struct meta_request *reqs, int nb, unsigned int mask);
+void meta_thread_release(void);
+unsigned char meta_d_type(struct statx *stx);
+const char *meta_type_name(mode_t mode);
+
+#endif
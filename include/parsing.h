@@ -1,6 +1,7 @@
 #ifndef FSH_PARSING
 #define FSH_PARSING
 
+#include "arena.h"
 #include "cmd_types.h"
 
 #define ERROR_SYNTAX 2
@@ -8,7 +9,6 @@
 
 extern int parsing_errno;
 
-struct cmd *parse(char *line);
-void free_cmd(struct cmd *cmd);
+struct cmd *parse(char *line, struct arena *arena);
 
 #endif
@@ -0,0 +1,10 @@
+#ifndef FSH_PATHCACHE_H
+#define FSH_PATHCACHE_H
+
+char *path_find(char *name);
+char *path_cache_lookup(char *name);
+char *path_cache_refresh(char *name);
+void path_cache_clear(void);
+void path_cache_print(void);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef FSH_PIPESIZE_H
+#define FSH_PIPESIZE_H
+
+// Number of voluntary context switches of a stage of a pipeline above which
+// the automatic mode considers that it blocked often on its pipes
+#define PIPE_AUTO_SWITCHES 1024
+
+int pipe_size_get(void);
+int pipe_size_auto(void);
+void pipe_size_feedback(long switches);
+
+#endif
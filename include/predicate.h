@@ -0,0 +1,9 @@
+#ifndef FSH_PREDICATE_H
+#define FSH_PREDICATE_H
+
+#include "cmd_types.h"
+
+int pred_prepare(struct cmd_for *cmd_for);
+int pred_match(struct cmd_for *cmd_for, int dirfd, const char *name);
+
+#endif
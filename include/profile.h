@@ -0,0 +1,41 @@
+#ifndef FSH_PROFILE_H
+#define FSH_PROFILE_H
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "cmd_types.h"
+
+// The resources used by a node of the syntax tree, over all its executions
+struct profile_node {
+  struct cmd *cmd; // only valid while the line of the node is executed
+  int pipeline; // the node of a whole pipeline, whose first command is `cmd`
+  char *label;
+  long calls;
+  long forks;
+  double wall; // in seconds, including the nodes inside it
+  double cpu;
+  struct profile_node *parent;
+  struct profile_node *children;
+  struct profile_node *last_child;
+  struct profile_node *next_sibling;
+};
+
+// A node being executed
+struct profile_frame {
+  struct profile_node *node;
+  struct timespec start_time;
+  struct rusage start_usage;
+  long start_forks;
+};
+
+// Whether fsh was started with --profile
+extern int g_profile_on;
+
+void profile_init(char *folded_path);
+void profile_line(void);
+void profile_enter(struct profile_frame *frame, struct cmd *cmd, int pipeline);
+void profile_exit(struct profile_frame *frame);
+void profile_report(void);
+
+#endif
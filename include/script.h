@@ -0,0 +1,22 @@
+#ifndef FSH_SCRIPT_H
+#define FSH_SCRIPT_H
+
+#include <stddef.h>
+
+struct script {
+  char *start; // content of the script
+  char *cur; // start of what was not read yet
+  char *end;
+  size_t map_len; // if the content is mapped, the length of the mapping
+
+  char *line; // the last command returned by script_next
+  size_t line_cap;
+};
+
+int script_open_file(struct script *script, char *path);
+void script_open_string(struct script *script, char *str);
+char *script_next(struct script *script);
+int script_at_end(struct script *script);
+void script_close(struct script *script);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef FSH_STATS_H
+#define FSH_STATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+// Number of buckets of a histogram: 16 exact values, then 16 buckets for each
+// power of two up to 2^63 (see stats_bucket)
+#define STATS_BUCKETS (16 * 61)
+
+// A histogram of durations in nanoseconds, with a precision of 1/16
+struct stats_histogram {
+  long count;
+  long sum;
+  long max;
+  long buckets[STATS_BUCKETS];
+};
+
+// The counters of the shell since it started, or since `stats -r`
+struct stats {
+  long forks_base; // g_forks at the last reset
+  long spawns_base; // g_spawns at the last reset
+  long execs; // external commands replacing a process (see exec_external_cmd)
+  long spawn_failures;
+  long pipes;
+  long dir_entries; // entries read by the loops, before their filters
+  long filtered_ext; // entries skipped by -e
+  long filtered_type; // entries skipped by -t
+  long filtered_meta; // entries skipped by -size, -mtime, -newer, -perm or -user
+  long slot_waits; // waits for a slot of a parallel loop
+  long slot_wait_ns;
+  struct stats_histogram spawn_latency; // from the spawn to the exec
+  struct stats_histogram child_run; // from the creation of a child to its reaping
+};
+
+extern struct stats g_stats;
+// Processes created since the shell started, never reset (the profiler counts
+// the processes of each node with them): subshells (pipeline stages,
+// background jobs, parallel workers) and external commands started with
+// posix_spawn
+extern long g_forks;
+extern long g_spawns;
+
+// Adds `n` to a counter that the threads of the walker also update
+#define STATS_ADD(counter, n) __atomic_fetch_add(&g_stats.counter, n, __ATOMIC_RELAXED)
+
+long stats_now(void);
+void stats_record(struct stats_histogram *hist, long ns);
+void stats_print(FILE *out, int json);
+void stats_reset(void);
+void stats_init(void);
+void stats_dump(void);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef FSH_STRHASH_H
+#define FSH_STRHASH_H
+
+#include <stdint.h>
+
+uint32_t str_hash(char *str);
+
+#endif
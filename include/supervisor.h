@@ -0,0 +1,14 @@
+#ifndef FSH_SUPERVISOR_H
+#define FSH_SUPERVISOR_H
+
+#include <signal.h>
+
+int supervisor_add(int pid);
+int supervisor_wait_pid(int pid);
+int supervisor_wait_next(void);
+int supervisor_wait_all(void);
+int supervisor_has_jobs(void);
+void supervisor_notify(void);
+int supervisor_child_sigmask(sigset_t *mask);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef FSH_TIMING_H
+#define FSH_TIMING_H
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "cmd_types.h"
+
+// The resources used by the runs of a stage of the pipelines of `time -s`
+struct stage_usage {
+  struct cmd_simple *cmd;
+  long runs;
+  struct rusage usage;
+};
+
+// A `time` command being executed
+struct timing {
+  int per_stage; // -s
+  long max_rss; // peak RSS of the children reaped while timing, in KiB
+  struct timespec start_time;
+  struct rusage start_usage;
+  struct stage_usage *stages;
+  int nb_stages;
+  int cap;
+  struct timing *outer; // the enclosing `time`, if any
+};
+
+extern struct timing *g_timing;
+
+void timing_start(struct timing *timing, int per_stage);
+void timing_end(struct timing *timing);
+void timing_reaped(struct rusage *usage);
+void timing_snapshot(struct rusage *usage);
+void timing_add_stage(struct cmd *cmd, struct rusage *usage);
+void timing_stage_begin(struct rusage *before);
+void timing_stage_end(struct cmd *cmd, struct rusage *before);
+
+#endif
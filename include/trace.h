@@ -0,0 +1,27 @@
+#ifndef FSH_TRACE_H
+#define FSH_TRACE_H
+
+// Size of the buffer of events of each thread
+#define TRACE_BUF_SIZE (64 * 1024)
+
+// Whether FSH_TRACE is set: the events are only built after testing it, so
+// that tracing costs a single branch when it is disabled
+extern int g_trace_on;
+
+// Records an event of phase `ph` ('B' begin, 'E' end, 'i' instant) named
+// `name`, with an optional string argument `key` (or NULL)
+#define TRACE(ph, name, key, value) \
+  do { if (g_trace_on) trace_event(ph, name, key, value); } while (0)
+
+// Same as TRACE with an integer argument
+#define TRACE_INT(ph, name, key, value) \
+  do { if (g_trace_on) trace_event_int(ph, name, key, value); } while (0)
+
+void trace_init(void);
+void trace_event(char ph, char *name, char *key, char *value);
+void trace_event_int(char ph, char *name, char *key, long value);
+void trace_thread_name(char *name);
+void trace_flush(void);
+void trace_thread_exit(void);
+
+#endif
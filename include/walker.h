@@ -0,0 +1,18 @@
+#ifndef FSH_WALKER_H
+#define FSH_WALKER_H
+
+#include "cmd_types.h"
+
+// An entry found by the walker that passed the filters of the loop
+struct walk_entry {
+  char *path; // malloc'd, already amputated of its extension with -e
+  unsigned char d_type;
+};
+
+struct walker;
+
+struct walker *walker_start(struct cmd_for *cmd_for, char **roots, int nb_roots);
+int walker_next(struct walker *walker, struct walk_entry *entry);
+int walker_finish(struct walker *walker);
+
+#endif
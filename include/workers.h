@@ -0,0 +1,33 @@
+#ifndef FSH_WORKERS_H
+#define FSH_WORKERS_H
+
+#include "cmd_types.h"
+
+struct worker {
+  int pid;
+  int fd; // end of the socket pair on the side of the shell
+  int busy; // whether a job was sent and its result not read yet
+  int has_token; // whether the job holds a token of the jobserver
+  char token;
+};
+
+struct worker_pool {
+  struct worker *workers;
+  int nb_workers;
+  int cap;
+  int max;
+  int nb_busy;
+  int nb_tokens; // busy workers holding a token, the others use the implicit one
+
+  // what the workers execute
+  struct cmd *body;
+  char var_name;
+  char **vars;
+};
+
+void worker_pool_init(struct worker_pool *pool, int max, struct cmd *body,
+                      char var_name, char **vars);
+int worker_pool_run(struct worker_pool *pool, char *value);
+int worker_pool_finish(struct worker_pool *pool);
+
+#endif
@@ -0,0 +1,98 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* ARENA ALLOCATOR:
+Memory is allocated by moving forward in large blocks, and is never freed
+individually: everything allocated after a `struct arena_mark` is freed at once
+by moving back to that mark with arena_release, and arena_reset frees the whole
+arena. The blocks are kept in a list, and reused by the following allocations
+when the arena moves back, so that a loop that releases its allocations at the
+end of each iteration does not call malloc anymore after the first one.
+
+An allocation that does not fit in the rest of the current block goes to the
+next block of the list that is large enough (the blocks in between are skipped
+until the arena moves back before them), or to a new block inserted after the
+current one.
+*/
+
+// Alignment of the allocations, enough for any type
+#define ARENA_ALIGN 16
+
+
+/**
+ * Allocates `size` bytes in the arena. The memory is not initialized.
+ *
+ * @return a pointer to the memory, or NULL on allocation failure.
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+  size_t pos = (arena->pos + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (arena->cur && pos + size <= arena->cur->size) {
+    arena->pos = pos + size;
+    return arena->cur->data + pos;
+  }
+
+  struct arena_block *block = arena->cur ? arena->cur->next : arena->first;
+  while (block && block->size < size) block = block->next;
+  if (!block) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(struct arena_block) + block_size);
+    if (!block) return NULL;
+    block->size = block_size;
+    if (arena->cur) {
+      block->next = arena->cur->next;
+      arena->cur->next = block;
+    } else {
+      block->next = arena->first;
+      arena->first = block;
+    }
+  }
+  arena->cur = block;
+  arena->pos = size;
+  return block->data;
+}
+
+// Same as arena_alloc, but the memory is set to zero
+void *arena_zalloc(struct arena *arena, size_t size) {
+  void *ptr = arena_alloc(arena, size);
+  if (ptr) memset(ptr, 0, size);
+  return ptr;
+}
+
+// Returns the current position of the arena, see arena_release
+struct arena_mark arena_mark(struct arena *arena) {
+  return (struct arena_mark) { arena->cur, arena->pos };
+}
+
+/**
+ * Frees everything that was allocated in the arena since `mark` was taken, in
+ * constant time. The blocks are kept for the next allocations.
+ */
+void arena_release(struct arena *arena, struct arena_mark mark) {
+  arena->cur = mark.block;
+  arena->pos = mark.pos;
+}
+
+/**
+ * Frees everything that was allocated in the arena, and gives back to the
+ * system all its blocks but the first one.
+ */
+void arena_reset(struct arena *arena) {
+  if (arena->first) {
+    struct arena_block *block = arena->first->next, *next;
+    for (; block; block = next) {
+      next = block->next;
+      free(block);
+    }
+    arena->first->next = NULL;
+  }
+  arena->cur = NULL;
+  arena->pos = 0;
+}
+
+void arena_free(struct arena *arena) {
+  arena_reset(arena);
+  free(arena->first);
+  arena->first = NULL;
+}
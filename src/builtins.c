@@ -0,0 +1,143 @@
+#include "builtins.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strhash.h"
+
+/* BUILTIN REGISTRY:
+The internal commands are found by name in a hash table with chaining, instead
+of comparing the name of the command with each of them in turn. Besides the
+commands of commands.c, registered when the shell starts, the table can hold
+commands loaded from shared objects with `enable -f LIB NAME`: the function
+`cmd_NAME` of LIB, with the same signature as the internal commands (see
+`cmd_func`), is then executed in the shell like them, without any fork.
+
+There are few commands, so the number of buckets is fixed.
+*/
+
+#define BUILTIN_BUCKETS 128
+
+struct builtin {
+  char *name;
+  cmd_func func;
+  void *handle; // the shared object the command comes from, NULL if internal
+  uint32_t hash;
+  struct builtin *next;
+};
+
+struct builtin *g_builtins[BUILTIN_BUCKETS] = { 0 };
+
+
+// Returns the link to the entry of `name` in its bucket (which points to NULL
+// if there is none)
+struct builtin **builtin_find(char *name, uint32_t hash) {
+  struct builtin **link = &g_builtins[hash % BUILTIN_BUCKETS];
+  while (*link && ((*link)->hash != hash || strcmp((*link)->name, name) != 0))
+    link = &(*link)->next;
+  return link;
+}
+
+/**
+ * Adds the command `name`, replacing the previous command with that name if
+ * there is one. `handle` is the shared object that `func` comes from, or NULL
+ * for an internal command.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int builtin_register(char *name, cmd_func func, void *handle) {
+  uint32_t hash = str_hash(name);
+  struct builtin **link = builtin_find(name, hash);
+  struct builtin *builtin = *link;
+
+  if (builtin) {
+    if (builtin->handle) dlclose(builtin->handle);
+  } else {
+    builtin = malloc(sizeof(struct builtin));
+    if (builtin) builtin->name = strdup(name);
+    if (!builtin || !builtin->name) {
+      free(builtin);
+      return -1;
+    }
+    builtin->hash = hash;
+    builtin->next = NULL;
+    *link = builtin;
+  }
+  builtin->func = func;
+  builtin->handle = handle;
+  return 0;
+}
+
+// Returns the function of the command `name`, or NULL if it is not a builtin
+cmd_func builtin_lookup(char *name) {
+  struct builtin *builtin = *builtin_find(name, str_hash(name));
+  return builtin ? builtin->func : NULL;
+}
+
+/**
+ * Loads the command `name` from the shared object `lib`, which must export a
+ * function `cmd_NAME`. Internal commands can not be replaced.
+ *
+ * @return 0 on success, -1 on failure (after printing an error).
+ */
+int builtin_load(char *lib, char *name) {
+  struct builtin *builtin = *builtin_find(name, str_hash(name));
+  if (builtin && !builtin->handle) {
+    dprintf(2, "enable: %s: cannot replace an internal command\n", name);
+    return -1;
+  }
+
+  // dlopen counts the references to each shared object, so that every command
+  // can own a reference and close it independently
+  void *handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    dprintf(2, "enable: %s\n", dlerror());
+    return -1;
+  }
+  char symbol[strlen(name) + 5];
+  sprintf(symbol, "cmd_%s", name);
+  cmd_func func = (cmd_func) dlsym(handle, symbol);
+  if (!func) {
+    dprintf(2, "enable: %s: %s not found\n", lib, symbol);
+    dlclose(handle);
+    return -1;
+  }
+  if (builtin_register(name, func, handle) == -1) {
+    perror("enable");
+    dlclose(handle);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Removes the command `name`, which must have been loaded with builtin_load.
+ *
+ * @return 0 on success, -1 on failure (after printing an error).
+ */
+int builtin_unload(char *name) {
+  struct builtin **link = builtin_find(name, str_hash(name));
+  struct builtin *builtin = *link;
+  if (!builtin || !builtin->handle) {
+    dprintf(2, "enable: %s: not a loaded command\n", name);
+    return -1;
+  }
+  *link = builtin->next;
+  dlclose(builtin->handle);
+  free(builtin->name);
+  free(builtin);
+  return 0;
+}
+
+// Prints the name of every command, followed by `(loaded)` for the commands
+// that come from a shared object
+void builtin_print(void) {
+  struct builtin *builtin;
+  for (int i = 0; i < BUILTIN_BUCKETS; i++) {
+    for (builtin = g_builtins[i]; builtin; builtin = builtin->next) {
+      dprintf(1, "%s%s\n", builtin->name, builtin->handle ? " (loaded)" : "");
+    }
+  }
+}
@@ -1,7 +1,10 @@
 #include "commands.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,10 +13,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "builtins.h"
+#include "copy.h"
 #include "fsh.h"
 #include "execution.h"
-
-typedef int (*cmd_func)(int argc, char **argv);
+#include "metadata.h"
+#include "pathcache.h"
+#include "stats.h"
+#include "supervisor.h"
+#include "trace.h"
 
 /**
  * Internal command. Takes no argument, and prints on stdout the current
@@ -99,40 +107,45 @@ int cmd_cd(int argc, char **argv) {
 
 
 /**
- * Internal command. Takes a file reference, and prints its type.
+ * Internal command. Takes file references, and prints their type. With several
+ * references, each type is preceded by the reference, and the files are
+ * stat'ed all at once by the metadata engine.
  *
- * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if any reference is invalid.
  */
 int cmd_ftype(int argc, char **argv) {
-  if (argc != 2) {
-    dprintf(2, "ftype: this command takes exactly one argument\n");
+  if (argc < 2) {
+    dprintf(2, "ftype: this command takes at least one argument\n");
     return EXIT_FAILURE;
   }
 
-  struct stat sb;
-  if (lstat(argv[1], &sb) == -1) {
-    perror("ftype");
-    return EXIT_FAILURE;
-  }
+  int ret = EXIT_SUCCESS;
+  struct meta_request reqs[META_BATCH_SIZE];
+  for (int first = 1; first < argc; first += META_BATCH_SIZE) {
+    int nb = argc - first < META_BATCH_SIZE ? argc - first : META_BATCH_SIZE;
+    for (int i = 0; i < nb; i++) {
+      reqs[i].dirfd = AT_FDCWD;
+      reqs[i].name = argv[first + i];
+    }
+    if (meta_stat_batch(reqs, nb, STATX_TYPE) == -1) {
+      perror("ftype");
+      return EXIT_FAILURE;
+    }
 
-  switch(sb.st_mode & S_IFMT) {
-    case S_IFREG:
-      dprintf(1, "regular file\n");
-      break;
-    case S_IFDIR:
-      dprintf(1, "directory\n");
-      break;
-    case S_IFLNK:
-      dprintf(1, "symbolic link\n");
-      break;
-    case S_IFIFO:
-      dprintf(1, "named pipe\n");
-      break;
-    default:
-      dprintf(1, "other\n");
+    for (int i = 0; i < nb; i++) {
+      if (reqs[i].error) {
+        if (argc == 2) dprintf(2, "ftype: %s\n", strerror(reqs[i].error));
+        else dprintf(2, "ftype: %s: %s\n", argv[first + i], strerror(reqs[i].error));
+        ret = EXIT_FAILURE;
+      } else if (argc == 2) {
+        dprintf(1, "%s\n", meta_type_name(reqs[i].stx.stx_mode));
+      } else {
+        dprintf(1, "%s: %s\n", argv[first + i], meta_type_name(reqs[i].stx.stx_mode));
+      }
+    }
   }
 
-  return EXIT_SUCCESS;
+  return ret;
 }
 
 
@@ -206,6 +219,7 @@ int cmd_return(int argc, char **argv) {
     val = EXIT_SUCCESS;
   } else {
     char *endptr;
+    errno = 0;
     val = (int) strtol(argv[1], &endptr, 10);
     if (*endptr != '\0' || errno != 0 || val < 0 || val > 255) {
       dprintf(2, "return: invalid argument\n");
@@ -235,6 +249,7 @@ int cmd_umask(int argc, char **argv) {
   }
   if (argc == 2) {
     char *endptr;
+    errno = 0;
     mode_t new_umask = strtol(argv[1], &endptr, 8);
     if (*endptr != '\0' || errno != 0 || new_umask > 0777) {
       dprintf(2, "umask: invalid argument\n");
@@ -250,82 +265,1029 @@ int cmd_umask(int argc, char **argv) {
 
 
 /**
- * Executes an external command, using execvp, and forwarding to the command
+ * Internal command. Manages the cache of the paths of external commands:
+ * without arguments, prints its content; with `-r`, empties it; otherwise,
+ * looks for each argument in PATH and adds it to the cache.
+ *
+ * @return `EXIT_SUCCESS` on success, `EXIT_FAILURE` if a command was not found
+ */
+int cmd_hash(int argc, char **argv) {
+  if (argc == 1) {
+    path_cache_print();
+    return EXIT_SUCCESS;
+  }
+  if (strcmp(argv[1], "-r") == 0) {
+    if (argc > 2) {
+      dprintf(2, "hash: too many arguments\n");
+      return EXIT_FAILURE;
+    }
+    path_cache_clear();
+    return EXIT_SUCCESS;
+  }
+
+  int ret = EXIT_SUCCESS;
+  for (int i = 1; i < argc; i++) {
+    if (strchr(argv[i], '/')) continue; // paths are never looked up in PATH
+    if (!path_cache_lookup(argv[i])) {
+      dprintf(2, "hash: %s: not found\n", argv[i]);
+      ret = EXIT_FAILURE;
+    }
+  }
+  return ret;
+}
+
+
+/**
+ * Internal command. Manages the commands loaded from shared objects: without
+ * arguments, prints every internal command; with `-f LIB NAME...`, loads the
+ * commands NAME from LIB (the functions `cmd_NAME`); with `-d NAME...`,
+ * removes loaded commands.
+ *
+ * @return `EXIT_SUCCESS` on success, `EXIT_FAILURE` otherwise
+ */
+int cmd_enable(int argc, char **argv) {
+  if (argc == 1) {
+    builtin_print();
+    return EXIT_SUCCESS;
+  }
+
+  int ret = EXIT_SUCCESS, i;
+  if (strcmp(argv[1], "-f") == 0) {
+    if (argc < 4) {
+      dprintf(2, "enable: usage: enable -f LIB NAME...\n");
+      return EXIT_FAILURE;
+    }
+    for (i = 3; i < argc; i++) {
+      if (builtin_load(argv[2], argv[i]) == -1) ret = EXIT_FAILURE;
+    }
+  } else if (strcmp(argv[1], "-d") == 0) {
+    for (i = 2; i < argc; i++) {
+      if (builtin_unload(argv[i]) == -1) ret = EXIT_FAILURE;
+    }
+  } else {
+    dprintf(2, "enable: invalid option %s\n", argv[1]);
+    ret = EXIT_FAILURE;
+  }
+  return ret;
+}
+
+
+/**
+ * Internal command. Prints the statistics of the shell (see stats.c), as text
+ * or with `-j` as JSON, then resets them with `-r`.
+ *
+ * @return `EXIT_SUCCESS`, or `EXIT_FAILURE` on invalid usage
+ */
+int cmd_stats(int argc, char **argv) {
+  int json = 0, reset = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0) {
+      json = 1;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      reset = 1;
+    } else {
+      dprintf(2, "stats: usage: stats [-j] [-r]\n");
+      return EXIT_FAILURE;
+    }
+  }
+  stats_print(stdout, json);
+  if (reset) stats_reset();
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * Internal command. Waits for background jobs: without arguments, for all of
+ * them; with `-n`, for the next one to terminate; otherwise, for each of the
+ * jobs whose pid is given.
+ *
+ * @return 0 without arguments, the exit status of the (last) job waited for
+ *         otherwise (127 if there was none), or -1 if interrupted by SIGINT
+ */
+int cmd_wait(int argc, char **argv) {
+  if (argc == 1) return supervisor_wait_all();
+  if (strcmp(argv[1], "-n") == 0) {
+    if (argc > 2) {
+      dprintf(2, "wait: too many arguments\n");
+      return EXIT_FAILURE;
+    }
+    return supervisor_wait_next();
+  }
+
+  int ret = EXIT_SUCCESS;
+  for (int i = 1; i < argc && ret != -1; i++) {
+    char *end;
+    errno = 0;
+    long pid = strtol(argv[i], &end, 10);
+    if (errno || *end || pid <= 0 || pid > INT_MAX) {
+      dprintf(2, "wait: %s: not a pid\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    ret = supervisor_wait_pid(pid);
+    if (ret == 127) dprintf(2, "wait: %s: not a job of this shell\n", argv[i]);
+  }
+  return ret;
+}
+
+
+/**
+ * Internal command. Does nothing, successfully.
+ *
+ * @return EXIT_SUCCESS
+ */
+int cmd_true(int argc, char **argv) {
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Internal command. Does nothing, unsuccessfully.
+ *
+ * @return EXIT_FAILURE
+ */
+int cmd_false(int argc, char **argv) {
+  return EXIT_FAILURE;
+}
+
+
+// State of the evaluation of the expression of `test`
+struct test_state {
+  char *name; // `test` or `[`, for the error messages
+  char **argv;
+  int pos; // the next argument to evaluate
+  int end;
+  int error; // whether the expression is invalid, which gives the status 2
+};
+
+// Prints an error about the expression of `test`, which fails with 2
+int test_error(struct test_state *st, char *msg, char *arg) {
+  if (!st->error) {
+    if (arg) dprintf(2, "%s: %s: %s\n", st->name, arg, msg);
+    else dprintf(2, "%s: %s\n", st->name, msg);
+  }
+  st->error = 1;
+  return 0;
+}
+
+// Whether `op` is a unary operator of `test`
+int test_is_unary(char *op) {
+  return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghLnprsStuwxzk", op[1]);
+}
+
+// Whether `op` is a binary operator of `test`, other than -a and -o
+int test_is_binary(char *op) {
+  char *ops[] = { "=", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                  "-nt", "-ot", "-ef" };
+  for (size_t i = 0; i < sizeof(ops) / sizeof(char *); i++) {
+    if (strcmp(op, ops[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+// Converts the integer operand `arg`, which can be surrounded by blanks
+int test_integer(struct test_state *st, char *arg, long long *val) {
+  char *end;
+  errno = 0;
+  *val = strtoll(arg, &end, 10);
+  while (*end == ' ' || *end == '\t') end++;
+  if (end == arg || *end || errno) return test_error(st, "integer expression expected", arg);
+  return 1;
+}
+
+// Evaluates the file test `-op path`, with at most one system call
+int test_file(struct test_state *st, char op, char *path) {
+  struct stat sb;
+  long long fd;
+  switch (op) {
+    case 'r': return faccessat(AT_FDCWD, path, R_OK, AT_EACCESS) == 0;
+    case 'w': return faccessat(AT_FDCWD, path, W_OK, AT_EACCESS) == 0;
+    case 'x': return faccessat(AT_FDCWD, path, X_OK, AT_EACCESS) == 0;
+    case 't': return test_integer(st, path, &fd) && fd >= 0 && fd <= INT_MAX && isatty(fd);
+  }
+
+  int flags = op == 'h' || op == 'L' ? AT_SYMLINK_NOFOLLOW : 0;
+  if (fstatat(AT_FDCWD, path, &sb, flags) == -1) return 0;
+  switch (op) {
+    case 'b': return S_ISBLK(sb.st_mode);
+    case 'c': return S_ISCHR(sb.st_mode);
+    case 'd': return S_ISDIR(sb.st_mode);
+    case 'f': return S_ISREG(sb.st_mode);
+    case 'h':
+    case 'L': return S_ISLNK(sb.st_mode);
+    case 'p': return S_ISFIFO(sb.st_mode);
+    case 'S': return S_ISSOCK(sb.st_mode);
+    case 'g': return (sb.st_mode & S_ISGID) != 0;
+    case 'u': return (sb.st_mode & S_ISUID) != 0;
+    case 'k': return (sb.st_mode & S_ISVTX) != 0;
+    case 's': return sb.st_size > 0;
+    default: return 1; // -e
+  }
+}
+
+// Evaluates the unary expression `op arg`
+int test_unary(struct test_state *st, char *op, char *arg) {
+  if (op[1] == 'n') return arg[0] != '\0';
+  if (op[1] == 'z') return arg[0] == '\0';
+  return test_file(st, op[1], arg);
+}
+
+// Compares the modification times of `a` and `b`, of which a missing file is
+// the oldest
+// @return < 0, 0 or > 0 if `a` is older, as old or newer than `b`
+int test_compare_mtime(char *a, char *b) {
+  struct stat sa, sb;
+  int has_a = stat(a, &sa) == 0, has_b = stat(b, &sb) == 0;
+  if (!has_a || !has_b) return has_a - has_b;
+  if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec)
+    return sa.st_mtim.tv_sec < sb.st_mtim.tv_sec ? -1 : 1;
+  return (sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec) - (sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec);
+}
+
+// Evaluates the binary expression `a op b`
+int test_binary(struct test_state *st, char *a, char *op, char *b) {
+  if (strcmp(op, "=") == 0) return strcmp(a, b) == 0;
+  if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+  if (strcmp(op, "<") == 0) return strcoll(a, b) < 0;
+  if (strcmp(op, ">") == 0) return strcoll(a, b) > 0;
+  if (strcmp(op, "-a") == 0) return a[0] && b[0];
+  if (strcmp(op, "-o") == 0) return a[0] || b[0];
+  if (strcmp(op, "-nt") == 0) return test_compare_mtime(a, b) > 0;
+  if (strcmp(op, "-ot") == 0) return test_compare_mtime(a, b) < 0;
+  if (strcmp(op, "-ef") == 0) {
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev &&
+           sa.st_ino == sb.st_ino;
+  }
+
+  long long x, y;
+  if (!test_integer(st, a, &x) || !test_integer(st, b, &y)) return 0;
+  switch (op[1] << 8 | op[2]) {
+    case 'e' << 8 | 'q': return x == y;
+    case 'n' << 8 | 'e': return x != y;
+    case 'l' << 8 | 't': return x < y;
+    case 'l' << 8 | 'e': return x <= y;
+    case 'g' << 8 | 't': return x > y;
+    default: return x >= y; // -ge
+  }
+}
+
+int test_or(struct test_state *st);
+
+// primary: ( or-expression ), a unary or binary expression, or a string
+int test_primary(struct test_state *st) {
+  char **argv = st->argv;
+  int left = st->end - st->pos, i = st->pos, ret;
+  if (left <= 0) return test_error(st, "argument expected", NULL);
+
+  if (left >= 3 && test_is_binary(argv[i + 1])) {
+    st->pos += 3;
+    return test_binary(st, argv[i], argv[i + 1], argv[i + 2]);
+  }
+  if (strcmp(argv[i], "(") == 0) {
+    st->pos++;
+    ret = test_or(st);
+    if (st->pos >= st->end || strcmp(argv[st->pos], ")") != 0)
+      return test_error(st, "missing )", NULL);
+    st->pos++;
+    return ret;
+  }
+  if (left >= 2 && test_is_unary(argv[i])) {
+    st->pos += 2;
+    return test_unary(st, argv[i], argv[i + 1]);
+  }
+  st->pos++;
+  return argv[i][0] != '\0';
+}
+
+// not-expression: ! not-expression, or a primary
+int test_not(struct test_state *st) {
+  if (st->pos < st->end && strcmp(st->argv[st->pos], "!") == 0) {
+    st->pos++;
+    return !test_not(st);
+  }
+  return test_primary(st);
+}
+
+// and-expression: not-expression [-a not-expression]...
+int test_and(struct test_state *st) {
+  int ret = test_not(st);
+  while (st->pos < st->end && strcmp(st->argv[st->pos], "-a") == 0) {
+    st->pos++;
+    ret = test_not(st) && ret;
+  }
+  return ret;
+}
+
+// or-expression: and-expression [-o and-expression]...
+int test_or(struct test_state *st) {
+  int ret = test_and(st);
+  while (st->pos < st->end && strcmp(st->argv[st->pos], "-o") == 0) {
+    st->pos++;
+    ret = test_and(st) || ret;
+  }
+  return ret;
+}
+
+/**
+ * Evaluates the `n` arguments of `test` from st->pos. Up to 4 arguments, the
+ * meaning of the expression only depends on their number, as POSIX specifies
+ * (`test -n` is a non-empty string, `test ! = x` compares `!`); beyond, it is
+ * parsed with the precedence of `!`, `-a` and `-o`.
+ *
+ * @return whether the expression is true, st->error is set if it is invalid.
+ */
+int test_eval(struct test_state *st, int n) {
+  char **argv = st->argv + st->pos;
+  int ret;
+  switch (n) {
+    case 0:
+      return 0;
+    case 1:
+      st->pos++;
+      return argv[0][0] != '\0';
+    case 2:
+      if (strcmp(argv[0], "!") == 0) {
+        st->pos++;
+        return !test_eval(st, 1);
+      }
+      if (!test_is_unary(argv[0])) return test_error(st, "unary operator expected", argv[0]);
+      st->pos += 2;
+      return test_unary(st, argv[0], argv[1]);
+    case 3:
+      if (test_is_binary(argv[1]) || strcmp(argv[1], "-a") == 0 || strcmp(argv[1], "-o") == 0) {
+        st->pos += 3;
+        return test_binary(st, argv[0], argv[1], argv[2]);
+      }
+      if (strcmp(argv[0], "!") == 0) {
+        st->pos++;
+        return !test_eval(st, 2);
+      }
+      if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0) {
+        st->pos++;
+        ret = test_eval(st, 1);
+        st->pos++;
+        return ret;
+      }
+      return test_error(st, "binary operator expected", argv[1]);
+    case 4:
+      if (strcmp(argv[0], "!") == 0) {
+        st->pos++;
+        return !test_eval(st, 3);
+      }
+      if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0) {
+        st->pos++;
+        ret = test_eval(st, 2);
+        st->pos++;
+        return ret;
+      }
+      // fall through
+    default:
+      ret = test_or(st);
+      if (st->pos < st->end) return test_error(st, "unexpected argument", st->argv[st->pos]);
+      return ret;
+  }
+}
+
+/**
+ * Internal command. Evaluates the expression of `test` (or `[ ... ]`, whose
+ * last argument must be `]`) as POSIX specifies: file tests (-e, -f, -d, -s,
+ * -r, ...), string (=, !=, <, >, -n, -z) and integer (-eq, -lt, ...)
+ * comparisons, -nt, -ot and -ef, combined with !, -a, -o and parentheses.
+ * Every file test costs a single fstatat (or faccessat for -r, -w and -x), so
+ * that `if test -f $F` in a loop body never forks.
+ *
+ * @return 0 if the expression is true, 1 if it is false, 2 if it is invalid
+ */
+int cmd_test(int argc, char **argv) {
+  struct test_state st = { argv[0], argv, 1, argc, 0 };
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      dprintf(2, "[: missing ]\n");
+      return 2;
+    }
+    st.end--;
+  }
+  int ret = test_eval(&st, st.end - st.pos);
+  if (st.error) return 2;
+  return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Prints on `out` the character of the escape sequence `s` (after its `\`),
+ * of echo -e, printf %b, or with `in_format` of the format of printf, where
+ * octal values do not start with 0 (`\101` instead of `\0101`).
+ *
+ * @return the number of characters of the sequence after the `\`, or -1 for
+ *         `\c`, after which nothing more must be printed.
+ */
+int print_escape(FILE *out, char *s, int in_format) {
+  char *escapes = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+  char *found = s[0] ? strchr(escapes, s[0]) : NULL;
+  if (found && (found - escapes) % 2 == 0) {
+    fputc(found[1], out);
+    return 1;
+  }
+  if (s[0] == 'c') return -1;
+
+  int first = in_format ? 0 : 1; // the leading 0 of \0ooo
+  if (in_format ? s[0] >= '0' && s[0] <= '7' : s[0] == '0') {
+    int i, c = 0;
+    for (i = first; i < first + 3 && s[i] >= '0' && s[i] <= '7'; i++) c = c * 8 + s[i] - '0';
+    fputc(c, out);
+    return i;
+  }
+  fputc('\\', out); // not an escape sequence
+  return 0;
+}
+
+/**
+ * Internal command. Prints its arguments on stdout separated by spaces and
+ * followed by a newline, like the echo of GNU coreutils that was executed
+ * before: leading options -n (no newline), -e (interpret the escapes, see
+ * print_escape) and -E (do not) are recognized, in any combination.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if stdout could not be written.
+ */
+int cmd_echo(int argc, char **argv) {
+  int newline = 1, escapes = 0, i, j, n;
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+    for (j = 1; argv[i][j]; j++) {
+      if (argv[i][j] == 'n') newline = 0;
+      else escapes = argv[i][j] == 'e';
+    }
+  }
+
+  for (; i < argc; i++) {
+    if (!escapes) {
+      fputs(argv[i], stdout);
+    } else {
+      for (char *s = argv[i]; *s; s++) {
+        if (*s != '\\') {
+          putchar(*s);
+        } else if ((n = print_escape(stdout, s + 1, 0)) == -1) {
+          newline = 0;
+          i = argc;
+          break;
+        } else {
+          s += n;
+        }
+      }
+    }
+    if (i < argc - 1) putchar(' ');
+  }
+  if (newline) putchar('\n');
+
+  if (fflush(stdout) == EOF) {
+    perror("echo");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+
+// The arguments of printf, consumed by the conversions of the format
+struct printf_args {
+  char **argv;
+  int nb;
+  int next;
+  int ret; // EXIT_FAILURE once an argument was not a valid number
+};
+
+// The next argument, or "" if there is none left
+char *printf_next(struct printf_args *args) {
+  return args->next < args->nb ? args->argv[args->next++] : "";
+}
+
+// Converts the next argument to a number, as C constants or 'c for the code of
+// the character c
+long long printf_number(struct printf_args *args, int is_unsigned) {
+  char *arg = printf_next(args), *end;
+  if (arg[0] == '\'' || arg[0] == '"') return (unsigned char) arg[1];
+  if (!arg[0]) return 0;
+  errno = 0;
+  long long val = is_unsigned ? (long long) strtoull(arg, &end, 0) : strtoll(arg, &end, 0);
+  if (*end || errno) {
+    dprintf(2, "printf: %s: %s\n", arg, errno ? strerror(errno) : "invalid number");
+    args->ret = EXIT_FAILURE;
+  }
+  return val;
+}
+
+// Converts the next argument to a floating point number
+double printf_double(struct printf_args *args) {
+  char *arg = printf_next(args), *end;
+  if (arg[0] == '\'' || arg[0] == '"') return (unsigned char) arg[1];
+  if (!arg[0]) return 0;
+  errno = 0;
+  double val = strtod(arg, &end);
+  if (*end || errno) {
+    dprintf(2, "printf: %s: %s\n", arg, errno ? strerror(errno) : "invalid number");
+    args->ret = EXIT_FAILURE;
+  }
+  return val;
+}
+
+// Prints the next argument with the escapes of %b, and the flags, width and
+// precision of `spec` (which ends with `s`)
+// @return 0, or -1 if the argument contains `\c`
+int printf_b(char *spec, struct printf_args *args, int width, int prec) {
+  char *arg = printf_next(args), *s;
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  if (!out) {
+    perror("printf");
+    return -1;
+  }
+  int n, stop = 0;
+  for (s = arg; *s && !stop; s++) {
+    if (*s != '\\') fputc(*s, out);
+    else if ((n = print_escape(out, s + 1, 0)) == -1) stop = 1;
+    else s += n;
+  }
+  fclose(out);
+  printf(spec, width, prec, buf);
+  free(buf);
+  return stop ? -1 : 0;
+}
+
+/**
+ * Prints the format once on stdout, converting the arguments from args->next.
+ *
+ * @return 1 if the output must stop (`\c`, or an invalid conversion), 0
+ *         otherwise.
+ */
+int printf_format(char *format, struct printf_args *args) {
+  char spec[32], *f = format;
+  int n;
+  while (*f) {
+    if (*f == '\\') {
+      if ((n = print_escape(stdout, f + 1, 1)) == -1) return 1;
+      f += n + 1;
+      continue;
+    }
+    if (*f != '%') {
+      putchar(*f++);
+      continue;
+    }
+    if (f[1] == '%') {
+      putchar('%');
+      f += 2;
+      continue;
+    }
+
+    // copy the flags of the conversion, with * for the width and precision
+    char *start = f++;
+    int width = 0, prec = -1;
+    f += strspn(f, "-+ #0");
+    if (*f == '*') {
+      width = printf_number(args, 0);
+      f++;
+    } else {
+      width = strtol(f, &f, 10);
+    }
+    if (*f == '.') {
+      f++;
+      if (*f == '*') {
+        prec = printf_number(args, 0);
+        f++;
+      } else {
+        prec = strtol(f, &f, 10);
+      }
+    }
+    int flags_len = strspn(start + 1, "-+ #0");
+    if (flags_len > 8 || !*f) {
+      dprintf(2, "printf: %s: invalid conversion\n", start);
+      return 1;
+    }
+    char conv = *f++;
+    // width and precision are always given as arguments of the C printf
+    n = sprintf(spec, "%%%.*s*.*", flags_len, start + 1);
+
+    switch (conv) {
+      case 'd':
+      case 'i':
+        sprintf(spec + n, "ll%c", conv);
+        printf(spec, width, prec, printf_number(args, 0));
+        break;
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        sprintf(spec + n, "ll%c", conv);
+        printf(spec, width, prec, (unsigned long long) printf_number(args, 1));
+        break;
+      case 'a': case 'A': case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+        sprintf(spec + n, "%c", conv);
+        printf(spec, width, prec, printf_double(args));
+        break;
+      case 'c': {
+        char c[2] = { printf_next(args)[0], '\0' };
+        sprintf(spec + n, "s");
+        printf(spec, width, -1, c);
+        break;
+      }
+      case 's':
+        sprintf(spec + n, "s");
+        printf(spec, width, prec, printf_next(args));
+        break;
+      case 'b':
+        sprintf(spec + n, "s");
+        if (printf_b(spec, args, width, prec) == -1) return 1;
+        break;
+      default:
+        dprintf(2, "printf: %%%c: invalid conversion\n", conv);
+        args->ret = EXIT_FAILURE;
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Internal command. Prints its arguments on stdout according to the format
+ * given as first argument, as POSIX specifies: the escapes of the format and
+ * the conversions %d, %i, %o, %u, %x, %X, %c, %s, %b (the argument with the
+ * escapes of echo -e), the floating point ones and %%, with flags, width and
+ * precision (possibly `*`). The format is reused while arguments remain.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if an argument was not a number, a
+ *         conversion is invalid or stdout could not be written.
+ */
+int cmd_printf(int argc, char **argv) {
+  if (argc < 2) {
+    dprintf(2, "printf: usage: printf FORMAT [ARGUMENT...]\n");
+    return EXIT_FAILURE;
+  }
+  struct printf_args args = { argv + 2, argc - 2, 0, EXIT_SUCCESS };
+  int prev;
+  do {
+    prev = args.next;
+    if (printf_format(argv[1], &args)) break;
+  } while (args.next < args.nb && args.next > prev);
+
+  if (fflush(stdout) == EOF) {
+    perror("printf");
+    return EXIT_FAILURE;
+  }
+  return args.ret;
+}
+
+
+// Fills `sh_argv` (argc + 2 elements) to run the file `path`, that the kernel
+// refused to execute (ENOEXEC: it has no #! line), as a script of /bin/sh, like
+// execvp does
+void sh_script_argv(char **sh_argv, char *path, int argc, char **argv) {
+  sh_argv[0] = "sh";
+  sh_argv[1] = path;
+  memcpy(sh_argv + 2, argv + 1, argc * sizeof(char *)); // NULL included
+}
+
+/**
+ * Executes an external command, using posix_spawn with its path from the PATH
+ * cache (see pathcache.c) or else posix_spawnp, and forwarding to the command
  * the arguments in argv.
  *
- * Also performs the necessary redirections so that the fd i refers to
- * redir[i], for each i in {0, 1, 2}
+ * Instead of a full fork of the shell, whose cost grows with the size of its
+ * memory, the child shares the memory of the shell until it calls exec (glibc
+ * uses clone with CLONE_VM and CLONE_VFORK). Everything the child used to do
+ * between fork and exec is thus described beforehand: the redirections, so
+ * that the fd i refers to redir[i] for each i in {0, 1, 2}, are file actions,
+ * and the default behaviour regarding SIGTERM (and the signal mask, if the
+ * child supervisor changed it) is restored with attributes.
+ *
+ * Unlike execvp, posix_spawn does not run the files without #! line with sh:
+ * such a file is spawned again as a script of /bin/sh.
  *
  * @return the return code of the command, or -1 if it was terminated by a
  *         signal
  */
 int call_external_cmd(int argc, char **argv, int redir[3]) {
-  int pid, i;
-  switch (pid = fork()) {
-    case -1:
-      perror("fork");
-      return EXIT_FAILURE;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigdef, sigmask;
+  int pid, i, err, flags = POSIX_SPAWN_SETSIGDEF;
+
+  posix_spawn_file_actions_init(&actions);
+  for (i = 0; i < 3; i++) {
+    if (redir[i] != -2) {
+      posix_spawn_file_actions_adddup2(&actions, redir[i], i);
+      if (redir[i] != i) posix_spawn_file_actions_addclose(&actions, redir[i]);
+    }
+  }
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigdef);
+  sigaddset(&sigdef, SIGTERM);
+  posix_spawnattr_setsigdefault(&attr, &sigdef);
+  if (supervisor_child_sigmask(&sigmask)) {
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    flags |= POSIX_SPAWN_SETSIGMASK;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  // Execute the cached path directly, or let posix_spawnp search PATH for the
+  // commands that can not be cached
+  TRACE('B', "spawn", "cmd", argv[0]);
+  // with CLONE_VFORK, posix_spawn returns once the child has called exec
+  long start = stats_now();
+  char *path = path_cache_lookup(argv[0]);
+  if (path) {
+    err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    if (err == ENOENT && (path = path_cache_refresh(argv[0]))) {
+      // The cached binary disappeared, but there is another one in PATH
+      err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    }
+  } else {
+    err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+  }
+  if (err == ENOEXEC) {
+    // without a cached path, find the file that posix_spawnp executed, maybe
+    // through a relative directory of PATH
+    char *found = path || strchr(argv[0], '/') ? NULL : path_find(argv[0]);
+    char *sh_argv[argc + 2];
+    sh_script_argv(sh_argv, path ? path : found ? found : argv[0], argc, argv);
+    err = posix_spawn(&pid, "/bin/sh", &actions, &attr, sh_argv, environ);
+    free(found);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  TRACE_INT('E', "spawn", "pid", err ? -1 : pid);
+
+  int ret;
+  switch (err) {
     case 0:
-      // Restore the default behaviour regarding SIGTERM
-      struct sigaction sa = { 0 };
-      sa.sa_handler = SIG_DFL;
-      sigaction(SIGTERM, &sa, NULL);
-      for (i = 0; i < 3; i++) {
-        if (redir[i] != -2) {
-          if (dup2(redir[i], i) == -1) {
-            perror("dup2");
-            exit(EXIT_FAILURE);
-          }
-          close(redir[i]);
-        }
-      }
-      execvp(argv[0], argv);
-      // We are in the child process, so we have to immediately exit if
-      // something goes wrong, otherwise there will be an additional child `fsh`
-      // process every time we enter a non-existent command
-      dprintf(2, "fsh: unknown command %s\n", argv[0]);
-      exit(EXIT_FAILURE);
+      g_spawns++;
+      stats_record(&g_stats.spawn_latency, stats_now() - start);
+      ret = wait_cmd(pid);
+      stats_record(&g_stats.child_run, stats_now() - start);
+      return ret;
+    case EAGAIN:
+    case ENOMEM:
+      g_stats.spawn_failures++;
+      errno = err;
+      perror("posix_spawnp");
+      return EXIT_FAILURE;
     default:
-      return wait_cmd(pid);
+      // The command could not be executed, like when execvp failed in the
+      // child of the fork that was used before
+      g_stats.spawn_failures++;
+      dprintf(2, "fsh: unknown command %s\n", argv[0]);
+      return EXIT_FAILURE;
+  }
+}
+
+
+// Whether the arguments of `cat` or `cp` contain an option, that the internal
+// commands do not implement
+int has_option(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && argv[i][1] != '\0') return 1;
+  }
+  return 0;
+}
+
+/**
+ * Copies `in` to `out` with copy_fd, with SIGPIPE ignored: the shell itself
+ * must not be killed when the reader of a pipe is gone.
+ *
+ * @return the same as copy_fd.
+ */
+int copy_fd_nosigpipe(int in, int out) {
+  struct sigaction sa = { 0 }, old;
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, &old);
+  int ret = copy_fd(in, out);
+  int err = errno;
+  sigaction(SIGPIPE, &old, NULL);
+  errno = err;
+  return ret;
+}
+
+/**
+ * Internal command. Prints the content of the files given in argument, or of
+ * stdin if there is none or for `-`, on stdout, without copying it through a
+ * buffer of the shell when possible (see copy.c). With options, the external
+ * `cat` is executed instead.
+ *
+ * @return `EXIT_SUCCESS` on success, `EXIT_FAILURE` if a file could not be
+ *         printed, `128 + SIGPIPE` if stdout was closed
+ */
+int cmd_cat(int argc, char **argv) {
+  if (has_option(argc, argv)) return call_external_cmd(argc, argv, (int[]) { -2, -2, -2 });
+
+  char *stdin_name[] = { "-" };
+  char **names = argc > 1 ? argv + 1 : stdin_name;
+  int nb_names = argc > 1 ? argc - 1 : 1;
+  int ret = EXIT_SUCCESS, fd, i;
+  struct stat in_st, out_st;
+  int out_regular = fstat(1, &out_st) == 0 && S_ISREG(out_st.st_mode);
+
+  for (i = 0; i < nb_names && !g_sig_received; i++) {
+    fd = strcmp(names[i], "-") == 0 ? 0 : open(names[i], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      dprintf(2, "cat: %s: %s\n", names[i], strerror(errno));
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    if (out_regular && fstat(fd, &in_st) == 0 && in_st.st_dev == out_st.st_dev &&
+        in_st.st_ino == out_st.st_ino) {
+      // it would never reach the end of a file it is appending to
+      dprintf(2, "cat: %s: input file is output file\n", names[i]);
+      ret = EXIT_FAILURE;
+    } else if (copy_fd_nosigpipe(fd, 1) == -1) {
+      if (errno == EPIPE) ret = 128 + SIGPIPE;
+      else if (errno != EINTR) dprintf(2, "cat: %s: %s\n", names[i], strerror(errno));
+      if (errno == EPIPE) i = nb_names; // nothing more can be written
+      else ret = EXIT_FAILURE;
+    }
+    if (fd != 0) close(fd);
+  }
+  return ret;
+}
+
+/**
+ * Copies the file `src` to `dst`, which is created with the permissions of
+ * `src` (minus the umask, and without the setuid, setgid and sticky bits, like
+ * cp without -p) if it does not exist, and truncated otherwise.
+ *
+ * @return 0 on success, -1 on failure (after printing an error message).
+ */
+int copy_file(char *src, char *dst) {
+  struct stat src_st, dst_st;
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in == -1 || fstat(in, &src_st) == -1) {
+    dprintf(2, "cp: %s: %s\n", src, strerror(errno));
+    if (in != -1) close(in);
+    return -1;
+  }
+  if (S_ISDIR(src_st.st_mode)) {
+    dprintf(2, "cp: -r not specified; omitting directory %s\n", src);
+    close(in);
+    return -1;
+  }
+  if (stat(dst, &dst_st) == 0 && dst_st.st_dev == src_st.st_dev &&
+      dst_st.st_ino == src_st.st_ino) {
+    dprintf(2, "cp: %s and %s are the same file\n", src, dst);
+    close(in);
+    return -1;
+  }
+
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, src_st.st_mode & 0777);
+  int ret = out == -1 ? -1 : copy_fd_nosigpipe(in, out);
+  if (ret == -1) dprintf(2, "cp: %s: %s\n", out == -1 ? dst : src, strerror(errno));
+  if (out != -1 && close(out) == -1 && ret == 0) {
+    dprintf(2, "cp: %s: %s\n", dst, strerror(errno));
+    ret = -1;
+  }
+  close(in);
+  return ret;
+}
+
+/**
+ * Internal command. Copies a file (`cp SRC DST`), or files into a directory
+ * (`cp SRC... DIR`), without copying their content through a buffer of the
+ * shell when possible (see copy.c). With options, the external `cp` is
+ * executed instead.
+ *
+ * @return `EXIT_SUCCESS` on success, `EXIT_FAILURE` if a file could not be
+ *         copied
+ */
+int cmd_cp(int argc, char **argv) {
+  if (has_option(argc, argv)) return call_external_cmd(argc, argv, (int[]) { -2, -2, -2 });
+  if (argc < 3) {
+    dprintf(2, "cp: usage: cp SRC DST, or cp SRC... DIR\n");
+    return EXIT_FAILURE;
+  }
+
+  char *dst = argv[argc - 1];
+  struct stat st;
+  int to_dir = stat(dst, &st) == 0 && S_ISDIR(st.st_mode);
+  if (!to_dir) {
+    if (argc > 3) {
+      dprintf(2, "cp: %s is not a directory\n", dst);
+      return EXIT_FAILURE;
+    }
+    return copy_file(argv[1], dst) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
   }
+
+  int ret = EXIT_SUCCESS, dst_len = strlen(dst);
+  for (int i = 1; i < argc - 1 && !g_sig_received; i++) {
+    // the copy keeps the last component of the source path
+    char *base = strrchr(argv[i], '/');
+    base = base ? base + 1 : argv[i];
+    char path[dst_len + strlen(base) + 2];
+    sprintf(path, "%s/%s", dst, base);
+    if (copy_file(argv[i], path) == -1) ret = EXIT_FAILURE;
+  }
+  return ret;
 }
 
 
+/**
+ * Replaces the shell by the external command in argv, with the redirections of
+ * redir (see call_external_cmd), in the same state as call_external_cmd gives
+ * to its children.
+ *
+ * @return EXIT_FAILURE if the command could not be executed, never returns
+ *         otherwise. The shell is left with the redirections and signals of
+ *         the command, so it must exit.
+ */
+int exec_external_cmd(int argc, char **argv, int redir[3]) {
+  for (int i = 0; i < 3; i++) {
+    if (redir[i] != -2 && redir[i] != i) {
+      dup2(redir[i], i);
+      close(redir[i]);
+    }
+  }
+  struct sigaction sa = { 0 };
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGTERM, &sa, NULL);
+  sigset_t sigmask;
+  if (supervisor_child_sigmask(&sigmask)) sigprocmask(SIG_SETMASK, &sigmask, NULL);
+  fflush(NULL);
+  if (g_trace_on) {
+    trace_event('i', "exec", "cmd", argv[0]);
+    trace_flush(); // lost if the exec succeeds
+  }
+  g_stats.execs++;
+  stats_dump(); // if the shell itself is replaced
+
+  char *path = path_cache_lookup(argv[0]);
+  if (path) {
+    execve(path, argv, environ);
+    if (errno == ENOENT && (path = path_cache_refresh(argv[0]))) execve(path, argv, environ);
+    if (errno == ENOEXEC) {
+      char *sh_argv[argc + 2];
+      sh_script_argv(sh_argv, path, argc, argv);
+      execve("/bin/sh", sh_argv, environ);
+    }
+  } else { // execvp runs the files without #! line with sh itself
+    execvp(argv[0], argv);
+  }
+  g_stats.spawn_failures++;
+  if (errno == ENOMEM || errno == E2BIG) perror("execve");
+  else dprintf(2, "fsh: unknown command %s\n", argv[0]);
+  return EXIT_FAILURE;
+}
+
+
+/**
+ * Adds the internal commands to the builtin registry, must be called once when
+ * the shell starts.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int register_internal_commands(void) {
+  char *names[] = { "ftype", "exit", "cd", "pwd", "autotune", "return", "umask",
+                    "hash", "enable", "wait", "cat", "cp", "stats", "true",
+                    "false", "test", "[", "echo", "printf" };
+  cmd_func funcs[] = { cmd_ftype, cmd_exit, cmd_cd, cmd_pwd, cmd_autotune,
+                       cmd_return, cmd_umask, cmd_hash, cmd_enable, cmd_wait,
+                       cmd_cat, cmd_cp, cmd_stats, cmd_true, cmd_false,
+                       cmd_test, cmd_test, cmd_echo, cmd_printf };
+  for (size_t i = 0; i < sizeof(funcs) / sizeof(cmd_func); i++) {
+    if (builtin_register(names[i], funcs[i], NULL) == -1) return -1;
+  }
+  return 0;
+}
+
+/**
+ * Runs a command that is the last thing the shell does before it exits: an
+ * external command replaces the shell instead of running in a child that the
+ * shell would wait for.
+ *
+ * @return the return code of an internal command, or EXIT_FAILURE if the
+ *         external command could not be executed.
+ */
+int call_command_last(int argc, char **argv, int redir[3]) {
+  if (builtin_lookup(argv[0])) return call_command_and_wait(argc, argv, redir);
+  return exec_external_cmd(argc, argv, redir);
+}
+
 // Runs a command (internal or external) and wait for it to finish
 int call_command_and_wait(int argc, char **argv, int redir[3]) {
   char *cmd = argv[0];
 
-  cmd_func internal_function;
-  if (strcmp(cmd, "ftype") == 0) {
-    internal_function = cmd_ftype;
-  } else if (strcmp(cmd, "exit") == 0) {
-    internal_function = cmd_exit;
-  } else if (strcmp(cmd, "cd") == 0) {
-    internal_function = cmd_cd;
-  } else if (strcmp(cmd, "pwd") == 0) {
-    internal_function = cmd_pwd;
-  } else if (strcmp(cmd, "autotune") == 0) {
-    internal_function = cmd_autotune;
-  } else if (strcmp(cmd, "return") == 0) {
-    internal_function = cmd_return;
-  } else if (strcmp(cmd, "umask") == 0) {
-    internal_function = cmd_umask;
-  } else {
-    internal_function = NULL;
-  }
+  cmd_func internal_function = builtin_lookup(cmd);
 
   int ret;
   if (internal_function) {
     // Need to save the current file descriptors as we will execute the command
-    // in the current process and not a subshell
+    // in the current process and not a subshell. The saves are not inherited
+    // by the external commands that cat and cp execute.
     int i, saves[3];
     for (i = 0; i < 3; i++) {
       if (redir[i] != -2) {
-        saves[i] = dup(i);
+        saves[i] = fcntl(i, F_DUPFD_CLOEXEC, 0);
         dup2(redir[i], i);
       }
     }
     ret = internal_function(argc, argv);
+    // What the command wrote with stdio must go to its own redirections
+    fflush(stdout);
+    fflush(stderr);
 
     // Restore the file descriptors
     for (i = 0; i < 3; i++) {
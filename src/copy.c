@@ -0,0 +1,148 @@
+#include "copy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fsh.h"
+
+/* COPY:
+Copies the content of a descriptor into another one without going through a
+buffer of the shell when the kernel can do it directly, for the `cat` and `cp`
+internal commands. The system call depends on what the descriptors are:
+- copy_file_range between two regular files, which can share the blocks of
+  the file on filesystems that support it (reflinks), or copy them on the side
+  of the kernel;
+- splice when one of them is a pipe (the stages of a pipeline), which moves
+  pages in and out of the pipe;
+- sendfile from a regular file to anything else (a terminal, a socket).
+
+None of them writes to a file opened with O_APPEND (`>>`), and some
+filesystems or older kernels reject some of them: the copy then goes on with
+the next method, from where the previous one stopped, down to a plain
+read/write loop with a large buffer.
+*/
+
+// A single call never copies more than this, so that SIGINT is noticed
+#define COPY_CHUNK (1 << 20)
+
+// Errors meaning that a method can not be used with these descriptors
+int copy_unsupported(int err) {
+  return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP ||
+         err == EBADF || err == ETXTBSY;
+}
+
+/**
+ * Handles a failed copy call: waits until the descriptors are ready again if
+ * they are non-blocking, and retries after a signal other than SIGINT.
+ *
+ * @return 1 if the call must be retried, 0 otherwise.
+ */
+int copy_retry(int in, int out) {
+  if (errno == EINTR) return !g_sig_received;
+  if (errno != EAGAIN) return 0;
+  struct pollfd fds[2] = { { in, POLLIN, 0 }, { out, POLLOUT, 0 } };
+  poll(fds, 2, -1);
+  return 1;
+}
+
+/**
+ * Copies with `method` until the end of `in`.
+ *
+ * @return 1 when the end was reached, 0 if the method is not supported (what
+ *         it copied before, if anything, is not lost), -1 on failure.
+ */
+int copy_with(ssize_t (*method)(int, int), int in, int out) {
+  ssize_t n;
+  while (1) {
+    n = method(in, out);
+    if (n == 0) return 1;
+    if (n > 0) continue;
+    if (copy_retry(in, out)) continue;
+    return copy_unsupported(errno) ? 0 : -1;
+  }
+}
+
+ssize_t copy_range_chunk(int in, int out) {
+  return copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+}
+
+ssize_t copy_splice_chunk(int in, int out) {
+  return splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+}
+
+ssize_t copy_sendfile_chunk(int in, int out) {
+  return sendfile(out, in, NULL, COPY_CHUNK);
+}
+
+// The last resort, that works with any descriptors
+int copy_read_write(int in, int out) {
+  char *buf = malloc(COPY_BUF_SIZE);
+  if (!buf) return -1;
+
+  ssize_t n, w, done;
+  while (1) {
+    n = read(in, buf, COPY_BUF_SIZE);
+    if (n == 0) break;
+    if (n == -1) {
+      if (copy_retry(in, out)) continue;
+      break;
+    }
+    for (done = 0; done < n; done += w) {
+      w = write(out, buf + done, n - done);
+      if (w == -1) {
+        if (copy_retry(in, out)) {
+          w = 0;
+          continue;
+        }
+        n = -1;
+        break;
+      }
+    }
+    if (n == -1) break;
+  }
+
+  int err = errno;
+  free(buf);
+  errno = err;
+  return n == 0 ? 0 : -1;
+}
+
+/**
+ * Copies everything that can be read from `in` to `out`, with the fastest
+ * method that works for these descriptors.
+ *
+ * @return 0 on success, -1 on failure, with errno set (EPIPE if the reader of
+ *         `out` is gone, EINTR if interrupted by SIGINT).
+ */
+int copy_fd(int in, int out) {
+  struct stat in_st, out_st;
+  if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1) return -1;
+  if (S_ISDIR(in_st.st_mode)) {
+    errno = EISDIR;
+    return -1;
+  }
+
+  int ret = 0;
+  if (!(fcntl(out, F_GETFL) & O_APPEND)) {
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+      ret = copy_with(copy_range_chunk, in, out);
+    }
+    if (!ret && (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))) {
+      ret = copy_with(copy_splice_chunk, in, out);
+    }
+    if (!ret && S_ISREG(in_st.st_mode)) {
+      ret = copy_with(copy_sendfile_chunk, in, out);
+    }
+  } else if (S_ISFIFO(in_st.st_mode) && S_ISFIFO(out_st.st_mode)) {
+    ret = copy_with(copy_splice_chunk, in, out); // O_APPEND means nothing for a pipe
+  }
+
+  if (ret == 1) return 0;
+  if (ret == -1) return -1;
+  return copy_read_write(in, out);
+}
@@ -4,88 +4,165 @@
 
 #include "cmd_types.h"
 
-void print_redir(int device, char *name, enum redir_type type) {
+void print_redir(FILE *out, int device, char *name, enum redir_type type) {
   if (device == 0) {
-    printf(" < %s", name);
+    fprintf(out, " < %s", name);
   } else {
-    printf(" ");
-    if (device == 2) printf("2");
+    fprintf(out, " ");
+    if (device == 2) fprintf(out, "2");
     switch (type) {
       case REDIR_NONE: // we check this before calling the function
         break;
       case REDIR_NORMAL:
-        printf("> %s", name);
+        fprintf(out, "> %s", name);
         break;
       case REDIR_APPEND:
-        printf(">> %s", name);
+        fprintf(out, ">> %s", name);
         break;
       case REDIR_OVERWRITE:
-        printf(">| %s", name);
+        fprintf(out, ">| %s", name);
         break;
     }
   }
   return;
 }
 
-void print_cmd_aux(struct cmd *cmd) {
+// Prints a metadata predicate of a for loop as it was written, except for the
+// user of -user, printed as its uid
+void print_for_pred(FILE *out, struct for_pred *pred) {
+  char *sign = pred->cmp < 0 ? "-" : pred->cmp > 0 ? "+" : "";
+  switch (pred->type) {
+    case PRED_SIZE:
+      char unit = pred->unit == 1 ? 'c' : pred->unit == 2 ? 'w' : pred->unit == 512 ? 'b' :
+                  pred->unit == 1 << 10 ? 'k' : pred->unit == 1 << 20 ? 'M' : 'G';
+      fprintf(out, " -size %s%lld%c", sign, pred->value, unit);
+      break;
+    case PRED_MTIME:
+      fprintf(out, " -mtime %s%lld", sign, pred->value);
+      break;
+    case PRED_NEWER:
+      fprintf(out, " -newer %s", pred->ref);
+      break;
+    case PRED_PERM:
+      fprintf(out, " -perm %s%llo", pred->cmp > 0 ? "/" : sign, pred->value);
+      break;
+    case PRED_USER:
+      fprintf(out, " -user %lld", pred->value);
+      break;
+  }
+}
+
+/**
+ * Prints the head of a command, without the commands of its bodies nor the
+ * ones that follow it: the whole simple command, `if` with its test, `for`
+ * with its options, or `time`.
+ */
+void print_cmd_node(FILE *out, struct cmd *cmd) {
   switch (cmd->cmd_type) {
     case CMD_EMPTY:
-      printf("<empty>");
+      fprintf(out, "<empty>");
       break;
 
     case CMD_IF_ELSE:
       struct cmd_if_else *if_else = (struct cmd_if_else *)(cmd->detail);
-      printf("if ");
-      print_cmd_aux(if_else->cmd_test);
-      printf(" { ");
-      print_cmd_aux(if_else->cmd_then);
-      printf(" }");
-      if (if_else->cmd_else) {
-        printf(" else { ");
-        print_cmd_aux(if_else->cmd_else);
-        printf(" }");
-      }
+      fprintf(out, "if ");
+      print_cmd_aux(out, if_else->cmd_test);
       break;
 
     case CMD_FOR:
       struct cmd_for *cmd_for = (struct cmd_for *)(cmd->detail);
-      printf("for %c in %s ", cmd_for->var_name, cmd_for->dir_name);
-      if (cmd_for->list_all) printf("-A ");
-      if (cmd_for->recursive) printf("-r ");
-      if (cmd_for->filter_ext) printf("-e %s ", cmd_for->filter_ext);
-      if (cmd_for->filter_type) printf("-t %c ", cmd_for->filter_type);
-      if (cmd_for->parallel) printf("-p %d ", cmd_for->parallel);
-      printf("{ ");
-      print_cmd_aux(cmd_for->body);
-      printf(" }");
+      fprintf(out, "for %c in", cmd_for->var_name);
+      for (char **dir = cmd_for->dir_names; *dir; dir++) fprintf(out, " %s", *dir);
+      if (cmd_for->list_all) fprintf(out, " -A");
+      if (cmd_for->recursive) fprintf(out, " -r");
+      if (cmd_for->filter_ext) fprintf(out, " -e %s", cmd_for->filter_ext);
+      if (cmd_for->filter_type) fprintf(out, " -t %c", cmd_for->filter_type);
+      if (cmd_for->parallel) fprintf(out, " -p %d", cmd_for->parallel);
+      for (int i = 0; i < cmd_for->nb_preds; i++) print_for_pred(out, &cmd_for->preds[i]);
+      break;
+
+    case CMD_TIME:
+      struct cmd_time *cmd_time = (struct cmd_time *)(cmd->detail);
+      fprintf(out, cmd_time->per_stage ? "time -s" : "time");
       break;
 
     case CMD_SIMPLE:
       struct cmd_simple *simple = (struct cmd_simple *)(cmd->detail);
-      printf("%s", simple->argv[0]);
-      for (char **arg = simple->argv + 1; *arg; arg++) printf(" %s", *arg);
-      if (simple->in) print_redir(0, simple->in, 0);
-      if (simple->out_type != REDIR_NONE) print_redir(1, simple->out, simple->out_type);
-      if (simple->err_type != REDIR_NONE) print_redir(2, simple->err, simple->err_type);
+      fprintf(out, "%s", simple->argv[0]);
+      for (char **arg = simple->argv + 1; *arg; arg++) fprintf(out, " %s", *arg);
+      if (simple->in) print_redir(out, 0, simple->in, 0);
+      if (simple->out_type != REDIR_NONE) print_redir(out, 1, simple->out, simple->out_type);
+      if (simple->err_type != REDIR_NONE) print_redir(out, 2, simple->err, simple->err_type);
+      break;
+  }
+}
+
+// Prints a command with its bodies, but not the commands that follow it
+void print_cmd_full(FILE *out, struct cmd *cmd) {
+  print_cmd_node(out, cmd);
+  switch (cmd->cmd_type) {
+    case CMD_IF_ELSE:
+      struct cmd_if_else *if_else = (struct cmd_if_else *)(cmd->detail);
+      fprintf(out, " { ");
+      print_cmd_aux(out, if_else->cmd_then);
+      fprintf(out, " }");
+      if (if_else->cmd_else) {
+        fprintf(out, " else { ");
+        print_cmd_aux(out, if_else->cmd_else);
+        fprintf(out, " }");
+      }
+      break;
+
+    case CMD_FOR:
+      fprintf(out, " { ");
+      print_cmd_aux(out, ((struct cmd_for *)(cmd->detail))->body);
+      fprintf(out, " }");
+      break;
+
+    case CMD_TIME:
+      fprintf(out, " ");
+      print_cmd_aux(out, ((struct cmd_time *)(cmd->detail))->body);
       break;
+
+    default:
+      break;
+  }
+}
+
+// Prints the pipeline starting at `cmd`, up to its last command
+void print_pipeline(FILE *out, struct cmd *cmd) {
+  print_cmd_full(out, cmd);
+  while (cmd->next_type == NEXT_PIPE) {
+    cmd = cmd->next;
+    fprintf(out, " | ");
+    print_cmd_full(out, cmd);
   }
+}
+
+// Prints a command and the ones that follow it
+void print_cmd_aux(FILE *out, struct cmd *cmd) {
+  print_cmd_full(out, cmd);
 
   switch (cmd->next_type) {
     case NEXT_NONE:
       break;
     case NEXT_PIPE:
-      printf(" | ");
-      print_cmd_aux(cmd->next);
+      fprintf(out, " | ");
+      print_cmd_aux(out, cmd->next);
       break;
     case NEXT_SEMICOLON:
-      printf(" ; ");
-      print_cmd_aux(cmd->next);
+      fprintf(out, " ; ");
+      print_cmd_aux(out, cmd->next);
+      break;
+    case NEXT_BACKGROUND:
+      fprintf(out, " & ");
+      print_cmd_aux(out, cmd->next);
       break;
   }
   return;
 }
 
 void print_cmd(struct cmd *cmd) {
-  print_cmd_aux(cmd);
+  print_cmd_aux(stdout, cmd);
   printf("\n");
 }
@@ -0,0 +1,209 @@
+#include "dirreader.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "metadata.h"
+#include "stats.h"
+
+/* DIRECTORY READER:
+Reads directories with getdents64 directly, in a large buffer owned by the
+reader and reused from one directory to the next. Entries are never copied:
+`struct dir_entry` points inside the buffer, and the filters that only need the
+name (`.`/`..`, hidden files, extension) are applied on the raw records.
+
+When the loop needs the type of the entries and the filesystem does not provide
+it, the missing types of a whole chunk are found at once with the metadata
+engine (see metadata.c).
+*/
+
+// Layout of the records returned by getdents64
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+
+/**
+ * Prepares a reader with a buffer of `buf_size` bytes. The filters of the
+ * reader are taken from `cmd_for`, which may be NULL to get every entry except
+ * `.` and `..`.
+ *
+ * When `buf_size` is 0, no buffer is allocated: the caller must provide one in
+ * the `buf` and `buf_size` fields before reading.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int dir_reader_init(struct dir_reader *reader, int buf_size, struct cmd_for *cmd_for) {
+  memset(reader, 0, sizeof(struct dir_reader));
+  reader->fd = -1;
+  if (buf_size) {
+    reader->buf = malloc(buf_size);
+    if (!reader->buf) return -1;
+    reader->buf_size = buf_size;
+  }
+
+  if (cmd_for) {
+    reader->list_all = cmd_for->list_all;
+    reader->filter_ext = cmd_for->filter_ext;
+    reader->ext_len = cmd_for->filter_ext ? strlen(cmd_for->filter_ext) : 0;
+    reader->keep_dirs = cmd_for->recursive;
+    reader->resolve_types = cmd_for->recursive || cmd_for->filter_type;
+  } else {
+    reader->list_all = 1;
+  }
+  return 0;
+}
+
+/**
+ * Opens the directory `path` (relative to `dirfd`, which can be AT_FDCWD) in
+ * the reader, closing the previous one if necessary.
+ *
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int dir_reader_open(struct dir_reader *reader, int dirfd, char *path) {
+  dir_reader_close(reader);
+  reader->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  reader->offset = 0;
+  return reader->fd == -1 ? -1 : 0;
+}
+
+// Length of the name of a record, using the fact that its terminating null
+// byte is always in the last 8 bytes of the record
+int dirent_name_len(struct linux_dirent64 *dirent) {
+  int area = dirent->d_reclen - offsetof(struct linux_dirent64, d_name);
+  int start = area > 8 ? area - 8 : 0;
+  return start + strnlen(dirent->d_name + start, area - start);
+}
+
+/**
+ * Some filesystems (XFS without ftype, some NFS or overlay setups) do not fill
+ * the type of the entries. Finds the type of every such entry of the current
+ * chunk of the buffer with batches of statx, and writes it in place in the
+ * records.
+ */
+void dir_reader_resolve_types(struct dir_reader *reader) {
+  struct meta_request reqs[META_BATCH_SIZE];
+  struct linux_dirent64 *dirents[META_BATCH_SIZE];
+  struct linux_dirent64 *dirent;
+  int nb = 0, pos = 0;
+
+  while (pos < reader->end || nb) {
+    if (pos < reader->end) {
+      dirent = (struct linux_dirent64 *) (reader->buf + pos);
+      pos += dirent->d_reclen;
+      if (dirent->d_type != DT_UNKNOWN) continue;
+      char *name = dirent->d_name;
+      if (name[0] == '.' && (!reader->list_all || name[1] == '\0' ||
+                             (name[1] == '.' && name[2] == '\0')))
+        continue;
+      reqs[nb].dirfd = reader->fd;
+      reqs[nb].name = name;
+      dirents[nb] = dirent;
+      nb++;
+      if (nb < META_BATCH_SIZE && pos < reader->end) continue;
+    }
+
+    if (meta_stat_batch(reqs, nb, STATX_TYPE) == 0) {
+      for (int i = 0; i < nb; i++) {
+        if (!reqs[i].error) dirents[i]->d_type = meta_d_type(&reqs[i].stx);
+      }
+    }
+    nb = 0;
+  }
+}
+
+/**
+ * Reads the next entry of the directory that passes the filters of the reader.
+ *
+ * @return 1 if an entry was stored in `entry`, 0 at the end of the directory,
+ *         -1 on failure with errno set.
+ */
+int dir_reader_next(struct dir_reader *reader, struct dir_entry *entry) {
+  struct linux_dirent64 *dirent;
+  char *name;
+  int len;
+
+  while (1) {
+    if (reader->pos >= reader->end) {
+      long nread = syscall(SYS_getdents64, reader->fd, reader->buf, reader->buf_size);
+      reader->nb_reads++;
+      if (nread <= 0) return nread == 0 ? 0 : -1;
+      reader->pos = 0;
+      reader->end = nread;
+      if (reader->resolve_types) dir_reader_resolve_types(reader);
+    }
+
+    dirent = (struct linux_dirent64 *) (reader->buf + reader->pos);
+    reader->pos += dirent->d_reclen;
+    reader->offset = dirent->d_off;
+    name = dirent->d_name;
+
+    if (name[0] == '.') {
+      if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) continue;
+      if (!reader->list_all) continue; // -A
+    }
+    reader->nb_entries++;
+
+    len = dirent_name_len(dirent);
+    entry->ext_match = 1;
+    if (reader->filter_ext) { // -e
+      char *ext_start = name + len - reader->ext_len - 1;
+      entry->ext_match = reader->ext_len < len && *ext_start == '.' &&
+        memcmp(ext_start + 1, reader->filter_ext, reader->ext_len) == 0;
+      if (!entry->ext_match && !(reader->keep_dirs && dirent->d_type == DT_DIR)) {
+        reader->nb_filtered++;
+        continue;
+      }
+    }
+
+    entry->name = name;
+    entry->name_len = len;
+    entry->d_type = dirent->d_type;
+    return 1;
+  }
+}
+
+/**
+ * Moves the reader to `offset` in its directory, which must be a value taken
+ * from the `offset` field of a reader of the same directory.
+ *
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int dir_reader_seek(struct dir_reader *reader, long offset) {
+  if (lseek(reader->fd, offset, SEEK_SET) == -1) return -1;
+  reader->offset = offset;
+  reader->pos = 0;
+  reader->end = 0;
+  return 0;
+}
+
+// Closes the current directory of the reader, but keeps its buffer
+void dir_reader_close(struct dir_reader *reader) {
+  if (reader->nb_entries) {
+    STATS_ADD(dir_entries, reader->nb_entries);
+    STATS_ADD(filtered_ext, reader->nb_filtered);
+    reader->nb_entries = 0;
+    reader->nb_filtered = 0;
+  }
+  if (reader->fd >= 0) close(reader->fd);
+  reader->fd = -1;
+  reader->pos = 0;
+  reader->end = 0;
+}
+
+void dir_reader_free(struct dir_reader *reader) {
+  dir_reader_close(reader);
+  free(reader->buf);
+  reader->buf = NULL;
+}
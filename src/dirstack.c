@@ -0,0 +1,227 @@
+#include "dirstack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* ITERATIVE TRAVERSAL:
+A `struct dir_stack` replaces the recursion of sequential `for -r` loops with an
+explicit stack of frames allocated on the heap, one for each directory being
+read. Subdirectories are opened with openat relative to the directory of their
+parent, and the path of the current entry is built in a single growable buffer:
+each frame only remembers where its own path ends in that buffer, so building
+the path of an entry only costs the length of its name.
+
+At most `max_fds` directories are kept open. When a new frame would exceed that
+limit, the directory of the oldest open frame is closed and the offset of its
+next entry is saved. Since frames are only evicted from the bottom and only the
+top frame is read, the open frames always are the topmost ones, and a closed
+frame is reopened and moved back to its saved offset only when it becomes the
+top of the stack again: through ".." from the child that is being popped, or
+from its full path if that fails.
+
+All the memory of a stack comes from an arena, and is freed with it: closing a
+stack only closes its directories. Buffers that are not needed anymore are
+kept in a list of spare buffers to be reused by the next frames.
+*/
+
+
+// Returns a buffer for a frame, reusing the one of a closed frame if possible
+char *dir_stack_get_buf(struct dir_stack *stack) {
+  if (stack->nb_spares) return stack->spare_bufs[--stack->nb_spares];
+  return arena_alloc(stack->arena, DIR_READER_BUF_SIZE);
+}
+
+// Closes the directory of a frame, and keeps its buffer for later use
+void dir_stack_close_frame(struct dir_stack *stack, struct dir_frame *frame) {
+  long offset = frame->reader.offset;
+  dir_reader_close(&frame->reader);
+  frame->reader.offset = offset;
+  if (frame->reader.buf) {
+    // at most max_fds + 1 buffers are in use at the same time
+    if (stack->nb_spares < stack->max_fds + 1)
+      stack->spare_bufs[stack->nb_spares++] = frame->reader.buf;
+    frame->reader.buf = NULL;
+  }
+}
+
+// Makes sure the path buffer can hold `len` characters and a null byte
+int dir_stack_reserve(struct dir_stack *stack, int len) {
+  if (len < stack->path_cap) return 0;
+  int new_cap = stack->path_cap * 2;
+  while (new_cap <= len) new_cap *= 2;
+  char *path = arena_alloc(stack->arena, new_cap);
+  if (!path) return -1;
+  memcpy(path, stack->path, stack->path_cap);
+  stack->path = path;
+  stack->path_cap = new_cap;
+  return 0;
+}
+
+// Maximum number of open directories, can be overridden with FSH_MAX_DIR_FDS
+int dir_stack_max_fds(void) {
+  char *env = getenv("FSH_MAX_DIR_FDS");
+  long n = env ? strtol(env, NULL, 10) : DIR_STACK_MAX_FDS;
+  return n < 1 ? 1 : n;
+}
+
+/**
+ * Prepares a stack with the directory `root` as its only frame, with the
+ * filters of `cmd_for`. Its memory is allocated in `arena`.
+ *
+ * @return 0 on success, -1 on failure with errno set (the stack is then
+ *         already closed).
+ */
+int dir_stack_init(struct dir_stack *stack, struct cmd_for *cmd_for, char *root,
+                   struct arena *arena) {
+  int saved_errno;
+  memset(stack, 0, sizeof(struct dir_stack));
+  dir_reader_init(&stack->model, 0, cmd_for);
+  stack->arena = arena;
+  stack->max_fds = dir_stack_max_fds();
+  stack->cap = 16;
+  stack->frames = arena_alloc(arena, stack->cap * sizeof(struct dir_frame));
+  stack->spare_bufs = arena_alloc(arena, (stack->max_fds + 1) * sizeof(char *));
+  stack->path_len = strlen(root);
+  stack->path_cap = 256;
+  while (stack->path_cap <= stack->path_len) stack->path_cap *= 2;
+  stack->path = arena_alloc(arena, stack->path_cap);
+  if (!stack->frames || !stack->spare_bufs || !stack->path) goto error;
+  memcpy(stack->path, root, stack->path_len + 1);
+
+  struct dir_frame *frame = &stack->frames[0];
+  frame->reader = stack->model;
+  frame->path_len = stack->path_len;
+  frame->ext_match = 1;
+  frame->reader.buf = dir_stack_get_buf(stack);
+  if (!frame->reader.buf) goto error;
+  frame->reader.buf_size = DIR_READER_BUF_SIZE;
+  stack->depth = 1;
+  if (dir_reader_open(&frame->reader, AT_FDCWD, root) == -1) goto error;
+
+  return 0;
+
+  error:
+  saved_errno = errno;
+  dir_stack_close(stack);
+  errno = saved_errno;
+  return -1;
+}
+
+/**
+ * Reopens the closed directory at the top of the stack from `path` (relative
+ * to `dirfd`), and moves it back to the offset it was closed at.
+ *
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int dir_stack_reopen(struct dir_stack *stack, int dirfd, char *path) {
+  struct dir_frame *top = &stack->frames[stack->depth - 1];
+  long offset = top->reader.offset;
+  top->reader.buf = dir_stack_get_buf(stack);
+  if (!top->reader.buf) return -1;
+  if (dir_reader_open(&top->reader, dirfd, path) == -1 ||
+      dir_reader_seek(&top->reader, offset) == -1) {
+    int saved_errno = errno;
+    dir_stack_close_frame(stack, top);
+    errno = saved_errno;
+    return -1;
+  }
+  stack->first_open = stack->depth - 1;
+  return 0;
+}
+
+/**
+ * Reads the next entry of the directory at the top of the stack, reopening it
+ * first if it was evicted. The path of the entry is then available in the
+ * `path` field of the stack, until the next call to a dir_stack_* function.
+ *
+ * @return 1 if an entry was stored in `entry`, 0 at the end of the directory,
+ *         -1 on failure with errno set.
+ */
+int dir_stack_next(struct dir_stack *stack, struct dir_entry *entry) {
+  struct dir_frame *top = &stack->frames[stack->depth - 1];
+
+  if (top->reader.fd == -1) {
+    // Only happens if it could not be reopened from its child in dir_stack_pop
+    stack->path[top->path_len] = '\0';
+    if (dir_stack_reopen(stack, AT_FDCWD, stack->path) == -1) return -1;
+  }
+
+  int n = dir_reader_next(&top->reader, entry);
+  if (n != 1) return n;
+
+  int len = top->path_len + 1 + entry->name_len;
+  if (dir_stack_reserve(stack, len) == -1) return -1;
+  stack->path[top->path_len] = '/';
+  memcpy(stack->path + top->path_len + 1, entry->name, entry->name_len + 1);
+  stack->path_len = len;
+  return 1;
+}
+
+/**
+ * Opens the last entry returned by dir_stack_next as a new frame on top of the
+ * stack, evicting the oldest open frame if there are too many.
+ *
+ * @param ext_match Whether the entry passed -e, given back by dir_stack_pop.
+ *
+ * @return 0 on success, -1 on failure with errno set (the stack is unchanged).
+ */
+int dir_stack_push(struct dir_stack *stack, int ext_match) {
+  if (stack->depth == stack->cap) {
+    struct dir_frame *frames = arena_alloc(stack->arena, stack->cap * 2 * sizeof(struct dir_frame));
+    if (!frames) return -1;
+    memcpy(frames, stack->frames, stack->cap * sizeof(struct dir_frame));
+    stack->frames = frames;
+    stack->cap *= 2;
+  }
+
+  struct dir_frame *top = &stack->frames[stack->depth - 1];
+  struct dir_frame *frame = &stack->frames[stack->depth];
+  frame->reader = stack->model;
+  frame->path_len = stack->path_len;
+  frame->ext_match = ext_match;
+  frame->reader.buf = dir_stack_get_buf(stack);
+  if (!frame->reader.buf) return -1;
+  frame->reader.buf_size = DIR_READER_BUF_SIZE;
+  if (dir_reader_open(&frame->reader, top->reader.fd, stack->path + top->path_len + 1) == -1) {
+    int saved_errno = errno;
+    dir_stack_close_frame(stack, frame);
+    errno = saved_errno;
+    return -1;
+  }
+  stack->depth++;
+
+  while (stack->depth - stack->first_open > stack->max_fds) {
+    dir_stack_close_frame(stack, &stack->frames[stack->first_open]);
+    stack->first_open++;
+  }
+  return 0;
+}
+
+/**
+ * Removes the top frame of the stack. The `path` field of the stack then
+ * holds the path of the directory of that frame.
+ *
+ * @return whether the directory passed -e, as given to dir_stack_push.
+ */
+int dir_stack_pop(struct dir_stack *stack) {
+  struct dir_frame *top = &stack->frames[--stack->depth];
+
+  // If the parent was evicted, reopen it through "..", which does not depend
+  // on the length of the path nor on the working directory
+  if (stack->depth && stack->frames[stack->depth - 1].reader.fd == -1 && top->reader.fd != -1)
+    dir_stack_reopen(stack, top->reader.fd, "..");
+
+  dir_stack_close_frame(stack, top);
+  stack->path[top->path_len] = '\0';
+  stack->path_len = top->path_len;
+  return top->ext_match;
+}
+
+// Closes the directories of the stack, its memory is freed with its arena
+void dir_stack_close(struct dir_stack *stack) {
+  for (int i = 0; i < stack->depth; i++) dir_reader_close(&stack->frames[i].reader);
+  stack->depth = 0;
+}
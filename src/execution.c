@@ -10,11 +10,21 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "builtins.h"
 #include "commands.h"
+#include "dirstack.h"
 #include "fsh.h"
-
-// Number of currently launched parallel loops
-int g_nb_parallel = 0;
+#include "pathcache.h"
+#include "pipesize.h"
+#include "predicate.h"
+#include "profile.h"
+#include "stats.h"
+#include "supervisor.h"
+#include "timing.h"
+#include "trace.h"
+#include "walker.h"
+#include "workers.h"
 
 /**
  * Function to be executed by a subshell if it detects one of its executed
@@ -23,6 +33,7 @@ int g_nb_parallel = 0;
  * forwarded to the parent.
  */
 void raise_sigint() {
+  if (g_trace_on) trace_flush(); // the process will not exit normally
   struct sigaction sa = { 0 };
   sa.sa_handler = SIG_DFL;
   if (sigaction(SIGINT, &sa, NULL) != EXIT_SUCCESS) exit(EXIT_FAILURE);
@@ -114,21 +125,19 @@ int setup_in_redir(char *name) {
  * Replaces occurrences of variables in the form `$F` (where F is a character)
  * in a given string with their corresponding values from an array of
  * variables. If no replacements are needed, returns the original string.
- * Otherwise, allocates a new string.
+ * Otherwise, allocates a new string in `arena`.
  *
  * @param dependent_str The input string containing potential variable references.
  * @param vars An array of strings, where `vars[F]` provides the value for
  *             the variable referenced by `F`. Unset variables are denoted by
  *             NULL.
+ * @param arena The arena in which the new string is allocated.
  *
  * @return A pointer to the modified string with variables replaced, or NULL on
  *         error. Returns the same pointer as `dependent_str` if no replacements
  *         are needed.
- *
- * @note The caller is responsible for freeing the returned string if it is not
- *       the same as the input string.
  */
-char *replace_variables(char *dependent_str, char **vars) {
+char *replace_variables(char *dependent_str, char **vars, struct arena *arena) {
   if (dependent_str == NULL) return NULL;
 
   int size = strlen(dependent_str); // will contain the length of the final string
@@ -147,7 +156,7 @@ char *replace_variables(char *dependent_str, char **vars) {
 
   if (!changed) return dependent_str; // If no change is needed, just return the string
 
-  char *res = malloc(size + 1);
+  char *res = arena_alloc(arena, size + 1);
   if (res == NULL) return NULL;
 
   int j = 0;
@@ -171,42 +180,47 @@ char *replace_variables(char *dependent_str, char **vars) {
 }
 
 
+// Arena for the temporary allocations of the execution (expanded arguments,
+// directory stacks of nested loops...), released after each loop iteration
+struct arena g_scratch = { 0 };
+
 /**
- * Creates a new argument vector (argv) where every variable of the form
- * `$C` in each argument is replaced with its corresponding value
- * from the provided variable array.
+ * Expands `arg`, compiled into `tpl` by the parser, in `arena`. An unset
+ * variable `$F` is left as is, like in replace_variables.
  *
- * @param argc The number of arguments in the `argv` array.
- * @param argv The input argument vector. Each argument may contain variables
- *             to be replaced.
- * @param vars An array of strings, where `vars[F]` provides the value for
- *             the variable referenced by `F`. Unset variables are denoted by
- *             NULL.
- *
- * @return A pointer to the newly allocated argument vector with variables
- *         replaced, or NULL on error. The returned vector is NULL-terminated.
- *
- * @note The caller is responsible for freeing the memory allocated for the
- *       returned argument vector and its individual arguments.
- *
- * @warning If `replace_variables` fails for any argument, this function will
- *          return NULL.
+ * @return the expanded argument, `arg` itself if it does not need to be
+ *         changed, or NULL on allocation failure.
  */
-char **replace_arg_variables(int argc, char **argv, char **vars) {
-  char **res_argv = malloc((argc + 1) * sizeof(char *));
-  if (res_argv == NULL) return NULL;
-
-  for (int i = 0 ; i < argc ; i++) {
-    res_argv[i] = replace_variables(argv[i], vars);
-    if (res_argv[i] == NULL) { // Variable substitution failed
-      for (int j=0; j < i; j++) free(res_argv[j]); // Free the previous arguments
-      return NULL;
+char *expand_template(char *arg, struct arg_template *tpl, char **vars, struct arena *arena) {
+  if (tpl->nb_segments == 0) return arg;
+  if (tpl->nb_segments == -1) return replace_variables(arg, vars, arena); // see compile_template
+
+  // the length of each variable is only computed once, in the first pass
+  int lens[tpl->nb_segments];
+  int size = 0, changed = 0, i;
+  struct arg_segment *seg;
+  for (i = 0; i < tpl->nb_segments; i++) {
+    seg = &tpl->segments[i];
+    if (seg->var && vars[(int) seg->var]) {
+      lens[i] = strlen(vars[(int) seg->var]);
+      changed = 1;
+    } else {
+      lens[i] = seg->len;
     }
+    size += lens[i];
   }
+  if (!changed) return arg; // every variable is unset
 
-  res_argv[argc] = NULL;
-
-  return res_argv;
+  char *res = arena_alloc(arena, size + 1);
+  if (res == NULL) return NULL;
+  char *cur = res;
+  for (i = 0; i < tpl->nb_segments; i++) {
+    seg = &tpl->segments[i];
+    memcpy(cur, seg->var && vars[(int) seg->var] ? vars[(int) seg->var] : seg->start, lens[i]);
+    cur += lens[i];
+  }
+  *cur = '\0';
+  return res;
 }
 
 
@@ -224,15 +238,28 @@ char **replace_arg_variables(int argc, char **argv, char **vars) {
  *         terminated by signal)
  */
 int wait_cmd(int pid) {
+  return wait_cmd_usage(pid, NULL);
+}
+
+/**
+ * Same as wait_cmd, but also fills `usage` with the resources used by the
+ * child and the descendants it waited for, if `usage` is not NULL.
+ */
+int wait_cmd_usage(int pid, struct rusage *usage) {
   int wstat, ret;
+  struct rusage timing_usage;
+  if (g_timing && !usage) usage = &timing_usage;
 
+  TRACE_INT('B', "wait", "pid", pid);
   do {
-    ret = waitpid(pid, &wstat, 0);
+    ret = wait4(pid, &wstat, 0, usage);
   } while (ret == -1 && errno == EINTR); // interruption of wait can lead to problems in parallel execution and much more
+  TRACE_INT('E', "wait", "status", ret == -1 ? -1 : wstat);
 
   if (ret == -1) {
     return 256;  // to differentiate between error and actual return value
   }
+  if (g_timing) timing_reaped(usage);
 
   if (WIFEXITED(wstat)) {
     return WEXITSTATUS(wstat);
@@ -275,50 +302,15 @@ int same_type(char filter_type, char file_type) {
 
 
 /**
- * Tries to spawn a command in parallel, respecting a limit on the maximum
- * number of parallel processes. If the limit is reached, it waits for one of
- * the previously launched processes to finish before starting the new one.
- *
- * @param cmd The command to execute
- * @param vars An array of variables that can be used by the command being executed.
- * @param max The maximum number of parallel processes allowed.
- *
- * @return The return value of the last spawned parallel command.
- */
-int exec_parallel(struct cmd *cmd, char **vars, int max) {
-  int ret = 0;
-
-  if (g_nb_parallel == max) {
-    ret = wait_cmd(-1);
-    if (ret == 256) return EXIT_FAILURE;
-    g_nb_parallel--;
-  }
-
-  switch (fork()) {
-    case -1:
-      perror("fork");
-      return EXIT_FAILURE;
-    case 0:
-      ret = exec_cmd_chain(cmd, vars);
-      if (g_sig_received) raise_sigint();
-      exit(ret);
-    default:
-      g_nb_parallel++;
-  }
-
-  return ret;
-}
-
-
-/**
- * Executes a command for each file in a directory, with optional filters and
- * parallel execution. Supports recursion, file type filtering, and extension
- * filtering.
+ * Executes a command for each file in a directory, with optional filters.
+ * Supports recursion, file type filtering, and extension filtering.
  *
- * As it may return even when parallel processes are still running, this
- * function should not be used directly. Use exec_for_cmd instead.
+ * The recursion is iterative, using a `struct dir_stack`: the body is executed
+ * on a directory after it has been executed on its content.
  *
  * @param cmd_for The `struct cmd_for` containing the command details and options.
+ * @param dir_name The directory to iterate on, with its variables already
+ *                 substituted.
  * @param vars An array of variables usable by the commands and the for loop
  *             itself. Modified during execution to store the new variable of
  *             the current loop
@@ -328,71 +320,77 @@ int exec_parallel(struct cmd *cmd, char **vars, int max) {
  *
  * @note The function modifies the `vars` array temporarily and restores it afterward.
  */
-int exec_for_aux(struct cmd_for *cmd_for, char **vars) {
-  // substitute the variables in the for loop argument
-  char *dir_name = replace_variables(cmd_for->dir_name, vars);
-  if (dir_name == NULL) return EXIT_FAILURE; // means allocation error
-  int dir_len = strlen(dir_name);
-
-  DIR *dirp = opendir(dir_name);
-  if (dirp == NULL) {
+int exec_for_aux(struct cmd_for *cmd_for, char *dir_name, char **vars) {
+  struct dir_stack stack;
+  if (dir_stack_init(&stack, cmd_for, dir_name, &g_scratch) == -1) {
     perror("opendir");
     return EXIT_FAILURE;
   }
 
   // save the original value to avoid nested for loops overwriting the original
   char *original_var_value = vars[(int) cmd_for->var_name];
-
-  int ret = 0, tmp_ret, file_len, var_size;
-  struct dirent *dentry;
-  while (!g_sig_received && (dentry = readdir(dirp))) {
-    if (strcmp(dentry->d_name, ".") == 0 || strcmp(dentry->d_name, "..") == 0)
-      continue;
-    if (!cmd_for->list_all && dentry->d_name[0] == '.') // -A
-      continue;
-
-    // make the variable
-    file_len = strlen(dentry->d_name);
-    var_size = dir_len + file_len + 2;
-    char var[var_size];
-    snprintf(var, var_size, "%s/%s", dir_name, dentry->d_name);
-    vars[(int) (cmd_for->var_name)] = var;
-
-    if (cmd_for->recursive && dentry->d_type == DT_DIR) { // -r
-      char *old_dir = cmd_for->dir_name;
-      cmd_for->dir_name = var;
-      tmp_ret = exec_for_aux(cmd_for, vars);
-      ret = max_or_neg(ret, tmp_ret);
-      cmd_for->dir_name = old_dir;
+  TRACE('B', "for", "dir", dir_name);
+
+  int ret = 0, tmp_ret, n;
+  long filtered_type = 0, filtered_meta = 0;
+  struct dir_entry dentry;
+  while (!g_sig_received) {
+    n = dir_stack_next(&stack, &dentry);
+    if (n == -1) {
+      perror("getdents64");
+      ret = max_or_neg(ret, EXIT_FAILURE);
     }
 
-    if (g_sig_received) break; // shouldn't move on to executing the body on the directory if the recursion was interrupted
-
-    if (cmd_for->filter_ext) { // -e
-      int ext_len = strlen(cmd_for->filter_ext);
-      if (ext_len >= file_len) continue; // too big to be an extension
-      char *ext_start = var + var_size - ext_len - 2;
-      if (*ext_start != '.' || strcmp(ext_start + 1, cmd_for->filter_ext) != 0)
-        continue;
-      *ext_start = '\0';
+    if (n != 1) {
+      if (stack.depth == 1) break;
+      // the content of a directory is done, now execute the body on itself
+      dentry.ext_match = dir_stack_pop(&stack);
+      dentry.d_type = DT_DIR;
+    } else if (cmd_for->recursive && dentry.d_type == DT_DIR) { // -r
+      if (dir_stack_push(&stack, dentry.ext_match) == 0) continue;
+      perror("opendir");
+      ret = max_or_neg(ret, EXIT_FAILURE);
     }
 
-    if (cmd_for->filter_type && !same_type(cmd_for->filter_type, dentry->d_type)) // -t
+    if (!dentry.ext_match) continue; // -e
+
+    if (cmd_for->filter_type && !same_type(cmd_for->filter_type, dentry.d_type)) { // -t
+      filtered_type++;
       continue;
+    }
 
-    if (cmd_for->parallel) { // -p
-      tmp_ret = exec_parallel(cmd_for->body, vars, cmd_for->parallel);
-    } else {
-      tmp_ret = exec_cmd_chain(cmd_for->body, vars);
+    if (cmd_for->nb_preds) { // -size, -mtime, -newer, -perm, -user
+      // an entry of an open directory is stat'ed relative to it
+      int dirfd = AT_FDCWD;
+      char *name = stack.path;
+      if (n == 1 && stack.frames[stack.depth - 1].reader.fd != -1) {
+        dirfd = stack.frames[stack.depth - 1].reader.fd;
+        name = dentry.name;
+      }
+      if (!pred_match(cmd_for, dirfd, name)) {
+        filtered_meta++;
+        continue;
+      }
     }
+    if (cmd_for->filter_ext) stack.path[stack.path_len - stack.model.ext_len - 1] = '\0';
+
+    // everything the body allocates in the scratch arena is released at the
+    // end of the iteration
+    struct arena_mark mark = arena_mark(&g_scratch);
+    vars[(int) (cmd_for->var_name)] = stack.path;
+    TRACE('B', "iteration", "path", stack.path);
+    tmp_ret = exec_cmd_chain(cmd_for->body, vars);
+    TRACE_INT('E', "iteration", "status", tmp_ret);
+    arena_release(&g_scratch, mark);
     ret = max_or_neg(ret, tmp_ret);
   }
 
   vars[(int) cmd_for->var_name] = original_var_value; // restore the old variable
 
-  // make sure we don't free the original (see the doc of replace_variables)
-  if (dir_name != cmd_for->dir_name) free(dir_name);
-  closedir(dirp);
+  dir_stack_close(&stack);
+  if (filtered_type) STATS_ADD(filtered_type, filtered_type);
+  if (filtered_meta) STATS_ADD(filtered_meta, filtered_meta);
+  TRACE('E', "for", NULL, NULL);
 
   if (g_sig_received) return -1;
   return ret;
@@ -400,31 +398,106 @@ int exec_for_aux(struct cmd_for *cmd_for, char **vars) {
 
 
 /**
- * Executes a `for` loop command, ensuring all parallel processes are complete
- * before returning.
+ * Executes a parallel `for` loop. The directories are walked by the threads of
+ * a `struct walker` while this function sends the entries to a pool of worker
+ * subshells as soon as they are found.
+ *
+ * @param cmd_for The `struct cmd_for` containing the command details and options.
+ * @param dir_names The roots of the loop, with their variables already
+ *                  substituted.
+ * @param vars An array of variables usable by the commands and the for loop
+ *             itself. Modified during execution to store the new variable of
+ *             the current loop
+ *
+ * @return The highest return value from executing the command on each file. Returns
+ *         `EXIT_FAILURE` on error.
+ */
+int exec_for_walker(struct cmd_for *cmd_for, char **dir_names, char **vars) {
+  struct walker *walker = walker_start(cmd_for, dir_names, cmd_for->nb_dirs);
+  if (walker == NULL) {
+    dprintf(2, "fsh: could not start the directory walker\n");
+    return EXIT_FAILURE;
+  }
+
+  struct worker_pool pool;
+  worker_pool_init(&pool, cmd_for->parallel, cmd_for->body, cmd_for->var_name, vars);
+  TRACE_INT('B', "parallel for", "max", cmd_for->parallel);
+
+  int ret = 0, tmp_ret;
+  struct walk_entry entry;
+  while (!g_sig_received && walker_next(walker, &entry)) {
+    tmp_ret = worker_pool_run(&pool, entry.path);
+    ret = max_or_neg(ret, tmp_ret);
+    free(entry.path);
+  }
+
+  ret = max_or_neg(ret, worker_pool_finish(&pool));
+  ret = max_or_neg(ret, walker_finish(walker));
+  TRACE('E', "parallel for", NULL, NULL);
+
+  if (g_sig_received) return -1;
+  return ret;
+}
+
+
+/**
+ * Adds the external commands of a command chain to the PATH cache, when their
+ * name does not depend on a variable. The subshells forked for pipelines and
+ * parallel loops inherit the cache, but can not fill the cache of the shell:
+ * without this, they would all search PATH again.
+ */
+void warm_path_cache(struct cmd *cmd_chain) {
+  for (struct cmd *cmd = cmd_chain; cmd; cmd = cmd->next) {
+    if (cmd->cmd_type == CMD_SIMPLE) {
+      struct cmd_simple *cmd_simple = cmd->detail;
+      char *name = cmd_simple->argv[0];
+      if (!strchr(name, '$') && !builtin_lookup(name)) path_cache_lookup(name);
+    }
+    if (cmd->next_type == NEXT_NONE) break;
+  }
+}
+
+/**
+ * Executes a `for` loop command, on each of its roots.
  *
  * @param cmd_for The `struct cmd_for` containing the loop command and options.
  * @param vars An array of variables usable by the command, and modified during
  *             execution
  *
  * @return The highest return value from the loop executions.
- *
- * @note This function ensures that `nb_parallel` is 0 at the end of execution.
  */
 int exec_for_cmd(struct cmd_for *cmd_for, char **vars) {
-  int ret, tmp_ret;
+  int ret = 0, tmp_ret, i;
+  struct arena_mark mark = arena_mark(&g_scratch);
+
+  // substitute the variables in the for loop arguments
+  char *dir_names[cmd_for->nb_dirs + 1];
+  for (i = 0; i < cmd_for->nb_dirs; i++) {
+    dir_names[i] = replace_variables(cmd_for->dir_names[i], vars, &g_scratch);
+    if (dir_names[i] == NULL) { // means allocation error
+      ret = EXIT_FAILURE;
+      goto cleanup;
+    }
+  }
+  dir_names[cmd_for->nb_dirs] = NULL;
 
-  ret = exec_for_aux(cmd_for, vars);
+  if (cmd_for->nb_preds && pred_prepare(cmd_for) == -1) {
+    ret = EXIT_FAILURE;
+    goto cleanup;
+  }
+  warm_path_cache(cmd_for->body);
 
-  if (cmd_for->parallel) { // clean remaining parallel loops
-    while (g_nb_parallel) {
-      tmp_ret = wait_cmd(-1);
-      if (tmp_ret == 256) return EXIT_FAILURE;
+  if (cmd_for->parallel) { // -p
+    ret = exec_for_walker(cmd_for, dir_names, vars);
+  } else {
+    for (i = 0; !g_sig_received && i < cmd_for->nb_dirs; i++) {
+      tmp_ret = exec_for_aux(cmd_for, dir_names[i], vars);
       ret = max_or_neg(ret, tmp_ret);
-      g_nb_parallel--;
     }
   }
 
+  cleanup:
+  arena_release(&g_scratch, mark);
   return ret;
 }
 
@@ -437,6 +510,8 @@ int exec_for_cmd(struct cmd_for *cmd_for, char **vars) {
  * @param cmd_simple The `struct cmd_simple` containing the command and
  *                   its arguments, along with redirection information.
  * @param vars An array of variables usable by the command.
+ * @param last Whether the process exits after this command, in which case an
+ *             external command replaces it (see call_command_last).
  *
  * @return The return code from the command execution. Returns `EXIT_FAILURE`
  *         if any error occurs.
@@ -444,24 +519,23 @@ int exec_for_cmd(struct cmd_for *cmd_for, char **vars) {
  * @note This function already handles cleanup of allocated memory and file
  *       descriptors.
  */
-int exec_simple_cmd(struct cmd_simple *cmd_simple, char **vars) {
-  // inject the variables in the argv
-  char **injected_argv = replace_arg_variables(cmd_simple->argc, cmd_simple->argv, vars);
-  if (injected_argv == NULL) return EXIT_FAILURE; // nothing to free
-
-  int ret, i;
+int exec_simple_cmd(struct cmd_simple *cmd_simple, char **vars, int last) {
+  int argc = cmd_simple->argc, ret, i;
   char *redir_name[3] = { cmd_simple->in, cmd_simple->out, cmd_simple->err };
-
-  // inject the variables in the redirections file names
-  char *injected_redir[3] = {0};
+  struct arena_mark mark = arena_mark(&g_scratch);
+
+  // inject the variables in the argv and in the redirections file names, the
+  // expanded strings are allocated in the scratch arena
+  char *injected_argv[argc + 1];
+  char *injected_redir[3];
+  for (i = 0; i < argc; i++) {
+    injected_argv[i] = expand_template(cmd_simple->argv[i], &cmd_simple->templates[i], vars, &g_scratch);
+    if (injected_argv[i] == NULL) goto alloc_error;
+  }
+  injected_argv[argc] = NULL;
   for (i = 0; i < 3; i++) {
-    if (redir_name[i]) {
-      injected_redir[i] = replace_variables(redir_name[i], vars); // will be free'd at the end
-      if (injected_redir[i] == NULL) {
-        ret = EXIT_FAILURE;
-        goto cleanup_injections;
-      }
-    }
+    injected_redir[i] = expand_template(redir_name[i], &cmd_simple->redir_templates[i], vars, &g_scratch);
+    if (redir_name[i] && injected_redir[i] == NULL) goto alloc_error;
   }
 
   // Setup redirections if necessary
@@ -476,7 +550,8 @@ int exec_simple_cmd(struct cmd_simple *cmd_simple, char **vars) {
     }
   }
 
-  ret = call_command_and_wait(cmd_simple->argc, injected_argv, redir);
+  if (last) ret = call_command_last(argc, injected_argv, redir);
+  else ret = call_command_and_wait(argc, injected_argv, redir);
 
   cleanup_fd:
   // Cleanup redirections file descriptors if necessary
@@ -486,20 +561,13 @@ int exec_simple_cmd(struct cmd_simple *cmd_simple, char **vars) {
     }
   }
 
-  cleanup_injections:
-  for (i = 0; i < cmd_simple->argc; i++) {
-    if (cmd_simple->argv[i] != injected_argv[i]) {
-      free(injected_argv[i]);
-    }
-  }
-  free(injected_argv);
-  for (i = 0; i < 3; i++) {
-    if (injected_redir[i] && injected_redir[i] != redir_name[i]) {
-      free(injected_redir[i]);
-    }
-  }
-
+  arena_release(&g_scratch, mark);
   return ret;
+
+  alloc_error:
+  perror("malloc");
+  arena_release(&g_scratch, mark);
+  return EXIT_FAILURE;
 }
 
 
@@ -511,12 +579,13 @@ int exec_simple_cmd(struct cmd_simple *cmd_simple, char **vars) {
  * @param cmd_if_else The `struct cmd_if_else` containing the "test", "then",
  *                    and "else" commands.
  * @param vars The variable array used by the commands.
+ * @param last Whether the process exits after this command (see exec_chain).
  *
  * @return The return code from the executed "then"/"else" command, or
  *         `EXIT_SUCCESS` if the test command fails and there is no "else"
  *         command.
  */
-int exec_if_else_cmd(struct cmd_if_else *cmd_if_else, char **vars) {
+int exec_if_else_cmd(struct cmd_if_else *cmd_if_else, char **vars, int last) {
   // default return value, in case the test fails and there is no "else" command
   int ret = EXIT_SUCCESS;
 
@@ -527,10 +596,10 @@ int exec_if_else_cmd(struct cmd_if_else *cmd_if_else, char **vars) {
 
   if (test_ret == EXIT_SUCCESS) {
     // Test succeeded
-    ret = exec_cmd_chain(cmd_if_else->cmd_then, vars);
+    ret = exec_chain(cmd_if_else->cmd_then, vars, last);
   } else if (cmd_if_else->cmd_else != NULL) {
     // Test failed and there is an "else" command in the statement
-    ret = exec_cmd_chain(cmd_if_else->cmd_else, vars);
+    ret = exec_chain(cmd_if_else->cmd_else, vars, last);
   }
 
   return ret;
@@ -538,102 +607,256 @@ int exec_if_else_cmd(struct cmd_if_else *cmd_if_else, char **vars) {
 
 
 /**
- * Executes the first, and only first command in a command chain
- *
- * @param cmd_chain The `struct cmd` representing the command chain.
- * @param vars An array of variables usable by the command.
+ * Executes a `time` command: runs the rest of the chain, then prints on stderr
+ * the resources that it used (see timing.c). The chain is never replaced by
+ * its last command, the report must be printed after it.
  *
- * @return The return code from executing the first command in the chain.
- *         If the command type is not implemented, `EXIT_FAILURE` is returned.
+ * @return The return code of the timed chain.
  */
-int exec_head_cmd(struct cmd *cmd_chain, char **vars) {
+int exec_time_cmd(struct cmd_time *cmd_time, char **vars) {
+  struct timing timing;
+  timing_start(&timing, cmd_time->per_stage);
+  int ret = exec_chain(cmd_time->body, vars, 0);
+  timing_end(&timing);
+  return ret;
+}
+
+
+// Executes the first command of a chain, see exec_head_cmd
+int exec_head_dispatch(struct cmd *cmd_chain, char **vars, int last) {
   switch (cmd_chain->cmd_type) {
     case CMD_EMPTY:
       return g_prev_ret_val;
     case CMD_SIMPLE:
-      return exec_simple_cmd(cmd_chain->detail, vars);
+      return exec_simple_cmd(cmd_chain->detail, vars, last);
     case CMD_IF_ELSE:
-      return exec_if_else_cmd(cmd_chain->detail, vars);
+      return exec_if_else_cmd(cmd_chain->detail, vars, last);
     case CMD_FOR:
       return exec_for_cmd(cmd_chain->detail, vars);
+    case CMD_TIME:
+      return exec_time_cmd(cmd_chain->detail, vars);
     default:
       dprintf(2, "fsh: Not implemented\n");
       return EXIT_FAILURE;
   }
 }
 
+/**
+ * Executes the first, and only first command in a command chain
+ *
+ * @param cmd_chain The `struct cmd` representing the command chain.
+ * @param vars An array of variables usable by the command.
+ * @param last Whether the process exits after this command (see exec_chain).
+ *
+ * @return The return code from executing the first command in the chain.
+ *         If the command type is not implemented, `EXIT_FAILURE` is returned.
+ */
+int exec_head_cmd(struct cmd *cmd_chain, char **vars, int last) {
+  if (!g_profile_on || cmd_chain->cmd_type == CMD_EMPTY)
+    return exec_head_dispatch(cmd_chain, vars, last);
+  struct profile_frame frame;
+  profile_enter(&frame, cmd_chain, 0);
+  int ret = exec_head_dispatch(cmd_chain, vars, last);
+  profile_exit(&frame);
+  return ret;
+}
+
+
+// Value of `$!`: the pid of the last background job
+char g_bg_pid[16];
+
+/**
+ * Executes a pipeline of `pipe_count + 1` commands, starting at `cmd_chain`.
+ * Every command that outputs into a pipe is executed in a subshell, but the
+ * last one is executed in the current process. The subshells exit after their
+ * command, so an external command replaces them; so does the last command if
+ * `last` is set and there is no subshell to wait for.
+ *
+ * @return The return code from the last command of the pipeline, or
+ *         `EXIT_FAILURE` if an error occurs during the pipeline setup.
+ */
+int exec_pipeline(struct cmd *cmd_chain, int pipe_count, char **vars, int last) {
+  int ret, next_in, pid, i, p[2];
+  int per_stage = g_timing && g_timing->per_stage; // time -s
+  struct rusage before;
+  if (!pipe_count && !per_stage) return exec_head_cmd(cmd_chain, vars, last);
+  if (!pipe_count) {
+    timing_stage_begin(&before);
+    ret = exec_head_cmd(cmd_chain, vars, last);
+    timing_stage_end(cmd_chain, &before);
+    return ret;
+  }
+  int pipe_size = pipe_size_get();
+
+  // exec in parallel everything that outputs into a pipe
+  next_in = fcntl(0, F_DUPFD_CLOEXEC, 0);
+  int pids[pipe_count];
+  long starts[pipe_count];
+  struct cmd *stages[pipe_count];
+  for (i = 0; i < pipe_count; i++) {
+    if (pipe(p) == -1) {
+      perror("pipe");
+      return EXIT_FAILURE;
+    }
+    g_stats.pipes++;
+    // failures (limit of the memory of pipes of the user) keep the default
+    if (pipe_size) fcntl(p[1], F_SETPIPE_SZ, pipe_size);
+    TRACE_INT('B', "fork", "stage", i);
+    starts[i] = stats_now();
+    pid = fork();
+    if (pid != 0) TRACE_INT('E', "fork", "pid", pid);
+    if (pid > 0) g_forks++;
+    switch (pid) {
+      case -1:
+        perror("fork");
+        return EXIT_FAILURE;
+      case 0:
+        dup2(next_in, 0);
+        dup2(p[1], 1);
+        close(p[1]);
+        close(p[0]);
+        close(next_in);
+        ret = exec_head_cmd(cmd_chain, vars, 1);
+
+        if (g_sig_received) raise_sigint();
+        exit(ret);
+      default:
+        pids[i] = pid;
+        stages[i] = cmd_chain;
+        if (per_stage) timing_add_stage(cmd_chain, NULL);
+        close(p[1]);
+        close(next_in);
+        next_in = p[0];
+        cmd_chain = cmd_chain->next;
+    }
+  }
+
+  // exec the last command of the pipeline in the fsh process itself
+  int in_save = fcntl(0, F_DUPFD_CLOEXEC, 0);
+  dup2(next_in, 0);
+  close(next_in);
+  if (per_stage) timing_stage_begin(&before);
+  ret = exec_head_cmd(cmd_chain, vars, 0);
+  if (per_stage) timing_stage_end(cmd_chain, &before);
+  dup2(in_save, 0);
+  close(in_save);
+
+  // wait of all commands of the pipeline to finish
+  if (pipe_size_auto() || per_stage) {
+    struct rusage usage;
+    long switches = 0;
+    for (i = 0; i < pipe_count; i++) {
+      if (wait_cmd_usage(pids[i], &usage) == 256) return EXIT_FAILURE;
+      stats_record(&g_stats.child_run, stats_now() - starts[i]);
+      if (usage.ru_nvcsw > switches) switches = usage.ru_nvcsw;
+      if (per_stage) timing_add_stage(stages[i], &usage);
+    }
+    if (pipe_size_auto()) pipe_size_feedback(switches);
+    return ret;
+  }
+  for (i = 0; i < pipe_count; i++) {
+    if (wait_cmd(pids[i]) == 256) return EXIT_FAILURE;
+    stats_record(&g_stats.child_run, stats_now() - starts[i]);
+  }
+  return ret;
+}
+
+/**
+ * Executes a pipeline of `pipe_count + 1` commands in a background subshell,
+ * and hands it to the child supervisor. Like in sh without job control, the
+ * job ignores SIGINT and reads from /dev/null unless redirected, so that it
+ * is not disturbed by what happens in the foreground. `$!` is set to its pid.
+ *
+ * @return `EXIT_SUCCESS`, or `EXIT_FAILURE` if the job could not be started.
+ */
+int exec_background(struct cmd *cmd_chain, int pipe_count, char **vars) {
+  TRACE('B', "fork", NULL, NULL);
+  int pid = fork(), ret;
+  if (pid != 0) TRACE_INT('E', "fork", "pid", pid);
+  if (pid > 0) g_forks++;
+  switch (pid) {
+    case -1:
+      perror("fork");
+      return EXIT_FAILURE;
+    case 0: {
+      struct sigaction sa = { 0 };
+      sa.sa_handler = SIG_IGN;
+      sigaction(SIGINT, &sa, NULL);
+      int null_fd = open("/dev/null", O_RDONLY);
+      if (null_fd > 0) {
+        dup2(null_fd, 0);
+        close(null_fd);
+      }
+      ret = exec_pipeline(cmd_chain, pipe_count, vars, 1);
+      exit(ret);
+    }
+  }
+
+  if (supervisor_add(pid) == -1) {
+    perror("fsh: background job");
+    return EXIT_FAILURE;
+  }
+  sprintf(g_bg_pid, "%d", pid);
+  vars['!'] = g_bg_pid;
+  return EXIT_SUCCESS;
+}
 
 /**
  * Executes a chain of commands, i.e. pipelines and commands separated by
- * `;`. It processes commands in parallel (with subshells) when a pipeline
- * is encountered, but always executes the last command in the chain in the
- * current process.
+ * `;` or `&`. Pipelines followed by `&` are executed in background, the
+ * others are waited for.
  *
  * @param cmd_chain The `cmd` structure representing the command chain.
  * @param vars The variable array used by the commands.
+ * @param last Whether the process exits after the chain: its last external
+ *             command can then replace the process instead of being waited
+ *             for (in a subshell, or at the end of `fsh -c`).
  *
  * @return The return code from the last executed command in the chain. Returns
  *         `EXIT_FAILURE` if any error occurs during command execution or pipeline setup.
  */
-int exec_cmd_chain(struct cmd *cmd_chain, char **vars) {
-  int ret = 0, pipe_count, next_in, pid, i, p[2];
-  struct cmd *tmp;
+int exec_chain(struct cmd *cmd_chain, char **vars, int last) {
+  int ret = 0, pipe_count;
+  struct cmd *end;
 
+  TRACE('B', "chain", NULL, NULL);
   while (!g_sig_received && cmd_chain) {
     // count number of pipes
     pipe_count = 0;
-    tmp = cmd_chain;
-    while (tmp->next_type == NEXT_PIPE) {
+    end = cmd_chain;
+    while (end->next_type == NEXT_PIPE) {
       pipe_count++;
-      tmp = tmp->next;
-    }
-
-    // exec in parallel everything that outputs into a pipe
-    next_in = dup(0);
-    int pids[pipe_count];
-    for (i = 0; i < pipe_count; i++) {
-      if (pipe(p) == -1) {
-        perror("pipe");
-        return EXIT_FAILURE;
-      }
-      switch (pid = fork()) {
-        case -1:
-          perror("fork");
-          return EXIT_FAILURE;
-        case 0:
-          dup2(next_in, 0);
-          dup2(p[1], 1);
-          close(p[1]);
-          close(p[0]);
-          close(next_in);
-          ret = exec_head_cmd(cmd_chain, vars);
-
-          if (g_sig_received) raise_sigint();
-          exit(ret);
-        default:
-          pids[i] = pid;
-          close(p[1]);
-          close(next_in);
-          next_in = p[0];
-          cmd_chain = cmd_chain->next;
-      }
+      end = end->next;
     }
 
-    // exec the last command of the pipeline in the fsh process itself
-    int in_save = dup(0);
-    dup2(next_in, 0);
-    close(next_in);
-    ret = exec_head_cmd(cmd_chain, vars);
-    dup2(in_save, 0);
-    close(in_save);
-
-    // wait of all commands of the pipeline to finish
-    for (i = 0; i < pipe_count; i++) {
-      if (wait_cmd(pids[i]) == 256) return EXIT_FAILURE;
+    if (end->next_type == NEXT_BACKGROUND) {
+      ret = exec_background(cmd_chain, pipe_count, vars);
+      // a `&` at the end of the chain is followed by an empty command
+      if (end->next->cmd_type == CMD_EMPTY && end->next->next_type == NEXT_NONE) break;
+    } else if (g_profile_on && pipe_count) {
+      struct profile_frame frame;
+      profile_enter(&frame, cmd_chain, 1);
+      ret = exec_pipeline(cmd_chain, pipe_count, vars, 0);
+      profile_exit(&frame);
+    } else {
+      // the jobs started in background could not be waited for after an exec
+      ret = exec_pipeline(cmd_chain, pipe_count, vars,
+                          last && end->next_type == NEXT_NONE && !supervisor_has_jobs());
     }
 
-    cmd_chain = cmd_chain->next;
+    cmd_chain = end->next;
   }
+  TRACE_INT('E', "chain", "status", ret);
 
   return g_sig_received ? -1 : ret;
 }
+
+// Executes a chain of commands, see exec_chain
+int exec_cmd_chain(struct cmd *cmd_chain, char **vars) {
+  return exec_chain(cmd_chain, vars, 0);
+}
+
+// Executes the last chain of commands of the shell, see exec_chain
+int exec_cmd_chain_last(struct cmd *cmd_chain, char **vars) {
+  return exec_chain(cmd_chain, vars, 1);
+}
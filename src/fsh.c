@@ -1,19 +1,26 @@
 #include "fsh.h"
 
+#include <dlfcn.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <readline/readline.h>
-#include <readline/history.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 
 #include "cmd_types.h"
+#include "commands.h"
 #include "execution.h"
+#include "jobserver.h"
 #include "parsing.h"
+#include "profile.h"
+#include "script.h"
+#include "stats.h"
+#include "supervisor.h"
+#include "trace.h"
 #ifdef DEBUG
 #include "debug.h"
 #endif
@@ -27,6 +34,7 @@ char *g_cwd; // Current working directory
 char *g_prev_wd; // Previous working directory
 char *g_home; // Path to the user's home
 int g_prev_ret_val; // Previous return value
+int g_interactive; // Whether the commands are read with readline
 volatile sig_atomic_t g_sig_received = 0;
 
 char g_prompt[52];
@@ -86,47 +94,179 @@ int init_wd_vars() {
   return EXIT_SUCCESS;
 }
 
-int main(int argc, char* argv[]) {
-  struct sigaction sa = { 0 };
-  sa.sa_handler = SIG_IGN;
-  sigaction(SIGTERM, &sa, NULL);
-  sa.sa_handler = sig_handler;
-  sigaction(SIGINT, &sa, NULL);
+// Functions of readline, loaded by load_readline
+struct line_editor {
+  char *(*readline)(const char *prompt);
+  void (*add_history)(const char *line);
+};
+
+/**
+ * Loads readline with dlopen: linking the shell with it would make every
+ * non-interactive run load it too, which takes a large part of the startup of
+ * the shell. Without readline, the lines are read with getline, without
+ * edition nor history.
+ *
+ * @return 0 if readline was loaded, -1 otherwise.
+ */
+int load_readline(struct line_editor *editor) {
+  char *names[] = { "libreadline.so.8", "libreadline.so" };
+  void *handle = NULL;
+  for (size_t i = 0; i < sizeof(names) / sizeof(char *) && !handle; i++) {
+    handle = dlopen(names[i], RTLD_NOW | RTLD_LOCAL);
+  }
+  if (!handle) return -1;
 
-  rl_outstream = stderr;
+  FILE **outstream = dlsym(handle, "rl_outstream");
+  editor->readline = dlsym(handle, "readline");
+  editor->add_history = dlsym(handle, "add_history");
+  if (!outstream || !editor->readline || !editor->add_history) {
+    dlclose(handle);
+    return -1;
+  }
+  *outstream = stderr;
+  return 0;
+}
+
+// Reads a line after the prompt when readline is not available, the caller
+// must free it
+char *read_line_plain(char *prompt) {
+  // without readline, the markers of the escape sequences are not needed
+  for (char *c = prompt; *c; c++) {
+    if (*c != '\001' && *c != '\002') fputc(*c, stderr);
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len = getline(&line, &cap, stdin);
+  if (len == -1) {
+    free(line);
+    return NULL;
+  }
+  if (len && line[len - 1] == '\n') line[len - 1] = '\0';
+  return line;
+}
 
+// The interactive mode: reads the commands with readline, after a prompt
+void run_interactive(struct arena *line_arena) {
   char *line;
   struct cmd *cmd;
-
-  if (init_wd_vars() == EXIT_FAILURE ||
-    init_env_vars() == EXIT_FAILURE) return EXIT_FAILURE;
+  struct line_editor editor;
+  int has_readline = load_readline(&editor) == 0;
 
   while (1) {
+    supervisor_notify();
     update_prompt();
-    line = readline(g_prompt);
+    line = has_readline ? editor.readline(g_prompt) : read_line_plain(g_prompt);
     if (line == NULL) {
       break;
     }
 
     if (*line != '\0') {
-      add_history(line);
-      cmd = parse(line);
+      if (has_readline) editor.add_history(line);
+      cmd = parse(line, line_arena);
       if (cmd == NULL) {
         g_prev_ret_val = parsing_errno;
       } else {
 #ifdef DEBUG
         print_cmd(cmd);
 #endif
+        if (g_profile_on) profile_line();
         g_sig_received = 0;
         g_prev_ret_val = exec_cmd_chain(cmd, g_vars);
-        free_cmd(cmd);
       }
+      arena_reset(line_arena);
+      arena_reset(&g_scratch);
     }
 
     free(line);
   }
+}
+
+/**
+ * The non-interactive mode (`fsh FILE` or `fsh -c COMMANDS`): executes the
+ * commands of `script`, without prompt nor history. Like in sh, a syntax error
+ * stops the script, and SIGINT kills the shell.
+ */
+void run_script(struct script *script, struct arena *line_arena) {
+  char *line;
+  struct cmd *cmd;
+
+  while ((line = script_next(script))) {
+    cmd = parse(line, line_arena);
+    if (cmd == NULL) {
+      g_prev_ret_val = parsing_errno;
+      break;
+    }
+#ifdef DEBUG
+    print_cmd(cmd);
+#endif
+    if (g_profile_on) profile_line();
+    // the last command does not need to return to the shell, an external one
+    // replaces it instead of being forked, unless its profile must be reported
+    if (script_at_end(script) && !g_profile_on) g_prev_ret_val = exec_cmd_chain_last(cmd, g_vars);
+    else g_prev_ret_val = exec_cmd_chain(cmd, g_vars);
+    arena_reset(line_arena);
+    arena_reset(&g_scratch);
+    if (g_sig_received) raise_sigint();
+  }
+  if (errno == ENOMEM) {
+    perror("fsh");
+    g_prev_ret_val = EXIT_FAILURE;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  struct sigaction sa = { 0 };
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = sig_handler;
+  sigaction(SIGINT, &sa, NULL);
+
+  // fsh, fsh FILE, or fsh -c COMMANDS, after --profile[=FILE]
+  struct script script;
+  char *profile = NULL;
+  if (argc > 1 && strncmp(argv[1], "--profile", 9) == 0 &&
+      (argv[1][9] == '\0' || argv[1][9] == '=')) {
+    profile = argv[1] + 9;
+    argv++;
+    argc--;
+  }
+  g_interactive = argc == 1;
+  if (argc > 3 || (argc == 3 && strcmp(argv[1], "-c") != 0) ||
+      (argc == 2 && strcmp(argv[1], "-c") == 0)) {
+    dprintf(2, "usage: fsh [--profile[=FILE]] [-c COMMANDS | FILE]\n");
+    return ERROR_SYNTAX;
+  }
+  if (argc == 3) {
+    script_open_string(&script, argv[2]);
+  } else if (argc == 2 && script_open_file(&script, argv[1]) == -1) {
+    dprintf(2, "fsh: %s: %s\n", argv[1], strerror(errno));
+    return 127;
+  }
+
+  if (register_internal_commands() == -1) {
+    perror("fsh");
+    return EXIT_FAILURE;
+  }
+  jobserver_init();
+  trace_init();
+  stats_init();
+  if (profile) profile_init(*profile == '=' ? profile + 1 : NULL);
+
+  struct arena line_arena = { 0 }; // syntax tree of the current line
+
+  if (init_wd_vars() == EXIT_FAILURE ||
+    init_env_vars() == EXIT_FAILURE) return EXIT_FAILURE;
+
+  if (g_interactive) {
+    run_interactive(&line_arena);
+  } else {
+    run_script(&script, &line_arena);
+    script_close(&script);
+  }
 
   if (g_prev_wd) free(g_prev_wd);
   free(g_cwd);
+  arena_free(&line_arena);
+  arena_free(&g_scratch);
   return g_prev_ret_val;
 }
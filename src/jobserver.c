@@ -0,0 +1,152 @@
+#include "jobserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* JOBSERVER:
+Parallel loops share their concurrency with the other fsh instances and with
+GNU make through the protocol of the make jobserver: a pipe (or a named fifo)
+holds one byte, a token, for each job that may run on top of the one every
+process is implicitly allowed to run. A process reads a token before starting
+an additional job, and writes the same byte back when that job is done.
+
+When the shell is started by make (or by another fsh), the jobserver is found
+in the `--jobserver-auth` option of MAKEFLAGS. Otherwise, if FSH_JOBS is set
+to N, the shell creates a jobserver with N - 1 tokens and adds it to MAKEFLAGS,
+so that the fsh and make started by the loops join it. Without any of them,
+parallel loops are only limited by their `-p` argument.
+
+The descriptors given by make are shared with other processes, so they can
+not be made non-blocking: the read end is reopened through /proc to get a
+non-blocking descriptor of our own, that can be polled without the risk of
+blocking in read when another process takes the token first.
+*/
+
+struct jobserver {
+  int read_fd; // non-blocking, -1 if there is no jobserver
+  int write_fd;
+};
+
+struct jobserver g_jobserver = { -1, -1 };
+
+
+// Checks that `fd` is an open pipe, like make does before using it
+int jobserver_valid_fd(int fd) {
+  struct stat st;
+  return fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Uses the pipe `r`, `w` as jobserver, through a non-blocking duplicate of `r`
+void jobserver_use_pipe(int r, int w) {
+  if (!jobserver_valid_fd(r) || !jobserver_valid_fd(w)) return;
+  char proc_path[64];
+  sprintf(proc_path, "/proc/self/fd/%d", r);
+  g_jobserver.read_fd = open(proc_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (g_jobserver.read_fd != -1) g_jobserver.write_fd = w;
+}
+
+// Joins the jobserver described by the value of --jobserver-auth, which is
+// either `fifo:PATH` or `R,W` (file descriptors)
+void jobserver_join(char *auth, int len) {
+  char value[len + 1];
+  memcpy(value, auth, len);
+  value[len] = '\0';
+
+  if (strncmp(value, "fifo:", 5) == 0) {
+    int fd = open(value + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return;
+    g_jobserver.read_fd = fd;
+    g_jobserver.write_fd = fd;
+    return;
+  }
+
+  int r, w;
+  if (sscanf(value, "%d,%d", &r, &w) == 2) jobserver_use_pipe(r, w);
+}
+
+// Creates a jobserver with `jobs - 1` tokens, and adds it to MAKEFLAGS. The
+// pipe style is used rather than a fifo, to be understood by make before 4.4
+void jobserver_create(int jobs) {
+  int p[2];
+  if (pipe(p) == -1) {
+    perror("fsh: jobserver");
+    return;
+  }
+  for (int i = 1; i < jobs; i++) {
+    if (write(p[1], "+", 1) != 1) break; // the pipe is full
+  }
+
+  char *makeflags = getenv("MAKEFLAGS");
+  char flags[(makeflags ? strlen(makeflags) : 0) + 64];
+  sprintf(flags, "%s%s-j%d --jobserver-auth=%d,%d", makeflags ? makeflags : "",
+          makeflags && *makeflags ? " " : "", jobs, p[0], p[1]);
+  setenv("MAKEFLAGS", flags, 1);
+  jobserver_use_pipe(p[0], p[1]);
+}
+
+/**
+ * Finds the jobserver given by make in MAKEFLAGS, or creates one if FSH_JOBS
+ * is set. It is called once at startup: the subshells inherit the result.
+ */
+void jobserver_init(void) {
+  char *makeflags = getenv("MAKEFLAGS");
+  char *auth = NULL, *found;
+  if (makeflags) {
+    // the last occurrence wins, the older name is still used by make 4.1
+    for (found = makeflags; (found = strstr(found, "--jobserver-")); found++) auth = found;
+  }
+  if (auth) {
+    auth = strchr(auth, '=');
+    if (auth) {
+      auth++;
+      jobserver_join(auth, strcspn(auth, " "));
+    }
+    return;
+  }
+
+  char *jobs = getenv("FSH_JOBS");
+  if (!jobs || !*jobs) return;
+  char *end;
+  errno = 0;
+  long nb_jobs = strtol(jobs, &end, 10);
+  if (errno || *end || nb_jobs < 1 || nb_jobs > 4096) {
+    dprintf(2, "fsh: FSH_JOBS: invalid number of jobs: %s\n", jobs);
+    return;
+  }
+  jobserver_create(nb_jobs);
+}
+
+// @return the descriptor to poll to wait for a token, or -1 if there is no
+//         jobserver
+int jobserver_fd(void) {
+  return g_jobserver.read_fd;
+}
+
+/**
+ * Takes a token from the jobserver without blocking.
+ *
+ * @return 1 if a token was stored in `token`, 0 if none is available for now,
+ *         -1 if there is no jobserver (anymore), in which case jobs do not
+ *         need tokens.
+ */
+int jobserver_acquire(char *token) {
+  if (g_jobserver.read_fd == -1) return -1;
+  ssize_t n = read(g_jobserver.read_fd, token, 1);
+  if (n == 1) return 1;
+  if (n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+
+  // every writer is gone, the jobserver can not give tokens anymore
+  close(g_jobserver.read_fd);
+  g_jobserver.read_fd = -1;
+  return -1;
+}
+
+// Gives back a token taken by jobserver_acquire
+void jobserver_release(char token) {
+  while (write(g_jobserver.write_fd, &token, 1) == -1 && errno == EINTR);
+}
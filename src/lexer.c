@@ -0,0 +1,207 @@
+#include "lexer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+
+/* LEXER:
+Cuts a line into tokens in a single pass, before parsing. Tokens are separated
+by spaces, tabs and newlines. Inside a word:
+- '...' keeps everything up to the next quote as is;
+- "..." does too, except for `$`, which still starts a variable, and for `\`
+  followed by `$`, `\` or `"`, which escapes it (or by a newline, both are
+  removed);
+- `\` escapes the next character, including a space, except a newline: both
+  are removed, outside of '' the line goes on.
+A word with quotes or escapes is a TOK_QUOTED token: `"|"` or `'for'` are
+plain arguments, only unquoted words can be operators or keywords.
+
+The text of the tokens is written in place in the line, without its quotes and
+escapes (it is never longer than the token itself), and null-terminated. Most
+words need no rewriting: they are found with strcspn, which the libc scans
+several bytes at a time, up to the next blank, quote or backslash.
+
+A `$` quoted with '' or escaped does not start a variable: such a word gets a
+mask of the `$` that do, for compile_template.
+*/
+
+// Adds an empty token at the end of `list`
+// @return the token, or NULL on allocation failure
+struct token *lex_push(struct token_list *list, struct arena *arena) {
+  if (list->nb == list->cap) {
+    int cap = list->cap ? 2 * list->cap : 32;
+    struct token *tokens = arena_alloc(arena, cap * sizeof(struct token));
+    if (!tokens) return NULL;
+    if (list->nb) memcpy(tokens, list->tokens, list->nb * sizeof(struct token));
+    list->tokens = tokens;
+    list->cap = cap;
+  }
+  struct token *tok = &list->tokens[list->nb++];
+  memset(tok, 0, sizeof(struct token));
+  return tok;
+}
+
+// The kind of the unquoted word `text`
+enum token_kind lex_kind(char *text) {
+  switch (text[0]) {
+    case '|': if (!text[1]) return TOK_PIPE; break;
+    case ';': if (!text[1]) return TOK_SEMICOLON; break;
+    case '&': if (!text[1]) return TOK_AMPERSAND; break;
+    case '{': if (!text[1]) return TOK_LBRACE; break;
+    case '}': if (!text[1]) return TOK_RBRACE; break;
+    case '2':
+      if (text[1] != '>') break;
+      text++;
+      // fall through
+    case '>':
+      if (!text[1] || ((text[1] == '>' || text[1] == '|') && !text[2])) return TOK_REDIR;
+      break;
+    case '<': if (!text[1]) return TOK_REDIR; break;
+  }
+  return TOK_WORD;
+}
+
+// Positions of the quoted `$` of the current word
+struct lex_dollars {
+  int *pos;
+  int nb;
+  int cap;
+};
+
+// Records that the `$` at position `pos` of the current word is quoted
+// @return 0 on success, -1 on allocation failure
+int lex_quote_dollar(struct lex_dollars *dollars, int pos, struct arena *arena) {
+  if (dollars->nb == dollars->cap) {
+    int cap = dollars->cap ? 2 * dollars->cap : 8;
+    int *new_pos = arena_alloc(arena, cap * sizeof(int));
+    if (!new_pos) return -1;
+    if (dollars->nb) memcpy(new_pos, dollars->pos, dollars->nb * sizeof(int));
+    dollars->pos = new_pos;
+    dollars->cap = cap;
+  }
+  dollars->pos[dollars->nb++] = pos;
+  return 0;
+}
+
+// Records the quoted `$` of the `len` bytes of the word copied at `pos`
+int lex_quote_dollars(struct lex_dollars *dollars, char *text, int pos, int len,
+                      struct arena *arena) {
+  char *dollar = memchr(text + pos, '$', len);
+  while (dollar) {
+    if (lex_quote_dollar(dollars, dollar - text, arena) == -1) return -1;
+    dollar++;
+    dollar = memchr(dollar, '$', text + pos + len - dollar);
+  }
+  return 0;
+}
+
+/**
+ * Cuts `line` into tokens, allocated in `arena`. The line is modified: the
+ * text of the tokens points inside it.
+ *
+ * @return 0 on success, -1 on failure (unterminated quote, or allocation
+ *         failure), after printing an error.
+ */
+int lex(char *line, struct arena *arena, struct token_list *out) {
+  char *read = line, *write, *quote;
+  struct lex_dollars dollars = { 0 };
+  size_t n;
+  memset(out, 0, sizeof(struct token_list));
+
+  while (1) {
+    read += strspn(read, " \t\n");
+    while (read[0] == '\\' && read[1] == '\n') read += 2 + strspn(read + 2, " \t\n");
+    if (!*read) return 0;
+
+    struct token *tok = lex_push(out, arena);
+    if (!tok) goto alloc_error;
+    tok->start = read - line;
+    tok->text = write = read;
+    tok->kind = TOK_WORD;
+    dollars.nb = 0;
+
+    while (1) {
+      n = strcspn(read, " \t\n'\"\\");
+      if (write != read) memmove(write, read, n);
+      read += n;
+      write += n;
+
+      if (*read == '\\' && read[1] == '\n') { // the line goes on
+        read += 2;
+      } else if (*read == '\\') {
+        tok->kind = TOK_QUOTED;
+        read++;
+        if (!*read) { // nothing to escape at the end of the line
+          *write++ = '\\';
+          break;
+        }
+        if (*read == '$' && lex_quote_dollar(&dollars, write - tok->text, arena) == -1)
+          goto alloc_error;
+        *write++ = *read++;
+      } else if (*read == '\'') {
+        tok->kind = TOK_QUOTED;
+        quote = read;
+        char *close = strchr(++read, '\'');
+        if (!close) goto unterminated;
+        n = close - read;
+        memmove(write, read, n);
+        if (lex_quote_dollars(&dollars, tok->text, write - tok->text, n, arena) == -1)
+          goto alloc_error;
+        write += n;
+        read = close + 1;
+      } else if (*read == '"') {
+        tok->kind = TOK_QUOTED;
+        quote = read++;
+        while (1) {
+          n = strcspn(read, "\"\\");
+          memmove(write, read, n);
+          read += n;
+          write += n;
+          if (*read == '"') {
+            read++;
+            break;
+          } else if (*read == '\\') {
+            char c = read[1];
+            if (c == '\n') { // the line goes on
+              read += 2;
+            } else if (c == '$' || c == '\\' || c == '"') {
+              if (c == '$' && lex_quote_dollar(&dollars, write - tok->text, arena) == -1)
+                goto alloc_error;
+              *write++ = c;
+              read += 2;
+            } else {
+              *write++ = *read++;
+            }
+          } else {
+            goto unterminated;
+          }
+        }
+      } else { // a blank, or the end of the line
+        break;
+      }
+    }
+
+    tok->len = read - (line + tok->start);
+    if (*read) read++; // the blank is overwritten by the end of the text
+    *write = '\0';
+    if (tok->kind == TOK_WORD) tok->kind = lex_kind(tok->text);
+
+    if (dollars.nb) {
+      int len = write - tok->text;
+      tok->var_mask = arena_alloc(arena, len);
+      if (!tok->var_mask) goto alloc_error;
+      for (int i = 0; i < len; i++) tok->var_mask[i] = tok->text[i] == '$';
+      for (int i = 0; i < dollars.nb; i++) tok->var_mask[dollars.pos[i]] = 0;
+    }
+  }
+
+  unterminated:
+  dprintf(2, "parsing: unterminated quote at column %d\n", (int) (quote - line) + 1);
+  return -1;
+
+  alloc_error:
+  perror("malloc");
+  return -1;
+}
@@ -0,0 +1,365 @@
+#include "metadata.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* METADATA ENGINE:
+Stats many files at once, to amortize the cost of metadata lookups over a whole
+batch instead of paying one blocking system call per entry.
+
+The batch is submitted as IORING_OP_STATX requests in an io_uring, and the
+kernel completes them concurrently. Each thread has its own ring, created on
+first use. A forked child never uses the ring of its parent (its memory is
+shared): it creates its own.
+
+When io_uring is not available (kernel older than 5.6, without
+IORING_OP_STATX, seccomp filter, disabled by sysctl, or FSH_NO_IO_URING set in
+the environment), the batch is split among
+a small pool of threads calling statx.
+*/
+
+#define META_POOL_THREADS 4
+
+struct meta_ring {
+  int fd;
+  pid_t owner;
+  unsigned int entries;
+
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+__thread struct meta_ring *t_ring;
+__thread int t_ring_failed; // io_uring is not available, don't retry
+
+
+void meta_ring_unmap(struct meta_ring *ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+  if (ring->fd >= 0) close(ring->fd);
+  free(ring);
+}
+
+// Whether the ring `fd` can execute IORING_OP_STATX. It appeared in Linux 5.6,
+// like IORING_REGISTER_PROBE: on older kernels, the probe itself fails, while
+// every statx would complete with -EINVAL.
+int meta_ring_has_statx(int fd) {
+  size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (!probe) return 0;
+  int ret = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+            probe->last_op >= IORING_OP_STATX &&
+            (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ret;
+}
+
+struct meta_ring *meta_ring_setup(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  struct meta_ring *ring = calloc(1, sizeof(struct meta_ring));
+  if (!ring) return NULL;
+  ring->owner = getpid();
+  ring->fd = syscall(SYS_io_uring_setup, META_BATCH_SIZE, &params);
+  if (ring->fd < 0 || !meta_ring_has_statx(ring->fd)) goto error;
+  ring->entries = params.sq_entries;
+
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    goto error;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      goto error;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto error;
+  }
+
+  char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return ring;
+
+  error:
+  meta_ring_unmap(ring);
+  return NULL;
+}
+
+// Returns the ring of the current thread, or NULL if io_uring can't be used
+struct meta_ring *meta_get_ring(void) {
+  if (t_ring && t_ring->owner != getpid()) {
+    // Inherited from the parent process through fork: drop our copy
+    meta_ring_unmap(t_ring);
+    t_ring = NULL;
+    t_ring_failed = 0;
+  }
+  if (!t_ring && !t_ring_failed) {
+    if (getenv("FSH_NO_IO_URING") || !(t_ring = meta_ring_setup())) t_ring_failed = 1;
+  }
+  return t_ring;
+}
+
+// Submits at most `ring->entries` requests and waits for their completion
+int meta_ring_batch(struct meta_ring *ring, struct meta_request *reqs, int nb, unsigned int mask) {
+  unsigned int tail = *ring->sq_tail;
+  for (int i = 0; i < nb; i++) {
+    unsigned int index = (tail + i) & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = reqs[i].dirfd;
+    sqe->addr = (unsigned long) reqs[i].name;
+    sqe->len = mask;
+    sqe->off = (unsigned long) &reqs[i].stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = i;
+    ring->sq_array[index] = index;
+  }
+  atomic_store_explicit((_Atomic unsigned int *) ring->sq_tail, tail + nb, memory_order_release);
+
+  int submitted = 0, completed = 0, ret;
+  while (completed < nb) {
+    ret = syscall(SYS_io_uring_enter, ring->fd, nb - submitted, nb - completed,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    submitted += ret;
+
+    unsigned int head = *ring->cq_head;
+    unsigned int cq_tail = atomic_load_explicit((_Atomic unsigned int *) ring->cq_tail, memory_order_acquire);
+    for (; head != cq_tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      reqs[cqe->user_data].error = cqe->res < 0 ? -cqe->res : 0;
+      completed++;
+    }
+    atomic_store_explicit((_Atomic unsigned int *) ring->cq_head, head, memory_order_release);
+  }
+  return 0;
+}
+
+
+/* Thread pool fallback */
+
+struct meta_pool {
+  pid_t owner;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  struct meta_request *reqs;
+  unsigned int mask;
+  int nb;
+  atomic_int next;
+  int remaining;
+  int active; // threads working on the current batch
+  long generation; // number of the current batch
+  long finished; // number of the last batch whose caller has returned
+};
+
+struct meta_pool g_meta_pool;
+pthread_mutex_t g_meta_pool_use = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t g_meta_pool_once = PTHREAD_ONCE_INIT;
+
+// Stats the requests of the current batch until there are none left
+int meta_pool_work(struct meta_request *reqs, int nb, unsigned int mask) {
+  struct meta_pool *pool = &g_meta_pool;
+  int i, done = 0;
+  while ((i = atomic_fetch_add(&pool->next, 1)) < nb) {
+    reqs[i].error = 0;
+    if (statx(reqs[i].dirfd, reqs[i].name, AT_SYMLINK_NOFOLLOW, mask, &reqs[i].stx) == -1)
+      reqs[i].error = errno;
+    done++;
+  }
+  return done;
+}
+
+void *meta_pool_thread(void *arg) {
+  struct meta_pool *pool = &g_meta_pool;
+  long generation;
+  int done;
+  pthread_mutex_lock(&pool->lock);
+  generation = pool->generation;
+  while (1) {
+    while (pool->generation == generation)
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+    generation = pool->generation;
+    // Woken too late: the caller already returned, and `reqs` is gone. Joining
+    // the batch is only possible while the caller still waits for `active`.
+    if (pool->finished == generation) continue;
+    pool->active++;
+    struct meta_request *reqs = pool->reqs;
+    int nb = pool->nb;
+    unsigned int mask = pool->mask;
+    pthread_mutex_unlock(&pool->lock);
+
+    done = meta_pool_work(reqs, nb, mask);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->active--;
+    pool->remaining -= done;
+    pthread_cond_broadcast(&pool->done_cond);
+  }
+  return NULL;
+}
+
+void meta_pool_init(void) {
+  pthread_mutex_init(&g_meta_pool.lock, NULL);
+  pthread_cond_init(&g_meta_pool.work_cond, NULL);
+  pthread_cond_init(&g_meta_pool.done_cond, NULL);
+  g_meta_pool.owner = 0;
+}
+
+// The threads of the pool do not survive fork, and their locks may be held
+void meta_pool_atfork_child(void) {
+  pthread_mutex_init(&g_meta_pool_use, NULL);
+  meta_pool_init();
+}
+
+void meta_pool_register(void) {
+  meta_pool_init();
+  pthread_atfork(NULL, NULL, meta_pool_atfork_child);
+}
+
+int meta_pool_batch(struct meta_request *reqs, int nb, unsigned int mask) {
+  struct meta_pool *pool = &g_meta_pool;
+  pthread_once(&g_meta_pool_once, meta_pool_register);
+
+  // One batch at a time, the pool is shared by every thread of the process
+  pthread_mutex_lock(&g_meta_pool_use);
+  if (pool->owner != getpid()) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    for (int i = 0; i < META_POOL_THREADS; i++) {
+      if (pthread_create(&thread, NULL, meta_pool_thread, NULL) == 0)
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pool->owner = getpid();
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->reqs = reqs;
+  pool->nb = nb;
+  pool->mask = mask;
+  pool->remaining = nb;
+  atomic_store(&pool->next, 0);
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  // The calling thread helps too, which also covers a pool without threads
+  int done = meta_pool_work(reqs, nb, mask);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->remaining -= done;
+  while (pool->remaining > 0 || pool->active > 0)
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  pool->finished = pool->generation;
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&g_meta_pool_use);
+  return 0;
+}
+
+
+/**
+ * Stats every request of `reqs` (without following symbolic links), filling
+ * the `stx` and `error` fields of each of them.
+ *
+ * @param mask The STATX_* fields needed by the caller.
+ *
+ * @return 0 when every request was processed (each one may still have failed
+ *         individually, see their `error` field), -1 on failure.
+ */
+int meta_stat_batch(struct meta_request *reqs, int nb, unsigned int mask) {
+  struct meta_ring *ring = meta_get_ring();
+  int chunk;
+
+  if (ring) {
+    for (int i = 0; i < nb; i += chunk) {
+      chunk = nb - i < (int) ring->entries ? nb - i : (int) ring->entries;
+      if (meta_ring_batch(ring, reqs + i, chunk, mask) == -1) {
+        // The ring is unusable, finish with the thread pool
+        meta_ring_unmap(ring);
+        t_ring = NULL;
+        t_ring_failed = 1;
+        return meta_pool_batch(reqs + i, nb - i, mask);
+      }
+    }
+    return 0;
+  }
+  return meta_pool_batch(reqs, nb, mask);
+}
+
+// Releases the ring of the current thread, must be called by threads that exit
+void meta_thread_release(void) {
+  if (t_ring && t_ring->owner == getpid()) meta_ring_unmap(t_ring);
+  t_ring = NULL;
+}
+
+// Converts the mode of a statx result to a DT_* constant
+unsigned char meta_d_type(struct statx *stx) {
+  return IFTODT(stx->stx_mode);
+}
+
+// Returns the name of the type of a file, as printed by ftype
+const char *meta_type_name(mode_t mode) {
+  switch (mode & S_IFMT) {
+    case S_IFREG: return "regular file";
+    case S_IFDIR: return "directory";
+    case S_IFLNK: return "symbolic link";
+    case S_IFIFO: return "named pipe";
+    default: return "other";
+  }
+}
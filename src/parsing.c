@@ -1,236 +1,320 @@
 #include "parsing.h"
 
+#include <errno.h>
+#include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "cmd_types.h"
+#include "lexer.h"
 
 /* PARSING FUNCTIONS:
-parse and free_cmd are the only exposed functions of this file, they are the
-ones that must be called from the main loop.
+parse is the only exposed function of this file, it is the one that must be
+called from the main loop. It cuts the line into tokens with lex (see
+lexer.c), then builds the syntax tree from them.
+
+Every node of the syntax tree is allocated in the arena given to parse, so
+the tree is freed at once by resetting that arena, even after an error.
+
+The state of the parsing is a `struct parser`, given to every parse_*
+function, so that several lines can be parsed at the same time.
 
 parse_* functions except consider that `out` points to an empty already
 allocated cmd that is ready to be filled.
 
-After the execution of any parse_* function, `token` points to the next token to
-be scanned, in particular, it is not be part of the command that have just been
-scanned.
+After the execution of any parse_* function, `parser->tok` points to the next
+token to be scanned, in particular, it is not be part of the command that have
+just been scanned.
 
-In case of error, -1 is propagated up to parse that calls free_cmd on the root
-of the syntax tree. Because of this, parse_* functions must ensure that the
-syntax tree remains valid even after an error.
+In case of error, -1 is propagated up to parse, which returns NULL.
 */
 
+struct parser {
+  struct token *tokens;
+  int nb_tokens;
+  int pos;
+  struct token *tok; // the current token, NULL at the end of the line
+  struct arena *arena; // where the syntax tree is allocated
+  int status; // the code of the first error encountered
+};
+
 // Parses a command of unknown type (calls the other parse_* functions)
-int parse_cmd(struct cmd *out);
+int parse_cmd(struct parser *parser, struct cmd *out);
 
 // Parses a simple command with eventual redirections
-int parse_simple(struct cmd *out);
+int parse_simple(struct parser *parser, struct cmd *out);
 
 // Parses a for loop
-int parse_for(struct cmd *out);
+int parse_for(struct parser *parser, struct cmd *out);
 
 // Parses an if-else construct
-int parse_if_else(struct cmd *out);
+int parse_if_else(struct parser *parser, struct cmd *out);
+
+// Parses a time command
+int parse_time(struct parser *parser, struct cmd *out);
 
 // Save the error code, only if it is the first error encountered
-void update_status(int error_code) {
-  if (!parsing_errno)
-    parsing_errno = error_code;
+void update_status(struct parser *parser, int error_code) {
+  if (!parser->status)
+    parser->status = error_code;
+}
+
+// Moves to the next token
+void next_token(struct parser *parser) {
+  parser->pos++;
+  parser->tok = parser->pos < parser->nb_tokens ? &parser->tokens[parser->pos] : NULL;
+}
+
+// Whether the current token is of kind `kind`
+int token_kind_is(struct parser *parser, enum token_kind kind) {
+  return parser->tok && parser->tok->kind == kind;
+}
+
+// Whether the current token is the unquoted word `word`
+int token_word_is(struct parser *parser, char *word) {
+  return token_kind_is(parser, TOK_WORD) && strcmp(parser->tok->text, word) == 0;
+}
+
+// Whether `tok` is an argument: a word, quoted or not
+int is_arg(struct token *tok) {
+  return tok && (tok->kind == TOK_WORD || tok->kind == TOK_QUOTED);
 }
 
 int parsing_errno;
-char *token;
 
-struct cmd *parse(char *line) {
-  // create the root of the syntax tree
+struct cmd *parse(char *line, struct arena *arena) {
+  struct parser parser = { 0 };
+  struct token_list tokens;
+  parser.arena = arena;
   parsing_errno = 0;
-  struct cmd *root = calloc(1, sizeof(struct cmd));
-  if (!root) return NULL;
 
-  // load the line in strtok
-  token = strtok(line, " ");
+  if (lex(line, arena, &tokens) == -1) {
+    parsing_errno = ERROR_SYNTAX;
+    return NULL;
+  }
+  parser.tokens = tokens.tokens;
+  parser.nb_tokens = tokens.nb;
+  parser.pos = -1;
+  next_token(&parser);
+
+  // create the root of the syntax tree
+  struct cmd *root = arena_zalloc(arena, sizeof(struct cmd));
+  if (!root) return NULL;
 
-  int ret = parse_cmd(root);
-  if (ret == -1 || token) {
+  int ret = parse_cmd(&parser, root);
+  if (ret == -1 || parser.tok) {
     // if parse_cmd failed or if there is still a token to parse, then the
     // command was malformed
     if (ret != -1) {
       // Nothing bad happened during parsing but it stopped to early
       dprintf(2, "parsing: malformed command\n");
     }
-    free_cmd(root);
-    update_status(ERROR_SYNTAX);
+    update_status(&parser, ERROR_SYNTAX);
+    parsing_errno = parser.status;
     return NULL;
   }
 
   return root;
 }
 
-int parse_cmd(struct cmd *root) {
+int parse_cmd(struct parser *parser, struct cmd *root) {
   int inside_pipeline = 0;
-  while (token && strcmp(token, "{") && strcmp(token, "}")) {
+  while (parser->tok && parser->tok->kind != TOK_LBRACE && parser->tok->kind != TOK_RBRACE) {
+    enum token_kind kind = parser->tok->kind;
 
-    if (strcmp(token, "|") == 0 || strcmp(token, ";") == 0) {
-      // if we see ; or |, we add a new command to the chained list of commands
-      inside_pipeline = (strcmp(token, "|") == 0);
+    if (kind == TOK_PIPE || kind == TOK_SEMICOLON || kind == TOK_AMPERSAND) {
+      // if we see ;, | or &, we add a new command to the chained list of commands
+      inside_pipeline = (kind == TOK_PIPE);
 
       if ((inside_pipeline && root->cmd_type != CMD_SIMPLE) || root->cmd_type == CMD_EMPTY) return -1;
 
       // create and fill new root
-      struct cmd *new_root = calloc(1, sizeof(struct cmd));
+      struct cmd *new_root = arena_zalloc(parser->arena, sizeof(struct cmd));
       if (!new_root) return -1;
 
       // link new root to the old one
-      root->next_type = inside_pipeline ? NEXT_PIPE : NEXT_SEMICOLON;
+      if (inside_pipeline) root->next_type = NEXT_PIPE;
+      else root->next_type = kind == TOK_AMPERSAND ? NEXT_BACKGROUND : NEXT_SEMICOLON;
       root->next = new_root;
       root = new_root;
 
-      token = strtok(NULL, " ");
+      next_token(parser);
 
     } else if (root->cmd_type != CMD_EMPTY) {
         // everything except | and ; must be parsed on an empty root
         dprintf(2, "parsing: malformed command\n");
         return -1;
 
-    } else if (strcmp(token, "for") == 0) {
+    } else if (token_word_is(parser, "for")) {
       // We don't allow piping into for loops, it could be implemented but
       // needs special care regarding parallel loops
       if (inside_pipeline) return -1;
-      if (parse_for(root) == -1) return -1;
+      if (parse_for(parser, root) == -1) return -1;
+
+    } else if (token_word_is(parser, "if")) {
+      if (parse_if_else(parser, root) == -1) return -1;
 
-    } else if (strcmp(token, "if") == 0) {
-      if (parse_if_else(root) == -1) return -1;
+    } else if (token_word_is(parser, "time")) {
+      // time takes the rest of the chain, which can not be piped into
+      if (inside_pipeline) return -1;
+      if (parse_time(parser, root) == -1) return -1;
 
     } else {
-      if (parse_simple(root) == -1) return -1;
+      if (parse_simple(parser, root) == -1) return -1;
     }
   }
   return 0;
 }
 
-int is_redir(char *token) {
-  return (
-    strcmp(token, "<") == 0 ||
-    strcmp(token, ">") == 0 ||
-    strcmp(token, ">>") == 0 ||
-    strcmp(token, ">|") == 0 ||
-    strcmp(token, "2>") == 0 ||
-    strcmp(token, "2>>") == 0 ||
-    strcmp(token, "2>|") == 0
-  );
+// The next `$` of the text of `tok` from `from` that starts a variable (not
+// quoted, and followed by a name), or NULL
+char *next_var(struct token *tok, char *from) {
+  char *cur = strchr(from, '$');
+  if (tok->var_mask) {
+    while (cur && !tok->var_mask[cur - tok->text]) cur = strchr(cur + 1, '$');
+  }
+  return cur && cur[1] ? cur : NULL;
 }
 
-int is_simple_end(char *token) {
-  return (
-    strcmp(token, ";") == 0 ||
-    strcmp(token, "|") == 0 ||
-    strcmp(token, "{") == 0 ||
-    strcmp(token, "}") == 0
-  );
+/**
+ * Compiles the text of `tok` into `tpl`: a list of literal pieces of the text
+ * and variable slots (`$F`), so that it can be expanded without scanning it
+ * again at each execution. A NULL `tok` (no redirection) gets an empty
+ * template.
+ *
+ * An argument with `$$` is not compiled: whether its first `$` starts a
+ * variable depends on whether the variable `$` is set at execution time. When
+ * the argument has quoted `$`, which must never be expanded, `$$` is compiled
+ * as the variable `$`.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int compile_template(struct parser *parser, struct token *tok, struct arg_template *tpl) {
+  int nb_vars = 0;
+  char *cur;
+  tpl->nb_segments = 0;
+  tpl->segments = NULL;
+  if (!tok) return 0;
+
+  char *arg = tok->text;
+  for (cur = next_var(tok, arg); cur; cur = next_var(tok, cur + 2)) {
+    if (cur[1] == '$' && !tok->var_mask) {
+      tpl->nb_segments = -1;
+      return 0;
+    }
+    nb_vars++;
+  }
+  if (!nb_vars) return 0;
+
+  tpl->segments = arena_alloc(parser->arena, (2 * nb_vars + 1) * sizeof(struct arg_segment));
+  if (!tpl->segments) return -1;
+
+  char *literal = arg;
+  for (cur = next_var(tok, arg); cur; cur = next_var(tok, cur + 2)) {
+    if (cur > literal) {
+      tpl->segments[tpl->nb_segments++] = (struct arg_segment) { 0, cur - literal, literal };
+    }
+    tpl->segments[tpl->nb_segments++] = (struct arg_segment) { cur[1], 2, cur };
+    literal = cur + 2;
+  }
+  if (*literal) {
+    tpl->segments[tpl->nb_segments++] = (struct arg_segment) { 0, strlen(literal), literal };
+  }
+  return 0;
 }
 
-int parse_simple(struct cmd *out) {
+int parse_simple(struct parser *parser, struct cmd *out) {
   // create detail node and link it to the root
-  struct cmd_simple *detail = calloc(1, sizeof(struct cmd_simple));
+  struct cmd_simple *detail = arena_zalloc(parser->arena, sizeof(struct cmd_simple));
   if (!detail) return -1;
   out->cmd_type = CMD_SIMPLE;
   out->detail = detail;
 
-  // count argc and make argv
-  char *first_token = token;
+  // the arguments are the words up to the first redirection or operator
+  struct token *args = parser->tok;
   int argc = 0;
-  while (token && !is_redir(token) && !is_simple_end(token)) {
+  while (is_arg(parser->tok)) {
     argc++;
-    token = strtok(NULL, " ");
+    next_token(parser);
   }
 
-  detail->argv = malloc((argc + 1) * sizeof(char *));
+  detail->argv = arena_alloc(parser->arena, (argc + 1) * sizeof(char *));
   if (!(detail->argv)) return -1;
   detail->argc = argc;
-
-  detail->argv[0] = first_token;
+  int i;
+  for (i = 0; i < argc; i++) detail->argv[i] = args[i].text;
   detail->argv[argc] = NULL;
 
-  int i = 1;
-  for (char *p = first_token; i < argc; p++) {
-    if (*p == '\0') {
-      do { p++; } while (*p == ' ');
-      detail->argv[i] = p;
-      i++;
+  // parse redirections
+  struct token *redir_tok[3] = { NULL, NULL, NULL };
+  while (token_kind_is(parser, TOK_REDIR)) {
+    char *symbol = parser->tok->text;
+    int device = symbol[0] == '<' ? 0 : symbol[0] == '2' ? 2 : 1;
+    next_token(parser);
+    if (!is_arg(parser->tok)) {
+      if (device == 0) dprintf(2, "parsing: missing file name after <\n");
+      else dprintf(2, "parsing: missing file name after redirection\n");
+      return -1;
     }
-  }
+    redir_tok[device] = parser->tok;
 
-  // parse redirections
-  while (token && !is_simple_end(token)) {
-    if (strcmp(token, "<") == 0) {
-      detail->in = strtok(NULL, " ");
-      if (!(detail->in)) {
-        dprintf(2, "parsing: missing file name after <\n");
-        return -1;
-      }
+    if (device == 0) {
+      detail->in = parser->tok->text;
     } else {
-      char **name;
-      enum redir_type *type;
-      if (token[0] == '2') {
-        name = &(detail->err);
-        type = &(detail->err_type);
-        token++;
+      if (device == 2) symbol++;
+      enum redir_type type = symbol[1] == '\0' ? REDIR_NORMAL
+                             : symbol[1] == '>' ? REDIR_APPEND : REDIR_OVERWRITE;
+      if (device == 1) {
+        detail->out = parser->tok->text;
+        detail->out_type = type;
       } else {
-        name = &(detail->out);
-        type = &(detail->out_type);
-      }
-
-      if (strcmp(token, ">") == 0) {
-        *type = REDIR_NORMAL;
-      } else if (strcmp(token, ">>") == 0) {
-        *type = REDIR_APPEND;
-      } else if (strcmp(token, ">|") == 0) {
-        *type = REDIR_OVERWRITE;
-      } else {
-        dprintf(2, "parsing: unknown redirection symbol\n");
-        return -1;
-      }
-
-      *name = strtok(NULL, " ");
-      if (!*name) {
-        dprintf(2, "parsing: missing file name after redirection\n");
-        return -1;
+        detail->err = parser->tok->text;
+        detail->err_type = type;
       }
     }
+    next_token(parser);
+  }
+  if (is_arg(parser->tok)) {
+    dprintf(2, "parsing: unknown redirection symbol\n");
+    return -1;
+  }
 
-    token = strtok(NULL, " ");
+  // compile the arguments and the redirections file names
+  detail->templates = arena_alloc(parser->arena, argc * sizeof(struct arg_template));
+  if (!(detail->templates)) return -1;
+  for (i = 0; i < argc; i++) {
+    if (compile_template(parser, &args[i], &detail->templates[i]) == -1) return -1;
+  }
+  for (i = 0; i < 3; i++) {
+    if (compile_template(parser, redir_tok[i], &detail->redir_templates[i]) == -1) return -1;
   }
 
   return 0;
 }
 
 // Parses a body surrounded by braces
-struct cmd *parse_body() {
+struct cmd *parse_body(struct parser *parser) {
   // check that we have "{" before the body
-  if (!token || strcmp(token, "{")) {
+  if (!token_kind_is(parser, TOK_LBRACE)) {
     dprintf(2, "parsing: missing { before body\n");
     return NULL;
   }
-  token = strtok(NULL, " ");
+  next_token(parser);
 
   // alloc and parse the body
-  struct cmd *body = calloc(1, sizeof(struct cmd));
+  struct cmd *body = arena_zalloc(parser->arena, sizeof(struct cmd));
   if (!body) return NULL;
-  if (parse_cmd(body) == -1) {
-    free(body);
-    return NULL;
-  }
+  if (parse_cmd(parser, body) == -1) return NULL;
 
   // check that we have "}" at the end of the body
-  if (!token || strcmp(token, "}")) {
+  if (!token_kind_is(parser, TOK_RBRACE)) {
     dprintf(2, "parsing: missing } after body\n");
-    free(body);
     return NULL;
   }
-  token = strtok(NULL, " ");
+  next_token(parser);
 
   return body;
 }
@@ -244,158 +328,247 @@ int is_ftype(char c) {
   );
 }
 
-int check_duplicate(struct cmd_for *detail, char *option) {
+int check_duplicate(struct parser *parser, struct cmd_for *detail, char *option) {
   long ptr;
-  if (strcmp(token, "-A") == 0) {
+  if (token_word_is(parser, "-A")) {
     ptr = detail->list_all;
-  } else if (strcmp(token, "-r") == 0) {
+  } else if (token_word_is(parser, "-r")) {
     ptr = detail->recursive;
-  } else if (strcmp(token, "-e") == 0) {
+  } else if (token_word_is(parser, "-e")) {
     ptr = (long)(detail->filter_ext);
-  } else if (strcmp(token, "-t") == 0) {
+  } else if (token_word_is(parser, "-t")) {
     ptr = detail->filter_type;
-  } else if (strcmp(token, "-p") == 0) {
+  } else if (token_word_is(parser, "-p")) {
     ptr = detail->parallel;
+  } else if (token_word_is(parser, "-size") || token_word_is(parser, "-mtime") ||
+             token_word_is(parser, "-newer") || token_word_is(parser, "-perm") ||
+             token_word_is(parser, "-user")) {
+    ptr = 0; // the predicates can be repeated, like -size +1M -size -10M
   } else {
     dprintf(2, "parsing: unknown loop option %s\n", option);
-    update_status(ERROR_FOR_ARG);
+    update_status(parser, ERROR_FOR_ARG);
     return -1;
   }
 
   if (ptr) {
     dprintf(2, "parsing: duplicate for loop option %s\n", option);
-    update_status(ERROR_FOR_ARG);
+    update_status(parser, ERROR_FOR_ARG);
     return -1;
   }
   return 0;
 }
 
-int parse_for(struct cmd *out) {
+// Converts `arg`, of the form [+-]N, into pred->cmp and pred->value, and
+// returns what follows the number (NULL if there is no number)
+char *parse_pred_number(char *arg, struct for_pred *pred) {
+  char *end;
+  pred->cmp = arg[0] == '+' ? 1 : arg[0] == '-' ? -1 : 0;
+  if (pred->cmp) arg++;
+  if (*arg < '0' || *arg > '9') return NULL;
+  errno = 0;
+  pred->value = strtoll(arg, &end, 10);
+  return errno ? NULL : end;
+}
+
+// Parses the argument of the metadata predicate `option` (see predicate.c)
+// and adds the predicate to the loop
+int parse_for_pred(struct parser *parser, struct cmd_for *detail, char *option) {
+  next_token(parser);
+  if (!is_arg(parser->tok)) goto invalid;
+  char *arg = parser->tok->text, *end;
+
+  struct for_pred *preds = arena_alloc(parser->arena, (detail->nb_preds + 1) * sizeof(struct for_pred));
+  if (!preds) return -1;
+  if (detail->nb_preds) memcpy(preds, detail->preds, detail->nb_preds * sizeof(struct for_pred));
+  detail->preds = preds;
+  struct for_pred *pred = &preds[detail->nb_preds];
+  memset(pred, 0, sizeof(struct for_pred));
+
+  if (strcmp(option, "-size") == 0) {
+    pred->type = PRED_SIZE;
+    if (!(end = parse_pred_number(arg, pred))) goto invalid;
+    switch (*end) {
+      case 'c': pred->unit = 1; break;
+      case 'w': pred->unit = 2; break;
+      case '\0':
+      case 'b': pred->unit = 512; break;
+      case 'k': pred->unit = 1 << 10; break;
+      case 'M': pred->unit = 1 << 20; break;
+      case 'G': pred->unit = 1 << 30; break;
+      default: goto invalid;
+    }
+    if (*end && end[1]) goto invalid;
+  } else if (strcmp(option, "-mtime") == 0) {
+    pred->type = PRED_MTIME;
+    if (!(end = parse_pred_number(arg, pred)) || *end) goto invalid;
+  } else if (strcmp(option, "-newer") == 0) {
+    pred->type = PRED_NEWER;
+    pred->ref = arg;
+  } else if (strcmp(option, "-perm") == 0) {
+    pred->type = PRED_PERM;
+    pred->cmp = arg[0] == '/' ? 1 : arg[0] == '-' ? -1 : 0;
+    if (pred->cmp) arg++;
+    errno = 0;
+    pred->value = strtol(arg, &end, 8);
+    if (!*arg || *end || errno || pred->value > 07777) goto invalid;
+  } else { // -user
+    pred->type = PRED_USER;
+    struct passwd *pw = getpwnam(arg);
+    if (pw) {
+      pred->value = pw->pw_uid;
+    } else {
+      errno = 0;
+      pred->value = strtoll(arg, &end, 10);
+      if (!*arg || *end || errno || pred->value < 0) {
+        dprintf(2, "parsing: unknown user %s for loop option -user\n", arg);
+        update_status(parser, ERROR_FOR_ARG);
+        return -1;
+      }
+    }
+  }
+  detail->nb_preds++;
+  return 0;
+
+  invalid:
+  dprintf(2, "parsing: missing or invalid argument for loop option %s\n", option);
+  update_status(parser, ERROR_FOR_ARG);
+  return -1;
+}
+
+int parse_for(struct parser *parser, struct cmd *out) {
   // create detail node and link it to the root
-  struct cmd_for *detail = calloc(1, sizeof(struct cmd_for));
+  struct cmd_for *detail = arena_zalloc(parser->arena, sizeof(struct cmd_for));
   if (!detail) return -1;
   out->cmd_type = CMD_FOR;
   out->detail = detail;
 
   // get variable name
-  token = strtok(NULL, " ");
-  if (!token) {
+  next_token(parser);
+  if (!parser->tok) {
     dprintf(2, "parsing: missing variable name in for loop\n");
     return -1;
-  } else if (token[0] == '\0' || token[1] != '\0') {
+  } else if (parser->tok->text[0] == '\0' || parser->tok->text[1] != '\0') {
     dprintf(2, "parsing: variable name must be one character long\n");
     return -1;
   }
-  detail->var_name = token[0];
-  token = strtok(NULL, " ");
+  detail->var_name = parser->tok->text[0];
+  next_token(parser);
 
   // check that we have "in" after the variable
-  if (!token || strcmp(token, "in")) {
+  if (!token_word_is(parser, "in")) {
     dprintf(2, "parsing: missing \"in\" in for loop\n");
     return -1;
   }
 
-  // get directory name
-  detail->dir_name = strtok(NULL, " ");
-  if (!(detail->dir_name)) {
+  // get directory names, the first one is mandatory and the following ones
+  // stop at the first option or at the body
+  next_token(parser);
+  if (!parser->tok) {
     dprintf(2, "parsing: missing directory name in for loop\n");
     return -1;
   }
-  token = strtok(NULL, " ");
+  int cap = 0;
+  do {
+    if (detail->nb_dirs + 2 > cap) {
+      cap = cap ? cap * 2 : 4;
+      char **dir_names = arena_alloc(parser->arena, cap * sizeof(char *));
+      if (!dir_names) return -1;
+      if (detail->nb_dirs) memcpy(dir_names, detail->dir_names, detail->nb_dirs * sizeof(char *));
+      detail->dir_names = dir_names;
+    }
+    detail->dir_names[detail->nb_dirs++] = parser->tok->text;
+    detail->dir_names[detail->nb_dirs] = NULL;
+    next_token(parser);
+  } while (parser->tok && !(parser->tok->kind == TOK_WORD && parser->tok->text[0] == '-') &&
+           parser->tok->kind != TOK_LBRACE);
 
   // parse options
-  while (token && strcmp(token, "{")) {
-    if (check_duplicate(detail, token) == -1) return -1;
-    if (strcmp(token, "-A") == 0) {
+  while (parser->tok && parser->tok->kind != TOK_LBRACE) {
+    if (check_duplicate(parser, detail, parser->tok->text) == -1) return -1;
+    if (token_word_is(parser, "-A")) {
       detail->list_all = 1;
-    } else if (strcmp(token, "-r") == 0) {
+    } else if (token_word_is(parser, "-r")) {
       detail->recursive = 1;
-    } else if (strcmp(token, "-e") == 0) {
-      detail->filter_ext = strtok(NULL, " ");
-      if (!(detail->filter_ext)) {
+    } else if (token_word_is(parser, "-e")) {
+      next_token(parser);
+      if (!is_arg(parser->tok)) {
         dprintf(2, "parsing: missing or invalid argument for loop option -e\n");
-        update_status(ERROR_FOR_ARG);
+        update_status(parser, ERROR_FOR_ARG);
         return -1;
       }
-    } else if (strcmp(token, "-t") == 0) {
-      token = strtok(NULL, " ");
-      if (!token || strlen(token) != 1 || !is_ftype(token[0])) {
+      detail->filter_ext = parser->tok->text;
+    } else if (token_word_is(parser, "-t")) {
+      next_token(parser);
+      if (!is_arg(parser->tok) || strlen(parser->tok->text) != 1 || !is_ftype(parser->tok->text[0])) {
         dprintf(2, "parsing: missing or invalid argument for loop option -t\n");
-        update_status(ERROR_FOR_ARG);
+        update_status(parser, ERROR_FOR_ARG);
         return -1;
       }
-      detail->filter_type = token[0];
-    } else if (strcmp(token, "-p") == 0) {
-      token = strtok(NULL, " ");
-      if (!token || sscanf(token, "%d", &(detail->parallel)) != 1) {
+      detail->filter_type = parser->tok->text[0];
+    } else if (token_word_is(parser, "-p")) {
+      next_token(parser);
+      if (!is_arg(parser->tok) || sscanf(parser->tok->text, "%d", &(detail->parallel)) != 1) {
         dprintf(2, "parsing: missing or invalid argument for loop option -p\n");
-        update_status(ERROR_FOR_ARG);
+        update_status(parser, ERROR_FOR_ARG);
         return -1;
       }
+    } else if (parse_for_pred(parser, detail, parser->tok->text) == -1) {
+      return -1;
     }
-    token = strtok(NULL, " ");
+    next_token(parser);
   }
 
   // parse the body
-  detail->body = parse_body();
+  detail->body = parse_body(parser);
   if (!(detail->body)) return -1;
 
   return 0;
 }
 
-int parse_if_else(struct cmd *out) {
+int parse_if_else(struct parser *parser, struct cmd *out) {
   // create detail node and link it to the root
-  struct cmd_if_else *detail = calloc(1, sizeof(struct cmd_if_else));
+  struct cmd_if_else *detail = arena_zalloc(parser->arena, sizeof(struct cmd_if_else));
   if (!detail) return -1;
   out->cmd_type = CMD_IF_ELSE;
   out->detail = detail;
 
   // parse and fill the test command
-  token = strtok(NULL, " ");
-  detail->cmd_test = calloc(1, sizeof(struct cmd));
-  if (!(detail->cmd_test) || parse_cmd(detail->cmd_test) == -1) return -1;
+  next_token(parser);
+  detail->cmd_test = arena_zalloc(parser->arena, sizeof(struct cmd));
+  if (!(detail->cmd_test) || parse_cmd(parser, detail->cmd_test) == -1) return -1;
 
   // parse the first body
-  detail->cmd_then = parse_body();
+  detail->cmd_then = parse_body(parser);
   if (!(detail->cmd_then)) return -1;
 
   // check if there is an else branch, if no return normally
-  if (!token || strcmp(token, "else")) return 0;
-  token = strtok(NULL, " ");
+  if (!token_word_is(parser, "else")) return 0;
+  next_token(parser);
 
   // parse the else body
-  detail->cmd_else = parse_body();
+  detail->cmd_else = parse_body(parser);
   if (!(detail->cmd_else)) return -1;
 
   return 0;
 }
 
-void free_cmd(struct cmd *cmd) {
-  switch (cmd->cmd_type) {
-    case CMD_EMPTY:
-      break;
-
-    case CMD_SIMPLE:
-      struct cmd_simple *simple = (struct cmd_simple *)(cmd->detail);
-      if (simple->argv != NULL) free(simple->argv);
-      free(simple);
-      break;
-
-    case CMD_IF_ELSE:
-      struct cmd_if_else *if_else = (struct cmd_if_else *)(cmd->detail);
-      if (if_else->cmd_test != NULL) free_cmd(if_else->cmd_test);
-      if (if_else->cmd_then != NULL) free_cmd(if_else->cmd_then);
-      if (if_else->cmd_else != NULL) free_cmd(if_else->cmd_else);
-      free(if_else);
-      break;
-
-    case CMD_FOR:
-      struct cmd_for *cmd_for = (struct cmd_for *)(cmd->detail);
-      if (cmd_for->body != NULL) free_cmd(cmd_for->body);
-      free(cmd_for);
-      break;
+int parse_time(struct parser *parser, struct cmd *out) {
+  // create detail node and link it to the root
+  struct cmd_time *detail = arena_zalloc(parser->arena, sizeof(struct cmd_time));
+  if (!detail) return -1;
+  out->cmd_type = CMD_TIME;
+  out->detail = detail;
+
+  next_token(parser);
+  if (token_word_is(parser, "-s")) {
+    detail->per_stage = 1;
+    next_token(parser);
   }
 
-  if (cmd->next_type != NEXT_NONE) free_cmd(cmd->next);
-  free(cmd);
+  // the timed commands go until the end of the chain (a `{`, a `}`, or the
+  // end of the line)
+  detail->body = arena_zalloc(parser->arena, sizeof(struct cmd));
+  if (!(detail->body) || parse_cmd(parser, detail->body) == -1) return -1;
+
+  return 0;
 }
@@ -0,0 +1,226 @@
+#include "pathcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "strhash.h"
+
+/* PATH CACHE:
+Remembers the absolute path of the external commands found in PATH, so that
+they can be executed directly instead of trying to execve them in every
+directory of PATH in turn, as execvp and posix_spawnp do.
+
+The cache is a hash table with chaining, indexed by the name of the command.
+It is emptied when PATH changes (its value is compared with the one the cache
+was built with before each lookup), and an entry is looked up again when its
+binary can not be found anymore.
+
+Only absolute paths are cached: a command found through a relative directory
+of PATH (an empty entry or `.`, for example) depends on the current directory,
+and is left to posix_spawnp.
+*/
+
+// Used when PATH is not set, like execvp
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+struct path_entry {
+  char *name;
+  char *path;
+  uint32_t hash;
+  long hits;
+  struct path_entry *next;
+};
+
+struct path_cache {
+  struct path_entry **buckets;
+  int nb_buckets;
+  int nb_entries;
+  char *path_var; // value of PATH when the entries were found
+};
+
+struct path_cache g_path_cache = { 0 };
+
+
+void path_cache_clear(void) {
+  struct path_entry *entry, *next;
+  for (int i = 0; i < g_path_cache.nb_buckets; i++) {
+    for (entry = g_path_cache.buckets[i]; entry; entry = next) {
+      next = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+    g_path_cache.buckets[i] = NULL;
+  }
+  g_path_cache.nb_entries = 0;
+}
+
+// Empties the cache if PATH changed since the entries were found
+int path_cache_check_path(void) {
+  char *path_var = getenv("PATH");
+  if (!path_var) path_var = DEFAULT_PATH;
+  if (g_path_cache.path_var && strcmp(g_path_cache.path_var, path_var) == 0) return 0;
+
+  path_cache_clear();
+  free(g_path_cache.path_var);
+  g_path_cache.path_var = strdup(path_var);
+  return g_path_cache.path_var ? 0 : -1;
+}
+
+// Doubles the number of buckets, or creates the first ones
+int path_cache_grow(void) {
+  int nb_buckets = g_path_cache.nb_buckets ? g_path_cache.nb_buckets * 2 : 64;
+  struct path_entry **buckets = calloc(nb_buckets, sizeof(struct path_entry *));
+  if (!buckets) return -1;
+
+  struct path_entry *entry, *next;
+  for (int i = 0; i < g_path_cache.nb_buckets; i++) {
+    for (entry = g_path_cache.buckets[i]; entry; entry = next) {
+      next = entry->next;
+      entry->next = buckets[entry->hash & (nb_buckets - 1)];
+      buckets[entry->hash & (nb_buckets - 1)] = entry;
+    }
+  }
+  free(g_path_cache.buckets);
+  g_path_cache.buckets = buckets;
+  g_path_cache.nb_buckets = nb_buckets;
+  return 0;
+}
+
+/**
+ * Looks for the executable `name` in the directories of PATH, in the same
+ * order as execvp, relative directories included.
+ *
+ * @return the newly allocated path of the executable (relative if it was found
+ *         in a relative directory), or NULL if it was not found.
+ */
+char *path_find(char *name) {
+  int name_len = strlen(name);
+  char *dir = getenv("PATH"), *end;
+  struct stat st;
+  if (!dir) dir = DEFAULT_PATH;
+
+  while (1) {
+    end = strchrnul(dir, ':');
+    // an empty entry is the current directory
+    char *prefix = end == dir ? "." : dir;
+    int dir_len = end == dir ? 1 : end - dir;
+    char candidate[dir_len + name_len + 2];
+    memcpy(candidate, prefix, dir_len);
+    candidate[dir_len] = '/';
+    memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+    if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(candidate, X_OK) == 0) {
+      return strdup(candidate);
+    }
+    if (*end == '\0') return NULL;
+    dir = end + 1;
+  }
+}
+
+/**
+ * Looks for the executable `name` in the directories of PATH, like execvp.
+ *
+ * @return the newly allocated absolute path of the executable, or NULL if it
+ *         was not found or if it was found in a relative directory (it is then
+ *         left to posix_spawnp, which searches PATH in the same order).
+ */
+char *path_cache_search(char *name) {
+  char *path = path_find(name);
+  if (path && path[0] != '/') {
+    free(path);
+    return NULL;
+  }
+  return path;
+}
+
+/**
+ * Finds the absolute path of the external command `name`, from the cache or
+ * else from PATH, in which case it is added to the cache.
+ *
+ * @return the path of the command (owned by the cache, only valid until the
+ *         next change of the cache), or NULL if `name` is a path itself, if it
+ *         was not found, or on allocation failure. The command can then be
+ *         executed with posix_spawnp.
+ */
+char *path_cache_lookup(char *name) {
+  if (strchr(name, '/') || path_cache_check_path() == -1) return NULL;
+
+  uint32_t hash = str_hash(name);
+  struct path_entry *entry;
+  if (g_path_cache.nb_buckets) {
+    for (entry = g_path_cache.buckets[hash & (g_path_cache.nb_buckets - 1)];
+         entry; entry = entry->next) {
+      if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+        entry->hits++;
+        return entry->path;
+      }
+    }
+  }
+
+  char *path = path_cache_search(name);
+  if (!path) return NULL;
+  if (g_path_cache.nb_entries >= g_path_cache.nb_buckets && path_cache_grow() == -1) {
+    free(path);
+    return NULL;
+  }
+  entry = malloc(sizeof(struct path_entry));
+  if (entry) entry->name = strdup(name);
+  if (!entry || !entry->name) {
+    free(entry);
+    free(path);
+    return NULL;
+  }
+  entry->path = path;
+  entry->hash = hash;
+  entry->hits = 1;
+  entry->next = g_path_cache.buckets[hash & (g_path_cache.nb_buckets - 1)];
+  g_path_cache.buckets[hash & (g_path_cache.nb_buckets - 1)] = entry;
+  g_path_cache.nb_entries++;
+  return path;
+}
+
+/**
+ * Removes `name` from the cache, because its cached path is not valid anymore,
+ * and looks for it again in PATH.
+ *
+ * @return the same as path_cache_lookup.
+ */
+char *path_cache_refresh(char *name) {
+  if (!g_path_cache.nb_buckets) return path_cache_lookup(name);
+
+  uint32_t hash = str_hash(name);
+  struct path_entry **link = &g_path_cache.buckets[hash & (g_path_cache.nb_buckets - 1)];
+  for (; *link; link = &(*link)->next) {
+    struct path_entry *entry = *link;
+    if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      g_path_cache.nb_entries--;
+      break;
+    }
+  }
+  return path_cache_lookup(name);
+}
+
+// Prints the content of the cache, with the number of uses of each command
+void path_cache_print(void) {
+  path_cache_check_path();
+  if (!g_path_cache.nb_entries) {
+    dprintf(1, "hash: hash table empty\n");
+    return;
+  }
+  dprintf(1, "hits\tcommand\n");
+  struct path_entry *entry;
+  for (int i = 0; i < g_path_cache.nb_buckets; i++) {
+    for (entry = g_path_cache.buckets[i]; entry; entry = entry->next) {
+      dprintf(1, "%4ld\t%s\n", entry->hits, entry->path);
+    }
+  }
+}
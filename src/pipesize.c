@@ -0,0 +1,106 @@
+#include "pipesize.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* PIPE SIZE:
+Capacity of the pipes created between the stages of a pipeline, set with
+F_SETPIPE_SZ from the environment variable FSH_PIPE_SIZE:
+- a size in bytes, with an optional K, M or G suffix (`1M`), rounded up by
+  the kernel to a power of two pages;
+- `auto`, that starts with the default capacity of the kernel, and doubles it
+  after a pipeline in which a stage blocked often, up to the maximum allowed
+  to unprivileged users (/proc/sys/fs/pipe-max-size). The size learned is kept
+  for the next pipelines, so a loop body quickly gets suitable pipes. A stage
+  is considered to have blocked often when it made more than
+  PIPE_AUTO_SWITCHES voluntary context switches, as reported by wait4: a
+  writer waiting for a full pipe, or a reader for an empty one, gives up the
+  CPU each time.
+Without it, the pipes keep the default capacity (64 KiB).
+*/
+
+// Capacity of the pipes of the kernel, when F_SETPIPE_SZ is not used
+#define PIPE_DEFAULT_SIZE 65536
+
+struct pipe_size {
+  int init; // whether FSH_PIPE_SIZE was read
+  int size; // 0 to keep the default capacity
+  int is_auto;
+  int max;
+};
+
+struct pipe_size g_pipe_size = { 0 };
+
+
+// Reads the maximum capacity of a pipe for an unprivileged user
+int pipe_size_max(void) {
+  int max = 1 << 20, fd = open("/proc/sys/fs/pipe-max-size", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return max;
+  char buf[32];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n > 0) {
+    buf[n] = '\0';
+    max = atoi(buf);
+  }
+  return max > 0 ? max : 1 << 20;
+}
+
+// Reads FSH_PIPE_SIZE, once: the shell never changes it
+void pipe_size_init(void) {
+  g_pipe_size.init = 1;
+  char *value = getenv("FSH_PIPE_SIZE");
+  if (!value || !*value) return;
+
+  g_pipe_size.max = pipe_size_max();
+  if (strcmp(value, "auto") == 0) {
+    g_pipe_size.is_auto = 1;
+    g_pipe_size.size = PIPE_DEFAULT_SIZE;
+    return;
+  }
+
+  char *end;
+  errno = 0;
+  long long size = strtoll(value, &end, 10);
+  int shift = 0;
+  switch (*end) {
+    case 'G': case 'g': shift += 10; // fallthrough
+    case 'M': case 'm': shift += 10; // fallthrough
+    case 'K': case 'k': shift += 10; end++;
+  }
+  if (errno || *end || size <= 0) {
+    dprintf(2, "fsh: FSH_PIPE_SIZE: invalid size: %s\n", value);
+    return;
+  }
+  // a size too large to be shifted is clamped to the maximum anyway
+  size = size > LLONG_MAX >> shift ? LLONG_MAX : size << shift;
+  g_pipe_size.size = size > g_pipe_size.max ? g_pipe_size.max : size;
+}
+
+// @return the capacity to give to the pipes of the next pipeline, or 0 to
+//         keep the default one
+int pipe_size_get(void) {
+  if (!g_pipe_size.init) pipe_size_init();
+  return g_pipe_size.size;
+}
+
+// @return whether the automatic mode needs the resource usage of the stages
+//         of the pipelines (see pipe_size_feedback)
+int pipe_size_auto(void) {
+  if (!g_pipe_size.init) pipe_size_init();
+  return g_pipe_size.is_auto;
+}
+
+// Gives to the automatic mode the highest number of voluntary context switches
+// among the stages of a pipeline that just terminated
+void pipe_size_feedback(long switches) {
+  if (switches > PIPE_AUTO_SWITCHES && g_pipe_size.size < g_pipe_size.max) {
+    g_pipe_size.size *= 2;
+    if (g_pipe_size.size > g_pipe_size.max) g_pipe_size.size = g_pipe_size.max;
+  }
+}
@@ -0,0 +1,117 @@
+#include "predicate.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* METADATA PREDICATES:
+The options -size, -mtime, -newer, -perm and -user of a for loop select the
+entries by their metadata, like the tests of find with the same name:
+- -size [+-]N[cwbkMG]: the size rounded up to units of 512 bytes by default
+  (c: bytes, w: 2 bytes, k, M, G: KiB, MiB, GiB), so -size -1M only matches
+  empty files;
+- -mtime [+-]N: the number of whole days since the last modification, counted
+  from the start of the loop;
+- -newer REF: modified after REF, which is stat'ed when the loop starts;
+- -perm MODE, -perm -MODE, -perm /MODE: the permission bits are exactly MODE,
+  include all of MODE, or any of MODE (octal);
+- -user NAME or UID: the owner, looked up when the line is parsed.
++N means more than N, -N less than N. As in find, symbolic links are not
+followed.
+
+The predicates cost one statx per entry, with only the fields they need, and
+only for the entries that passed -e and -t: the loops without predicates never
+stat anything. Since they are evaluated before the body is launched, an entry
+that does not match never costs a fork.
+*/
+
+/**
+ * Resolves what the predicates of the loop compare to: the mtime of the
+ * reference of -newer, and the current time for -mtime. Must be called every
+ * time the loop starts.
+ *
+ * @return 0 on success, -1 if a reference file can not be stat'ed (after
+ *         printing an error).
+ */
+int pred_prepare(struct cmd_for *cmd_for) {
+  struct timespec now;
+  struct stat sb;
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (int i = 0; i < cmd_for->nb_preds; i++) {
+    struct for_pred *pred = &cmd_for->preds[i];
+    if (pred->type == PRED_MTIME) {
+      pred->time = now;
+    } else if (pred->type == PRED_NEWER) {
+      if (stat(pred->ref, &sb) == -1) {
+        dprintf(2, "for: -newer: ");
+        perror(pred->ref);
+        return -1;
+      }
+      pred->time = sb.st_mtim;
+    }
+  }
+  return 0;
+}
+
+// Compares `x` to the value of `pred`, according to its -N, N or +N form
+int pred_compare(struct for_pred *pred, long long x) {
+  if (pred->cmp < 0) return x < pred->value;
+  if (pred->cmp > 0) return x > pred->value;
+  return x == pred->value;
+}
+
+/**
+ * Evaluates the predicates of the loop on the entry `name` of the directory
+ * `dirfd` (or AT_FDCWD), with a single statx of the fields they need.
+ *
+ * @return 1 if the entry matches all of them, 0 otherwise (or if it can not
+ *         be stat'ed anymore).
+ */
+int pred_match(struct cmd_for *cmd_for, int dirfd, const char *name) {
+  unsigned int mask = 0;
+  int i;
+  for (i = 0; i < cmd_for->nb_preds; i++) {
+    switch (cmd_for->preds[i].type) {
+      case PRED_SIZE: mask |= STATX_SIZE; break;
+      case PRED_MTIME:
+      case PRED_NEWER: mask |= STATX_MTIME; break;
+      case PRED_PERM: mask |= STATX_MODE; break;
+      case PRED_USER: mask |= STATX_UID; break;
+    }
+  }
+
+  struct statx stx;
+  if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &stx) == -1) return 0;
+
+  for (i = 0; i < cmd_for->nb_preds; i++) {
+    struct for_pred *pred = &cmd_for->preds[i];
+    long long mode = stx.stx_mode & 07777;
+    int match;
+    switch (pred->type) {
+      case PRED_SIZE:
+        match = pred_compare(pred, (stx.stx_size + pred->unit - 1) / pred->unit);
+        break;
+      case PRED_MTIME: {
+        long long age = pred->time.tv_sec - stx.stx_mtime.tv_sec; // rounded down
+        match = pred_compare(pred, age >= 0 ? age / 86400 : -((86399 - age) / 86400));
+        break;
+      }
+      case PRED_NEWER:
+        match = stx.stx_mtime.tv_sec > pred->time.tv_sec ||
+                (stx.stx_mtime.tv_sec == pred->time.tv_sec &&
+                 stx.stx_mtime.tv_nsec > pred->time.tv_nsec);
+        break;
+      case PRED_PERM:
+        if (pred->cmp < 0) match = (mode & pred->value) == pred->value;
+        else if (pred->cmp > 0) match = !pred->value || (mode & pred->value);
+        else match = mode == pred->value;
+        break;
+      default: // PRED_USER
+        match = stx.stx_uid == pred->value;
+        break;
+    }
+    if (!match) return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,189 @@
+#include "profile.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmd_types.h"
+#include "debug.h"
+#include "stats.h"
+#include "timing.h"
+
+/* PROFILE:
+With `fsh --profile`, every command executed by the shell (exec_head_cmd) and
+every pipeline (exec_chain) is a node of a tree, in which the shell accounts
+the wall time, the CPU time (of the shell and of the children reaped meanwhile,
+like `time`), the number of executions and the number of processes created.
+The times of a node include the ones of the nodes inside it: the test and
+branches of an `if`, the body of a `for`, the commands of a pipeline.
+
+The syntax tree of a line is freed after its execution, so the profile has its
+own tree: each line executed gets a node under the root, and the nodes inside
+it are found by the address of their `struct cmd` among the children of the
+current node, which is only valid during the line. Their text is printed with
+the functions of debug.c when they are created.
+
+Only the shell is profiled: the commands of the subshells (the stages of a
+pipeline but the last, the body of a parallel loop, the background jobs) are
+accounted to the node that waits for them. At exit, the report is printed on
+stderr, and with `--profile=FILE`, the time spent in each node itself (without
+the nodes inside it) is written in FILE in the folded stacks format of
+flamegraph.pl (`label;label;label microseconds`).
+*/
+
+int g_profile_on = 0;
+int g_profile_pid;
+char *g_profile_folded_path;
+struct profile_node g_profile_root;
+struct profile_node *g_profile_cur = &g_profile_root;
+
+// In a forked child, whose executions are accounted by its parent
+void profile_after_fork(void) {
+  g_profile_on = 0;
+}
+
+/**
+ * Starts profiling, `folded_path` is the file for the folded stacks, or NULL.
+ * Must be called once when the shell starts, before it forks.
+ */
+void profile_init(char *folded_path) {
+  g_profile_folded_path = folded_path;
+  g_profile_pid = getpid();
+  pthread_atfork(NULL, NULL, profile_after_fork);
+  atexit(profile_report);
+  g_profile_on = 1;
+}
+
+// Adds a node at the end of the children of `parent`
+// @return the node, or NULL on allocation failure
+struct profile_node *profile_add_node(struct profile_node *parent, struct cmd *cmd, int pipeline) {
+  struct profile_node *node = calloc(1, sizeof(struct profile_node));
+  if (!node) return NULL;
+  node->cmd = cmd;
+  node->pipeline = pipeline;
+  node->parent = parent;
+  if (parent->last_child) parent->last_child->next_sibling = node;
+  else parent->children = node;
+  parent->last_child = node;
+  return node;
+}
+
+// Starts the accounting of a new line of commands
+void profile_line(void) {
+  struct profile_node *line = profile_add_node(&g_profile_root, NULL, 0);
+  g_profile_cur = line ? line : &g_profile_root;
+}
+
+/**
+ * Starts an execution of the command `cmd`, or of the pipeline starting at it
+ * if `pipeline` is set, which must be ended with profile_exit.
+ */
+void profile_enter(struct profile_frame *frame, struct cmd *cmd, int pipeline) {
+  struct profile_node *node = g_profile_cur->children;
+  while (node && (node->cmd != cmd || node->pipeline != pipeline)) node = node->next_sibling;
+  if (!node) {
+    node = profile_add_node(g_profile_cur, cmd, pipeline);
+    if (node) {
+      size_t size;
+      FILE *out = open_memstream(&node->label, &size);
+      if (out) {
+        if (pipeline) print_pipeline(out, cmd);
+        else print_cmd_node(out, cmd);
+        fclose(out);
+      }
+    }
+  }
+  frame->node = node;
+  if (!node) return; // this execution is not accounted
+  g_profile_cur = node;
+  frame->start_forks = g_forks + g_spawns;
+  timing_snapshot(&frame->start_usage);
+  clock_gettime(CLOCK_MONOTONIC, &frame->start_time);
+}
+
+// Ends an execution started with profile_enter
+void profile_exit(struct profile_frame *frame) {
+  struct profile_node *node = frame->node;
+  if (!node) return;
+  struct timespec end_time;
+  struct rusage usage;
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  timing_snapshot(&usage);
+
+  node->calls++;
+  node->forks += g_forks + g_spawns - frame->start_forks;
+  node->wall += end_time.tv_sec - frame->start_time.tv_sec +
+                (end_time.tv_nsec - frame->start_time.tv_nsec) / 1e9;
+  node->cpu += usage.ru_utime.tv_sec - frame->start_usage.ru_utime.tv_sec +
+               usage.ru_stime.tv_sec - frame->start_usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec - frame->start_usage.ru_utime.tv_usec +
+                usage.ru_stime.tv_usec - frame->start_usage.ru_stime.tv_usec) / 1e6;
+  g_profile_cur = node->parent;
+}
+
+// Prints the nodes of the list `node` and their children, indented by `depth`
+void profile_print_nodes(struct profile_node *node, int depth) {
+  for (; node; node = node->next_sibling) {
+    dprintf(2, "%10.3f %10.3f %8ld %7ld  %*s%s\n", node->wall * 1e3, node->cpu * 1e3,
+            node->calls, node->forks, 2 * depth, "", node->label ? node->label : "?");
+    profile_print_nodes(node->children, depth + 1);
+  }
+}
+
+// Writes the folded stacks of the list `node` and their children, `stack`
+// being the labels of their ancestors
+void profile_fold_nodes(FILE *out, struct profile_node *node, char *stack) {
+  for (; node; node = node->next_sibling) {
+    double self = node->wall;
+    for (struct profile_node *child = node->children; child; child = child->next_sibling)
+      self -= child->wall;
+
+    char *frame_stack;
+    if (asprintf(&frame_stack, "%s%s%s", stack, *stack ? ";" : "",
+                 node->label ? node->label : "?") == -1) continue;
+    // `;` separates the frames, it can not appear in a label
+    for (char *c = frame_stack + strlen(stack) + (*stack != '\0'); *c; c++)
+      if (*c == ';') *c = ',';
+    if ((long) (self * 1e6) > 0) fprintf(out, "%s %ld\n", frame_stack, (long) (self * 1e6));
+    profile_fold_nodes(out, node->children, frame_stack);
+    free(frame_stack);
+  }
+}
+
+void profile_free_nodes(struct profile_node *node) {
+  struct profile_node *next;
+  for (; node; node = next) {
+    next = node->next_sibling;
+    profile_free_nodes(node->children);
+    free(node->label);
+    free(node);
+  }
+}
+
+/**
+ * Prints the report of the profile on stderr, and writes the folded stacks,
+ * at the exit of the shell (not of its subshells).
+ */
+void profile_report(void) {
+  if (!g_profile_on || getpid() != g_profile_pid) return;
+  g_profile_on = 0;
+
+  dprintf(2, "%10s %10s %8s %7s  %s\n", "wall ms", "cpu ms", "calls", "forks", "command");
+  for (struct profile_node *line = g_profile_root.children; line; line = line->next_sibling)
+    profile_print_nodes(line->children, 0);
+
+  if (g_profile_folded_path) {
+    FILE *out = fopen(g_profile_folded_path, "w");
+    if (!out) {
+      dprintf(2, "fsh: --profile: %s: %s\n", g_profile_folded_path, strerror(errno));
+    } else {
+      for (struct profile_node *line = g_profile_root.children; line; line = line->next_sibling)
+        profile_fold_nodes(out, line->children, "");
+      fclose(out);
+    }
+  }
+  profile_free_nodes(g_profile_root.children);
+}
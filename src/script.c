@@ -0,0 +1,213 @@
+#include "script.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* SCRIPT READER:
+Reads the commands of a script file (`fsh FILE`) or of the argument of
+`fsh -c`, without readline. A file is mapped in memory rather than read, and
+scanned once: script_next cuts it into top-level commands, each one returned
+as a single line of tokens separated by spaces, like the lines parse gets
+from readline.
+
+Newlines separate commands, except:
+- after `|`, `{` or `else`, and before `else`, where the command goes on;
+- inside braces, where they become `;` between two commands of the body, and
+  are ignored elsewhere (after `{`, before `}`...).
+A `#` at the start of a token starts a comment, up to the end of the line.
+Quotes and backslashes are kept for the lexer (see lexer.c), but a token goes
+on up to the end of its quotes, blanks and newlines included.
+*/
+
+// Whether `tok` (of length `len`) is `str`
+int token_is(char *tok, int len, char *str) {
+  return (int) strlen(str) == len && memcmp(tok, str, len) == 0;
+}
+
+// Whether a newline after `tok` lets the command go on on the next line, at the
+// top level (outside of braces)
+int token_continues(char *tok, int len) {
+  return token_is(tok, len, "|") || token_is(tok, len, "{") || token_is(tok, len, "else");
+}
+
+// Whether a newline after `tok` is ignored inside braces: it is not the end of
+// a command
+int token_connects(char *tok, int len) {
+  return token_is(tok, len, "{") || token_is(tok, len, ";") || token_is(tok, len, "&") ||
+         token_is(tok, len, "|") || token_is(tok, len, "else");
+}
+
+// Whether `tok` can follow the commands of a body without a `;` before it
+int token_no_sep(char *tok, int len) {
+  return token_is(tok, len, "}") || token_is(tok, len, ";") || token_is(tok, len, "&") ||
+         token_is(tok, len, "|") || token_is(tok, len, "else");
+}
+
+// The end of the token starting at `cur`: the next blank outside of quotes, or
+// `end` if a quote is not terminated (the lexer will report it)
+char *script_token_end(char *cur, char *end) {
+  while (cur < end && *cur != ' ' && *cur != '\t' && *cur != '\r' && *cur != '\n') {
+    if (*cur == '\\') {
+      cur += cur + 1 < end ? 2 : 1;
+    } else if (*cur == '\'' || *cur == '"') {
+      char quote = *cur++;
+      while (cur < end && *cur != quote) {
+        if (quote == '"' && *cur == '\\' && cur + 1 < end) cur++;
+        cur++;
+      }
+      if (cur < end) cur++;
+    } else {
+      cur++;
+    }
+  }
+  return cur;
+}
+
+/**
+ * Maps the script file `path` in memory, or reads it if it can not be mapped
+ * (a pipe, for example).
+ *
+ * @return 0 on success, -1 on failure, with errno set.
+ */
+int script_open_file(struct script *script, char *path) {
+  memset(script, 0, sizeof(struct script));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) goto error;
+
+  if (S_ISREG(st.st_mode)) {
+    if (st.st_size > 0) {
+      script->start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+      if (script->start == MAP_FAILED) goto error;
+      script->map_len = st.st_size;
+    }
+  } else {
+    size_t len = 0, cap = 0;
+    ssize_t n;
+    do {
+      if (len == cap) {
+        cap = cap ? cap * 2 : 4096;
+        char *buf = realloc(script->start, cap);
+        if (!buf) goto error;
+        script->start = buf;
+      }
+      n = read(fd, script->start + len, cap - len);
+      if (n > 0) len += n;
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    if (n == -1) goto error;
+    st.st_size = len;
+  }
+  close(fd);
+  script->cur = script->start;
+  script->end = script->start + st.st_size;
+  return 0;
+
+  error:;
+  int err = errno;
+  if (!script->map_len) free(script->start);
+  script->start = NULL;
+  if (fd != -1) close(fd);
+  errno = err;
+  return -1;
+}
+
+// Reads the commands of the string `str` (the argument of -c), which must live
+// as long as the script
+void script_open_string(struct script *script, char *str) {
+  memset(script, 0, sizeof(struct script));
+  script->cur = str;
+  script->end = str + strlen(str);
+}
+
+// Appends `len` bytes to the current command, after a space if it is not empty
+// @return 0 on success, -1 on allocation failure
+int script_append(struct script *script, size_t *line_len, char *str, int len) {
+  if (*line_len + len + 2 > script->line_cap) {
+    size_t cap = script->line_cap ? script->line_cap : 256;
+    while (cap < *line_len + len + 2) cap *= 2;
+    char *line = realloc(script->line, cap);
+    if (!line) return -1;
+    script->line = line;
+    script->line_cap = cap;
+  }
+  if (*line_len) script->line[(*line_len)++] = ' ';
+  memcpy(script->line + *line_len, str, len);
+  *line_len += len;
+  script->line[*line_len] = '\0';
+  return 0;
+}
+
+/**
+ * Reads the next top-level command of the script.
+ *
+ * @return the command, as a line that can be given to parse (and modified by
+ *         it) and is valid until the next call, or NULL at the end of the
+ *         script or on allocation failure (with errno set to ENOMEM).
+ */
+char *script_next(struct script *script) {
+  char *cur = script->cur, *tok, *last = NULL;
+  size_t line_len = 0;
+  int depth = 0, last_len = 0, len, end_pending = 0, sep_pending = 0;
+
+  errno = 0;
+  while (1) {
+    // a mapped file is not terminated by a null byte, only `end` is reliable
+    while (cur < script->end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) cur++;
+    if (cur >= script->end) break;
+
+    if (*cur == '\n') {
+      cur++;
+      if (!line_len) continue; // empty line
+      if (depth == 0 && !token_continues(last, last_len)) end_pending = 1;
+      else if (depth > 0 && !token_connects(last, last_len)) sep_pending = 1;
+      continue;
+    }
+    if (*cur == '#') { // comment
+      cur = memchr(cur, '\n', script->end - cur);
+      if (!cur) cur = script->end;
+      continue;
+    }
+
+    tok = cur;
+    cur = script_token_end(cur, script->end);
+    len = cur - tok;
+    if (end_pending && !token_is(tok, len, "else")) { // next command
+      cur = tok;
+      break;
+    }
+    end_pending = 0;
+    if (sep_pending && !token_no_sep(tok, len) && script_append(script, &line_len, ";", 1) == -1)
+      goto alloc_error;
+    sep_pending = 0;
+
+    if (script_append(script, &line_len, tok, len) == -1) goto alloc_error;
+    if (token_is(tok, len, "{")) depth++;
+    if (token_is(tok, len, "}")) depth--;
+    last = tok;
+    last_len = len;
+  }
+
+  script->cur = cur;
+  return line_len ? script->line : NULL;
+
+  alloc_error:
+  errno = ENOMEM;
+  return NULL;
+}
+
+// Whether script_next has returned the last command of the script
+int script_at_end(struct script *script) {
+  // script_next skips the blanks and comments that follow the last command
+  return script->cur >= script->end;
+}
+
+void script_close(struct script *script) {
+  if (script->map_len) munmap(script->start, script->map_len);
+  else if (script->start) free(script->start);
+  free(script->line);
+}
@@ -0,0 +1,159 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* STATISTICS:
+Counters of what the shell does (processes created, pipes, directory entries
+read and filtered by the loops, waits for a slot of a parallel loop), and
+histograms of the latency of the spawns of external commands and of the run
+time of the children, printed by the `stats` command. They are always
+updated: a counter is an increment (an atomic one for those that the threads
+of the walker update, once per directory), and a histogram an increment of a
+bucket, next to a fork or a spawn that costs far more.
+
+The histograms are log-linear like HDR histograms: a duration in nanoseconds
+falls in one of 16 buckets for each power of two, so that the percentiles are
+given within 1/16 of their value whatever its magnitude, in a fixed array.
+
+Only the shell updates them: what its subshells do is lost with them, except
+the children they create, counted by the shell as the subshells themselves.
+With FSH_STATS=FILE, the statistics are appended to FILE as a JSON line when
+the shell exits, or replaces itself with its last command.
+*/
+
+struct stats g_stats;
+long g_forks;
+long g_spawns;
+char *g_stats_path;
+int g_stats_pid;
+
+// The monotonic time in nanoseconds
+long stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Index of the bucket of `ns`: exact below 16, then the 4 bits that follow the
+// highest bit set select one of the 16 buckets of its power of two
+int stats_bucket(long ns) {
+  if (ns < 16) return ns < 0 ? 0 : ns;
+  int exp = 63 - __builtin_clzl(ns);
+  return (exp - 3) * 16 + ((ns >> (exp - 4)) & 15);
+}
+
+// Highest value of the bucket `i`, but not more than the maximum recorded
+long stats_bucket_max(struct stats_histogram *hist, int i) {
+  if (i < 16) return i;
+  int shift = i / 16 - 1;
+  unsigned long high = ((unsigned long) (16 + i % 16) << shift) + (1UL << shift) - 1;
+  return high < (unsigned long) hist->max ? (long) high : hist->max;
+}
+
+void stats_record(struct stats_histogram *hist, long ns) {
+  hist->count++;
+  hist->sum += ns;
+  if (ns > hist->max) hist->max = ns;
+  hist->buckets[stats_bucket(ns)]++;
+}
+
+// The value under which a fraction `p` of the recorded values are
+long stats_percentile(struct stats_histogram *hist, double p) {
+  long rank = p * hist->count + 0.999999, seen = 0;
+  if (rank < 1) rank = 1;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) return stats_bucket_max(hist, i);
+  }
+  return hist->max;
+}
+
+double stats_us(long ns) {
+  return ns / 1e3;
+}
+
+void stats_print_histogram(FILE *out, char *name, struct stats_histogram *hist, int json) {
+  double mean = hist->count ? (double) hist->sum / hist->count : 0;
+  if (!json) {
+    fprintf(out, "%-16s count %ld, mean %.1f us, p50 %.1f us, p90 %.1f us, "
+                 "p99 %.1f us, p99.9 %.1f us, max %.1f us\n", name, hist->count,
+            stats_us(mean), stats_us(stats_percentile(hist, 0.5)),
+            stats_us(stats_percentile(hist, 0.9)), stats_us(stats_percentile(hist, 0.99)),
+            stats_us(stats_percentile(hist, 0.999)), stats_us(hist->max));
+    return;
+  }
+  fprintf(out, ",\"%s\":{\"count\":%ld,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+               "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,\"buckets\":[", name,
+          hist->count, stats_us(mean), stats_us(stats_percentile(hist, 0.5)),
+          stats_us(stats_percentile(hist, 0.9)), stats_us(stats_percentile(hist, 0.99)),
+          stats_us(stats_percentile(hist, 0.999)), stats_us(hist->max));
+  // the non-empty buckets, as [highest value in ns, count]
+  int first = 1;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    if (!hist->buckets[i]) continue;
+    fprintf(out, "%s[%ld,%ld]", first ? "" : ",", stats_bucket_max(hist, i), hist->buckets[i]);
+    first = 0;
+  }
+  fprintf(out, "]}");
+}
+
+/**
+ * Prints the statistics on `out`, as text or as a single JSON line.
+ */
+void stats_print(FILE *out, int json) {
+  struct stats *s = &g_stats;
+  char *names[] = { "forks", "spawns", "execs", "spawn_failures", "pipes", "dir_entries",
+                    "filtered_ext", "filtered_type", "filtered_meta", "slot_waits" };
+  long values[] = { g_forks - s->forks_base, g_spawns - s->spawns_base, s->execs, s->spawn_failures, s->pipes,
+                    s->dir_entries, s->filtered_ext, s->filtered_type, s->filtered_meta,
+                    s->slot_waits };
+  int nb = sizeof(values) / sizeof(long);
+
+  if (json) {
+    fprintf(out, "{\"pid\":%d", getpid());
+    for (int i = 0; i < nb; i++) fprintf(out, ",\"%s\":%ld", names[i], values[i]);
+    fprintf(out, ",\"slot_wait_us\":%.1f", stats_us(s->slot_wait_ns));
+  } else {
+    for (int i = 0; i < nb; i++) fprintf(out, "%-16s %ld\n", names[i], values[i]);
+    fprintf(out, "%-16s %.1f us\n", "slot_wait", stats_us(s->slot_wait_ns));
+  }
+  stats_print_histogram(out, "spawn_latency", &s->spawn_latency, json);
+  stats_print_histogram(out, "child_run", &s->child_run, json);
+  if (json) fprintf(out, "}\n");
+}
+
+void stats_reset(void) {
+  memset(&g_stats, 0, sizeof(struct stats));
+  g_stats.forks_base = g_forks;
+  g_stats.spawns_base = g_spawns;
+}
+
+/**
+ * Prepares the dump of the statistics at exit if FSH_STATS is set, must be
+ * called once when the shell starts.
+ */
+void stats_init(void) {
+  char *path = getenv("FSH_STATS");
+  if (!path || !*path) return;
+  g_stats_path = path;
+  g_stats_pid = getpid();
+  atexit(stats_dump);
+}
+
+// Appends the statistics to the file of FSH_STATS, once, from the shell only
+void stats_dump(void) {
+  if (!g_stats_path || getpid() != g_stats_pid) return;
+  FILE *out = fopen(g_stats_path, "ae");
+  if (!out) {
+    dprintf(2, "fsh: FSH_STATS: %s: %s\n", g_stats_path, strerror(errno));
+  } else {
+    stats_print(out, 1);
+    fclose(out);
+  }
+  g_stats_path = NULL;
+}
@@ -0,0 +1,11 @@
+#include "strhash.h"
+
+// FNV-1a hash of a string, used by the hash tables of the shell
+uint32_t str_hash(char *str) {
+  uint32_t hash = 2166136261u;
+  while (*str) {
+    hash ^= (unsigned char) *str++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
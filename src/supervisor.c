@@ -0,0 +1,301 @@
+#include "supervisor.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fsh.h"
+
+/* CHILD SUPERVISOR:
+Keeps track of the background jobs (pipelines followed by `&`), so that the
+shell can go on reading commands while they run, and reap them when they are
+done, with `wait` or before the next prompt.
+
+Each job is watched through a pidfd (pidfd_open), added to an epoll instance:
+it becomes readable when the process terminates, and refers to that process
+only, so waiting for a job never reaps a child of somebody else (a stage of a
+pipeline, a worker of a parallel loop), as waitpid(-1) would.
+
+When pidfd_open is not available (before Linux 5.3, or if FSH_NO_PIDFD is set
+in the environment), SIGCHLD is blocked and read from a signalfd in the same
+epoll instance instead, and the jobs are then checked with waitpid(WNOHANG).
+The commands the shell starts must not inherit this mask: see
+supervisor_child_sigmask.
+
+A subshell inherits the supervisor of its parent, but not its children: the
+supervisor starts over in a process that did not create it.
+*/
+
+struct job {
+  int id; // number of the job, as printed for the user
+  int pid;
+  int fd; // pidfd, or -1 with the signalfd
+  int done;
+  int wstat; // only has meaning if done
+};
+
+struct supervisor {
+  int owner; // process that owns the jobs and the descriptors
+  int epoll_fd;
+  int signal_fd; // -1 unless pidfds are not available
+  int mask_changed; // whether SIGCHLD was blocked for the signalfd
+  sigset_t old_mask; // mask before that
+  struct job *jobs;
+  int nb_jobs;
+  int cap;
+  int last_id;
+};
+
+struct supervisor g_supervisor = { 0 };
+
+
+// Forgets the jobs and descriptors inherited from the parent of a subshell
+void supervisor_reset(void) {
+  struct supervisor *sup = &g_supervisor;
+  if (sup->owner) {
+    for (int i = 0; i < sup->nb_jobs; i++) {
+      if (sup->jobs[i].fd != -1) close(sup->jobs[i].fd);
+    }
+    close(sup->epoll_fd);
+    if (sup->signal_fd != -1) close(sup->signal_fd);
+  }
+  // the mask set for the signalfd is inherited, and stays in place
+  sup->nb_jobs = 0;
+  sup->last_id = 0;
+  sup->signal_fd = -1;
+  sup->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  sup->owner = getpid();
+}
+
+// Switches to the signalfd, when pidfds can not be used
+// @return 0 on success, -1 on failure
+int supervisor_use_signalfd(void) {
+  struct supervisor *sup = &g_supervisor;
+  if (sup->signal_fd != -1) return 0;
+
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  if (!sup->mask_changed) {
+    if (sigprocmask(SIG_BLOCK, &chld, &sup->old_mask) == -1) return -1;
+    sup->mask_changed = 1;
+  }
+  sup->signal_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sup->signal_fd == -1) return -1;
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = sup->signal_fd };
+  return epoll_ctl(sup->epoll_fd, EPOLL_CTL_ADD, sup->signal_fd, &ev);
+}
+
+/**
+ * Starts to supervise the background job `pid`, a child of the shell, and
+ * prints its number and pid on stderr in the interactive mode.
+ *
+ * @return the number of the job, or -1 on failure.
+ */
+int supervisor_add(int pid) {
+  struct supervisor *sup = &g_supervisor;
+  if (sup->owner != getpid()) supervisor_reset();
+  if (sup->epoll_fd == -1) return -1;
+
+  if (sup->nb_jobs == sup->cap) {
+    int cap = sup->cap ? sup->cap * 2 : 8;
+    struct job *jobs = realloc(sup->jobs, cap * sizeof(struct job));
+    if (!jobs) return -1;
+    sup->jobs = jobs;
+    sup->cap = cap;
+  }
+
+  int fd = -1;
+  if (sup->signal_fd == -1 && !getenv("FSH_NO_PIDFD")) fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd != -1) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(sup->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close(fd);
+      return -1;
+    }
+  } else if (supervisor_use_signalfd() == -1) {
+    return -1;
+  }
+
+  // the numbers start over when there is no job left, like in other shells
+  if (!sup->nb_jobs) sup->last_id = 0;
+  struct job *job = &sup->jobs[sup->nb_jobs++];
+  job->id = ++sup->last_id;
+  job->pid = pid;
+  job->fd = fd;
+  job->done = 0;
+  if (g_interactive) dprintf(2, "[%d] %d\n", job->id, pid);
+  return job->id;
+}
+
+// Reaps `job` if it is terminated
+// @return 1 if it is done, 0 otherwise
+int supervisor_check(struct job *job) {
+  if (job->done) return 1;
+  int ret;
+  do {
+    ret = waitpid(job->pid, &job->wstat, WNOHANG);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == 0) return 0;
+  if (ret == -1) job->wstat = 127 << 8; // reaped by someone else, should not happen
+
+  job->done = 1;
+  if (job->fd != -1) {
+    epoll_ctl(g_supervisor.epoll_fd, EPOLL_CTL_DEL, job->fd, NULL);
+    close(job->fd);
+    job->fd = -1;
+  }
+  return 1;
+}
+
+/**
+ * Waits for a job to terminate, at most `timeout` milliseconds (-1 for no
+ * limit, 0 to only collect the jobs already terminated), and reaps all the
+ * terminated ones.
+ *
+ * @return the number of events, or -1 if the wait was interrupted by SIGINT or
+ *         failed.
+ */
+int supervisor_poll(int timeout) {
+  struct supervisor *sup = &g_supervisor;
+  struct epoll_event events[16];
+  int n, i, j;
+
+  // with the signalfd, a SIGCHLD could have been missed before the first job
+  if (sup->signal_fd != -1) {
+    for (i = 0; i < sup->nb_jobs; i++) {
+      if (!sup->jobs[i].done && supervisor_check(&sup->jobs[i])) timeout = 0;
+    }
+  }
+
+  do {
+    n = epoll_wait(sup->epoll_fd, events, 16, timeout);
+  } while (n == -1 && errno == EINTR && !g_sig_received);
+  if (n == -1) return -1;
+
+  for (i = 0; i < n; i++) {
+    if (events[i].data.fd == sup->signal_fd) {
+      struct signalfd_siginfo info;
+      while (read(sup->signal_fd, &info, sizeof(info)) == sizeof(info));
+      for (j = 0; j < sup->nb_jobs; j++) supervisor_check(&sup->jobs[j]);
+      continue;
+    }
+    for (j = 0; j < sup->nb_jobs; j++) {
+      if (sup->jobs[j].fd == events[i].data.fd) supervisor_check(&sup->jobs[j]);
+    }
+  }
+  return n;
+}
+
+// Removes a terminated job from the supervisor
+// @return its exit status, 128 + the signal if it was killed, like in sh
+int supervisor_remove(struct job *job) {
+  int wstat = job->wstat;
+  *job = g_supervisor.jobs[--g_supervisor.nb_jobs];
+  return WIFEXITED(wstat) ? WEXITSTATUS(wstat) : 128 + WTERMSIG(wstat);
+}
+
+// @return the job of `pid`, or NULL if it is not a job of this shell
+struct job *supervisor_find(int pid) {
+  if (g_supervisor.owner != getpid()) return NULL;
+  for (int i = 0; i < g_supervisor.nb_jobs; i++) {
+    if (g_supervisor.jobs[i].pid == pid) return &g_supervisor.jobs[i];
+  }
+  return NULL;
+}
+
+/**
+ * Waits for the background job `pid` to terminate.
+ *
+ * @return its exit status (see supervisor_remove), 127 if `pid` is not a job
+ *         of the shell, or -1 if the wait was interrupted by SIGINT.
+ */
+int supervisor_wait_pid(int pid) {
+  struct job *job = supervisor_find(pid);
+  if (!job) return 127;
+  while (!job->done) {
+    if (supervisor_poll(-1) == -1) return -1;
+  }
+  return supervisor_remove(job);
+}
+
+/**
+ * Waits for the next background job to terminate, or takes one that already
+ * did and was not reported yet.
+ *
+ * @return the same as supervisor_wait_pid, 127 meaning that there is no job.
+ */
+int supervisor_wait_next(void) {
+  struct supervisor *sup = &g_supervisor;
+  if (sup->owner != getpid()) return 127;
+  while (sup->nb_jobs) {
+    for (int i = 0; i < sup->nb_jobs; i++) {
+      if (sup->jobs[i].done) return supervisor_remove(&sup->jobs[i]);
+    }
+    if (supervisor_poll(-1) == -1) return -1;
+  }
+  return 127;
+}
+
+/**
+ * Waits for every background job to terminate.
+ *
+ * @return 0, or -1 if the wait was interrupted by SIGINT.
+ */
+int supervisor_wait_all(void) {
+  struct supervisor *sup = &g_supervisor;
+  if (sup->owner != getpid()) return 0;
+  while (sup->nb_jobs) {
+    if (supervisor_wait_next() == -1) return -1;
+  }
+  return 0;
+}
+
+// Whether the shell has background jobs that were not waited for
+int supervisor_has_jobs(void) {
+  return g_supervisor.owner == getpid() && g_supervisor.nb_jobs > 0;
+}
+
+// Reaps the jobs that terminated since the last call, and reports them on
+// stderr. Called before each prompt, does nothing if there is no job.
+void supervisor_notify(void) {
+  struct supervisor *sup = &g_supervisor;
+  if (!sup->nb_jobs || sup->owner != getpid()) return;
+  supervisor_poll(0);
+
+  for (int i = 0; i < sup->nb_jobs; i++) {
+    struct job *job = &sup->jobs[i];
+    if (!job->done) continue;
+    if (WIFSIGNALED(job->wstat)) {
+      dprintf(2, "[%d] %s\t%d\n", job->id, strsignal(WTERMSIG(job->wstat)), job->pid);
+    } else if (WEXITSTATUS(job->wstat)) {
+      dprintf(2, "[%d] Exit %d\t%d\n", job->id, WEXITSTATUS(job->wstat), job->pid);
+    } else {
+      dprintf(2, "[%d] Done\t%d\n", job->id, job->pid);
+    }
+    supervisor_remove(job);
+    i--; // the last job was moved here
+  }
+}
+
+/**
+ * Gives the signal mask that the commands started by the shell must have,
+ * which differs from the one of the shell when SIGCHLD is blocked for the
+ * signalfd.
+ *
+ * @return 1 if `mask` was filled and must be set in the child, 0 if the mask
+ *         of the shell can be inherited.
+ */
+int supervisor_child_sigmask(sigset_t *mask) {
+  // also true in a subshell, that inherits the mask but not the signalfd
+  if (!g_supervisor.mask_changed) return 0;
+  *mask = g_supervisor.old_mask;
+  return 1;
+}
@@ -0,0 +1,159 @@
+#include "timing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cmd_types.h"
+
+/* TIMING:
+Accounting of the resources used by a `time` command. The times and context
+switches are the difference between the usage of the shell and of its reaped
+children (getrusage RUSAGE_SELF and RUSAGE_CHILDREN) at the start and at the
+end of the command: every child is reaped with wait4 (see wait_cmd_usage),
+which also counts what its own children used, so the parallel loop workers and
+their commands are included once they are reaped. The peak RSS of the children
+can not be computed this way (RUSAGE_CHILDREN gives the peak since the start
+of the shell), so it is taken from each wait4 while timing (timing_reaped):
+the peak RSS reported is the one of the largest child, or of the shell if no
+child was reaped.
+
+With `time -s`, the resources are also given for each stage of the pipelines
+that are simple commands, added up over all their runs: a stage run in a
+subshell gets the usage reported by wait4, and the last stage, run in the
+shell, the difference of the usage around it (see exec_pipeline).
+*/
+
+struct timing *g_timing = NULL;
+
+// Adds the times and context switches of `b` to `a`, and keeps the peak RSS
+void rusage_add(struct rusage *a, struct rusage *b) {
+  timeradd(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+  timeradd(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+  a->ru_nvcsw += b->ru_nvcsw;
+  a->ru_nivcsw += b->ru_nivcsw;
+  if (b->ru_maxrss > a->ru_maxrss) a->ru_maxrss = b->ru_maxrss;
+}
+
+// Subtracts the times and context switches of `b` from `a`
+void rusage_sub(struct rusage *a, struct rusage *b) {
+  timersub(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+  timersub(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+  a->ru_nvcsw -= b->ru_nvcsw;
+  a->ru_nivcsw -= b->ru_nivcsw;
+}
+
+// The usage of the shell and of its reaped children until now, with the peak
+// RSS of the shell
+void timing_snapshot(struct rusage *usage) {
+  struct rusage children;
+  getrusage(RUSAGE_SELF, usage);
+  getrusage(RUSAGE_CHILDREN, &children);
+  children.ru_maxrss = 0;
+  rusage_add(usage, &children);
+}
+
+// Starts timing a command, nested in the current one if any
+void timing_start(struct timing *timing, int per_stage) {
+  memset(timing, 0, sizeof(struct timing));
+  timing->per_stage = per_stage;
+  timing->outer = g_timing;
+  g_timing = timing;
+  clock_gettime(CLOCK_MONOTONIC, &timing->start_time);
+  timing_snapshot(&timing->start_usage);
+}
+
+// Takes into account a child reaped with wait4
+void timing_reaped(struct rusage *usage) {
+  if (g_timing && usage->ru_maxrss > g_timing->max_rss) g_timing->max_rss = usage->ru_maxrss;
+}
+
+// Adds the usage of a run of the stage `cmd` of a pipeline, with `time -s`. A
+// NULL `usage` only adds the stage to the report, so that the stages appear in
+// the order of the pipeline rather than in the order they terminate.
+void timing_add_stage(struct cmd *cmd, struct rusage *usage) {
+  struct timing *timing = g_timing;
+  if (!timing || !timing->per_stage || cmd->cmd_type != CMD_SIMPLE) return;
+
+  int i;
+  for (i = 0; i < timing->nb_stages && timing->stages[i].cmd != cmd->detail; i++);
+  if (i == timing->nb_stages) {
+    if (timing->nb_stages == timing->cap) {
+      int cap = timing->cap ? 2 * timing->cap : 8;
+      struct stage_usage *stages = realloc(timing->stages, cap * sizeof(struct stage_usage));
+      if (!stages) return; // the report will miss this stage
+      timing->stages = stages;
+      timing->cap = cap;
+    }
+    memset(&timing->stages[i], 0, sizeof(struct stage_usage));
+    timing->stages[i].cmd = cmd->detail;
+    timing->nb_stages++;
+  }
+  if (!usage) return;
+  timing->stages[i].runs++;
+  rusage_add(&timing->stages[i].usage, usage);
+}
+
+// Starts the run of a stage in the shell, see timing_stage_end
+void timing_stage_begin(struct rusage *before) {
+  timing_snapshot(before);
+  // keeps the peak of the children reaped before, to see those of the stage
+  before->ru_maxrss = g_timing->max_rss;
+  g_timing->max_rss = 0;
+}
+
+// Adds the usage since timing_stage_begin to the stage `cmd`, run in the
+// shell: its peak RSS is the one of its children, or of the shell without
+// children (an internal command)
+void timing_stage_end(struct cmd *cmd, struct rusage *before) {
+  struct rusage usage;
+  long children_rss = g_timing->max_rss;
+  timing_snapshot(&usage);
+  rusage_sub(&usage, before);
+  if (children_rss) usage.ru_maxrss = children_rss;
+  timing_add_stage(cmd, &usage);
+  if (before->ru_maxrss > g_timing->max_rss) g_timing->max_rss = before->ru_maxrss;
+}
+
+double timeval_seconds(struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Ends the timing of a command, and prints its report on stderr
+void timing_end(struct timing *timing) {
+  struct timespec end_time;
+  struct rusage usage;
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  timing_snapshot(&usage);
+  rusage_sub(&usage, &timing->start_usage);
+  if (timing->max_rss) usage.ru_maxrss = timing->max_rss;
+  double real = end_time.tv_sec - timing->start_time.tv_sec +
+                (end_time.tv_nsec - timing->start_time.tv_nsec) / 1e9;
+
+  dprintf(2, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ld KiB\n"
+             "csw\t%ld voluntary, %ld involuntary\n", real,
+          timeval_seconds(&usage.ru_utime), timeval_seconds(&usage.ru_stime),
+          usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw);
+
+  if (timing->per_stage && timing->nb_stages) {
+    dprintf(2, "%-24s %8s %9s %9s %10s %8s %8s\n", "stage", "runs", "user",
+            "sys", "maxrss", "vcsw", "ivcsw");
+    for (int i = 0; i < timing->nb_stages; i++) {
+      struct stage_usage *stage = &timing->stages[i];
+      // the stage is named by the beginning of its arguments
+      char name[25];
+      int len = 0;
+      for (char **arg = stage->cmd->argv; *arg && len < 24; arg++) {
+        len += snprintf(name + len, sizeof(name) - len, len ? " %s" : "%s", *arg);
+      }
+      dprintf(2, "%-24.24s %8ld %8.3fs %8.3fs %6ld KiB %8ld %8ld\n", name, stage->runs, timeval_seconds(&stage->usage.ru_utime),
+              timeval_seconds(&stage->usage.ru_stime), stage->usage.ru_maxrss,
+              stage->usage.ru_nvcsw, stage->usage.ru_nivcsw);
+    }
+  }
+  free(timing->stages);
+
+  g_timing = timing->outer;
+  if (g_timing && timing->max_rss > g_timing->max_rss) g_timing->max_rss = timing->max_rss;
+}
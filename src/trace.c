@@ -0,0 +1,189 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* TRACE:
+With FSH_TRACE=FILE, the shell records the steps of the execution (chains,
+loop iterations, directories read by the walker, forks, spawns, waits, waits
+for a slot of a parallel loop...) in FILE, in the trace event format of
+Chrome (chrome://tracing, or https://ui.perfetto.dev): a JSON array of
+objects, one per line, with the pid and tid of the process and thread that
+recorded it, so that each gets its own lane. The array is never closed, which
+the viewers accept.
+
+Each thread builds its events in its own buffer, written with a single
+write(2) when it is full and at the exit of the process or of the thread, in
+append mode: the events of the subshells and threads are interleaved in the
+file, but never mixed within a line. A child forked by the shell empties its
+copy of the buffer (pthread_atfork), the events in it belong to the parent.
+The buffer is also written before an exec replaces the process, and before
+the process kills itself with SIGINT (see raise_sigint).
+
+The fsh started by the shell inherit FSH_TRACE, and append their events to
+the same file; only the first one truncates it (FSH_TRACE_NESTED is set for
+the others).
+*/
+
+int g_trace_on = 0;
+int g_trace_fd = -1;
+int g_trace_pid;
+
+__thread char *t_trace_buf;
+__thread size_t t_trace_len;
+__thread int t_trace_tid;
+
+// Writes the events of the current thread in the file
+void trace_flush(void) {
+  size_t done = 0;
+  ssize_t n;
+  if (!g_trace_on) return;
+  while (done < t_trace_len) {
+    n = write(g_trace_fd, t_trace_buf + done, t_trace_len - done);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break; // the events are lost, but the shell goes on
+    done += n;
+  }
+  t_trace_len = 0;
+}
+
+// In a forked child, whose buffer holds events of its parent
+void trace_after_fork(void) {
+  t_trace_len = 0;
+  g_trace_pid = getpid();
+  t_trace_tid = g_trace_pid;
+}
+
+// Makes room for `size` bytes in the buffer of the current thread
+// @return the end of the buffer, or NULL on allocation failure
+char *trace_reserve(size_t size) {
+  if (!t_trace_buf) {
+    t_trace_buf = malloc(TRACE_BUF_SIZE);
+    if (!t_trace_buf) return NULL;
+    t_trace_tid = gettid();
+  }
+  if (t_trace_len + size > TRACE_BUF_SIZE) trace_flush();
+  return t_trace_buf + t_trace_len;
+}
+
+/**
+ * Starts tracing if FSH_TRACE is set, must be called once when the shell
+ * starts, before it forks or creates threads.
+ */
+void trace_init(void) {
+  char *path = getenv("FSH_TRACE");
+  if (!path || !*path) return;
+  int nested = getenv("FSH_TRACE_NESTED") != NULL;
+  g_trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (nested ? 0 : O_TRUNC), 0644);
+  if (g_trace_fd == -1) {
+    dprintf(2, "fsh: FSH_TRACE: %s: %s\n", path, strerror(errno));
+    return;
+  }
+  if (!nested) {
+    if (write(g_trace_fd, "[\n", 2) != 2) return;
+    setenv("FSH_TRACE_NESTED", "1", 1);
+  }
+  g_trace_pid = getpid();
+  pthread_atfork(NULL, NULL, trace_after_fork);
+  atexit(trace_flush);
+  g_trace_on = 1;
+}
+
+// Writes the beginning of an event in `out`, up to its arguments
+int trace_header(char *out, char ph, char *name) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return sprintf(out, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%ld.%03ld,\"pid\":%d,\"tid\":%d",
+                 name, ph, ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+                 ts.tv_nsec % 1000, g_trace_pid, t_trace_tid);
+}
+
+// Maximum number of characters of a string argument that are recorded
+#define TRACE_MAX_VALUE 1024
+
+// Length of the valid UTF-8 character at `s` (overlong forms, surrogates and
+// code points above U+10FFFF excluded), or 0 if it is not one
+int trace_utf8_len(const unsigned char *s) {
+  unsigned char lo = 0x80, hi = 0xbf;
+  int len;
+  if (s[0] < 0x80) return 1;
+  if (s[0] < 0xc2) return 0;
+  if (s[0] < 0xe0) len = 2;
+  else if (s[0] < 0xf0) len = 3;
+  else if (s[0] < 0xf5) len = 4;
+  else return 0;
+  if (s[0] == 0xe0) lo = 0xa0;
+  else if (s[0] == 0xed) hi = 0x9f;
+  else if (s[0] == 0xf0) lo = 0x90;
+  else if (s[0] == 0xf4) hi = 0x8f;
+  if (s[1] < lo || s[1] > hi) return 0;
+  for (int i = 2; i < len; i++) {
+    if (s[i] < 0x80 || s[i] > 0xbf) return 0;
+  }
+  return len;
+}
+
+void trace_event(char ph, char *name, char *key, char *value) {
+  // each character takes at most 6 bytes escaped (\u00XX)
+  char *out = trace_reserve(256 + 6 * TRACE_MAX_VALUE);
+  if (!out) return;
+  char *head = out + trace_header(out, ph, name);
+  if (ph == 'i') head += sprintf(head, ",\"s\":\"t\"");
+  if (key) {
+    head += sprintf(head, ",\"args\":{\"%s\":\"", key);
+    // The JSON must stay valid UTF-8: the bytes that are not part of a valid
+    // character are escaped as if they were Latin-1, and the value is cut
+    // between two characters
+    int i = 0, len;
+    while (value[i]) {
+      unsigned char c = value[i];
+      len = trace_utf8_len((unsigned char *) value + i);
+      if (i + (len ? len : 1) > TRACE_MAX_VALUE) break;
+      if (c == '"' || c == '\\') {
+        *head++ = '\\';
+        *head++ = c;
+      } else if (c < 0x20 || !len) {
+        head += sprintf(head, "\\u%04x", c);
+      } else {
+        memcpy(head, value + i, len);
+        head += len;
+        i += len - 1;
+      }
+      i++;
+    }
+    head += sprintf(head, "\"}");
+  }
+  head += sprintf(head, "},\n");
+  t_trace_len = head - t_trace_buf;
+}
+
+void trace_event_int(char ph, char *name, char *key, long value) {
+  char *out = trace_reserve(256);
+  if (!out) return;
+  char *head = out + trace_header(out, ph, name);
+  if (ph == 'i') head += sprintf(head, ",\"s\":\"t\"");
+  head += sprintf(head, ",\"args\":{\"%s\":%ld}},\n", key, value);
+  t_trace_len = head - t_trace_buf;
+}
+
+// Names the lane of the current thread in the viewers
+void trace_thread_name(char *name) {
+  char *out = trace_reserve(256);
+  if (!out) return;
+  t_trace_len += sprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                         "\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", g_trace_pid,
+                         t_trace_tid, name);
+}
+
+// Writes the events of a thread that terminates, and frees its buffer
+void trace_thread_exit(void) {
+  trace_flush();
+  free(t_trace_buf);
+  t_trace_buf = NULL;
+}
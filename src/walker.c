@@ -0,0 +1,509 @@
+#include "walker.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirreader.h"
+#include "execution.h"
+#include "fsh.h"
+#include "metadata.h"
+#include "predicate.h"
+#include "stats.h"
+#include "trace.h"
+
+/* PARALLEL TRAVERSAL ENGINE:
+The walker explores the directory trees of a `for` loop with a pool of threads,
+while the main thread consumes the entries it finds and launches the body of the
+loop. The threads never execute anything, so all the state of the shell (vars,
+file descriptors, children) stays in the hands of the main thread.
+
+Each thread owns a deque of directories waiting to be read. It pushes the
+subdirectories it finds at the back of its own deque and pops from there too
+(depth first, good locality), and when it runs out of work it steals from the
+front of the deques of the other threads (the biggest subtrees).
+
+Entries that pass the filters of the loop are grouped in batches, and each batch
+is published in a bounded queue read by the main thread. A batch is published
+as soon as it is full or the directory is done, so that the first jobs can start
+while the rest of the tree is still being walked.
+*/
+
+#define WALKER_MAX_THREADS 16
+#define WALKER_BATCH_SIZE 256
+#define WALKER_MAX_BATCHES 64
+
+struct walk_batch {
+  struct walk_batch *next;
+  int count;
+  int pos;
+  struct walk_entry entries[WALKER_BATCH_SIZE];
+};
+
+struct walk_deque {
+  pthread_mutex_t lock;
+  char **dirs; // circular buffer of malloc'd paths
+  int head;
+  int size;
+  int cap;
+};
+
+struct walker {
+  struct cmd_for *cmd_for;
+  int nb_threads;
+  int nb_started;
+  pthread_t *threads;
+  struct walk_deque *deques;
+
+  // work distribution, protected by `lock`
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  long pending; // directories queued or being read
+  long work_gen; // incremented every time a directory is queued
+  atomic_int stop; // also read without the lock by the threads, between entries
+  int error;
+
+  // output queue, protected by `out_lock`
+  pthread_mutex_t out_lock;
+  pthread_cond_t out_cond;
+  pthread_cond_t space_cond;
+  struct walk_batch *out_head;
+  struct walk_batch *out_tail;
+  int out_count;
+  int running; // threads that have not exited yet
+  struct walk_batch *current; // batch being consumed by the main thread
+};
+
+struct walk_thread {
+  struct walker *walker;
+  int id;
+  struct walk_batch *batch;
+  struct dir_reader reader; // reused for every directory read by the thread
+};
+
+
+int deque_push(struct walk_deque *deque, char *dir) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->size == deque->cap) {
+    int new_cap = deque->cap ? deque->cap * 2 : 64;
+    char **dirs = malloc(new_cap * sizeof(char *));
+    if (!dirs) {
+      pthread_mutex_unlock(&deque->lock);
+      return -1;
+    }
+    for (int i = 0; i < deque->size; i++)
+      dirs[i] = deque->dirs[(deque->head + i) % deque->cap];
+    free(deque->dirs);
+    deque->dirs = dirs;
+    deque->head = 0;
+    deque->cap = new_cap;
+  }
+  deque->dirs[(deque->head + deque->size) % deque->cap] = dir;
+  deque->size++;
+  pthread_mutex_unlock(&deque->lock);
+  return 0;
+}
+
+// Pops from the back (owner) or the front (thief) of a deque
+char *deque_pop(struct walk_deque *deque, int steal) {
+  char *dir = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->size > 0) {
+    if (steal) {
+      dir = deque->dirs[deque->head];
+      deque->head = (deque->head + 1) % deque->cap;
+    } else {
+      dir = deque->dirs[(deque->head + deque->size - 1) % deque->cap];
+    }
+    deque->size--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return dir;
+}
+
+
+// Queues a directory to be read by the thread `id`
+int walker_push_dir(struct walker *walker, int id, char *dir) {
+  pthread_mutex_lock(&walker->lock);
+  walker->pending++;
+  pthread_mutex_unlock(&walker->lock);
+
+  if (deque_push(&walker->deques[id], dir) == -1) {
+    pthread_mutex_lock(&walker->lock);
+    walker->pending--;
+    walker->error = 1;
+    pthread_mutex_unlock(&walker->lock);
+    return -1;
+  }
+
+  pthread_mutex_lock(&walker->lock);
+  walker->work_gen++;
+  pthread_cond_signal(&walker->work_cond);
+  pthread_mutex_unlock(&walker->lock);
+  return 0;
+}
+
+// Returns the next directory for the thread `id`, or NULL when the walk is over
+char *walker_get_dir(struct walker *walker, int id) {
+  char *dir;
+  long gen;
+
+  while (1) {
+    pthread_mutex_lock(&walker->lock);
+    if (walker->stop || walker->pending == 0) {
+      pthread_mutex_unlock(&walker->lock);
+      return NULL;
+    }
+    gen = walker->work_gen;
+    pthread_mutex_unlock(&walker->lock);
+
+    if ((dir = deque_pop(&walker->deques[id], 0))) return dir;
+    for (int i = 1; i < walker->nb_threads; i++) {
+      dir = deque_pop(&walker->deques[(id + i) % walker->nb_threads], 1);
+      if (dir) return dir;
+    }
+
+    // Nothing to do for now: sleep until some directory is queued, or until
+    // the last directory has been read
+    pthread_mutex_lock(&walker->lock);
+    while (!walker->stop && walker->pending && walker->work_gen == gen)
+      pthread_cond_wait(&walker->work_cond, &walker->lock);
+    pthread_mutex_unlock(&walker->lock);
+  }
+}
+
+void walker_dir_done(struct walker *walker) {
+  pthread_mutex_lock(&walker->lock);
+  walker->pending--;
+  if (walker->pending == 0) pthread_cond_broadcast(&walker->work_cond);
+  pthread_mutex_unlock(&walker->lock);
+}
+
+
+// Hands the current batch of the thread over to the main thread
+void walker_publish(struct walk_thread *self) {
+  struct walker *walker = self->walker;
+  struct walk_batch *batch = self->batch;
+  if (!batch || batch->count == 0) return;
+  self->batch = NULL;
+
+  pthread_mutex_lock(&walker->out_lock);
+  while (!walker->stop && walker->out_count >= WALKER_MAX_BATCHES)
+    pthread_cond_wait(&walker->space_cond, &walker->out_lock);
+  if (walker->stop) {
+    pthread_mutex_unlock(&walker->out_lock);
+    for (int i = 0; i < batch->count; i++) free(batch->entries[i].path);
+    free(batch);
+    return;
+  }
+  if (walker->out_tail) walker->out_tail->next = batch;
+  else walker->out_head = batch;
+  walker->out_tail = batch;
+  walker->out_count++;
+  pthread_cond_signal(&walker->out_cond);
+  pthread_mutex_unlock(&walker->out_lock);
+}
+
+int walker_emit(struct walk_thread *self, char *path, unsigned char d_type) {
+  if (!self->batch) {
+    self->batch = malloc(sizeof(struct walk_batch));
+    if (!self->batch) return -1;
+    self->batch->next = NULL;
+    self->batch->count = 0;
+    self->batch->pos = 0;
+  }
+  self->batch->entries[self->batch->count].path = path;
+  self->batch->entries[self->batch->count].d_type = d_type;
+  if (++self->batch->count == WALKER_BATCH_SIZE) walker_publish(self);
+  return 0;
+}
+
+
+/**
+ * Reads a directory, queues its subdirectories if the loop is recursive, and
+ * emits the entries that pass the filters of the loop.
+ *
+ * @return 0 on success, -1 if the directory could not be read entirely.
+ */
+int walker_read_dir(struct walk_thread *self, char *dir_name) {
+  struct walker *walker = self->walker;
+  struct cmd_for *cmd_for = walker->cmd_for;
+  struct dir_reader *reader = &self->reader;
+  int dir_len = strlen(dir_name);
+
+  if (dir_reader_open(reader, AT_FDCWD, dir_name) == -1) {
+    perror("opendir");
+    return -1;
+  }
+
+  int ret = 0, n = 0;
+  long filtered_type = 0, filtered_meta = 0;
+  struct dir_entry dentry;
+  while (!atomic_load_explicit(&walker->stop, memory_order_relaxed) &&
+         (n = dir_reader_next(reader, &dentry)) == 1) {
+    char *path = malloc(dir_len + dentry.name_len + 2);
+    if (!path) {
+      ret = -1;
+      break;
+    }
+    memcpy(path, dir_name, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, dentry.name, dentry.name_len + 1);
+
+    if (cmd_for->recursive && dentry.d_type == DT_DIR) { // -r
+      char *sub_dir = strdup(path);
+      if (!sub_dir || walker_push_dir(walker, self->id, sub_dir) == -1) {
+        free(sub_dir);
+        ret = -1;
+      }
+    }
+
+    if (!dentry.ext_match) { // -e
+      free(path);
+      continue;
+    }
+    if (cmd_for->filter_ext)
+      path[dir_len + dentry.name_len - reader->ext_len] = '\0';
+
+    if (cmd_for->filter_type && !same_type(cmd_for->filter_type, dentry.d_type)) { // -t
+      filtered_type++;
+      free(path);
+      continue;
+    }
+
+    // -size, -mtime, -newer, -perm, -user
+    if (cmd_for->nb_preds && !pred_match(cmd_for, reader->fd, dentry.name)) {
+      filtered_meta++;
+      free(path);
+      continue;
+    }
+
+    if (walker_emit(self, path, dentry.d_type) == -1) {
+      free(path);
+      ret = -1;
+      break;
+    }
+  }
+  if (n == -1) {
+    perror("getdents64");
+    ret = -1;
+  }
+
+  dir_reader_close(reader);
+  if (filtered_type) STATS_ADD(filtered_type, filtered_type);
+  if (filtered_meta) STATS_ADD(filtered_meta, filtered_meta);
+  walker_publish(self);
+  return ret;
+}
+
+void *walker_thread(void *arg) {
+  struct walk_thread *self = arg;
+  struct walker *walker = self->walker;
+  char *dir;
+
+  if (g_trace_on) trace_thread_name("walker");
+  while ((dir = walker_get_dir(walker, self->id))) {
+    TRACE('B', "read dir", "dir", dir);
+    int ret = walker_read_dir(self, dir);
+    TRACE('E', "read dir", NULL, NULL);
+    if (ret == -1) {
+      pthread_mutex_lock(&walker->lock);
+      walker->error = 1;
+      pthread_mutex_unlock(&walker->lock);
+    }
+    free(dir);
+    walker_dir_done(walker);
+  }
+  walker_publish(self);
+  dir_reader_free(&self->reader);
+  meta_thread_release();
+
+  pthread_mutex_lock(&walker->out_lock);
+  walker->running--;
+  pthread_cond_signal(&walker->out_cond);
+  pthread_mutex_unlock(&walker->out_lock);
+
+  free(self);
+  if (g_trace_on) trace_thread_exit();
+  return NULL;
+}
+
+
+// Number of walker threads, can be overridden with FSH_WALKERS
+int walker_nb_threads(void) {
+  char *env = getenv("FSH_WALKERS");
+  long n = env ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) n = 1;
+  if (n > WALKER_MAX_THREADS) n = WALKER_MAX_THREADS;
+  return n;
+}
+
+/**
+ * Starts walking the directories `roots` with a pool of threads, according to
+ * the options of `cmd_for`. The roots are distributed among the threads, so
+ * that they are walked concurrently.
+ *
+ * @return the walker, to be consumed with walker_next and released with
+ *         walker_finish, or NULL on failure.
+ */
+struct walker *walker_start(struct cmd_for *cmd_for, char **roots, int nb_roots) {
+  struct walker *walker = calloc(1, sizeof(struct walker));
+  if (!walker) return NULL;
+  walker->cmd_for = cmd_for;
+  walker->nb_threads = walker_nb_threads();
+  pthread_mutex_init(&walker->lock, NULL);
+  pthread_cond_init(&walker->work_cond, NULL);
+  pthread_mutex_init(&walker->out_lock, NULL);
+  pthread_cond_init(&walker->out_cond, NULL);
+  pthread_cond_init(&walker->space_cond, NULL);
+
+  walker->threads = calloc(walker->nb_threads, sizeof(pthread_t));
+  walker->deques = calloc(walker->nb_threads, sizeof(struct walk_deque));
+  if (!walker->threads || !walker->deques) goto error;
+  for (int i = 0; i < walker->nb_threads; i++)
+    pthread_mutex_init(&walker->deques[i].lock, NULL);
+
+  for (int i = 0; i < nb_roots; i++) {
+    char *root = strdup(roots[i]);
+    if (!root || walker_push_dir(walker, i % walker->nb_threads, root) == -1) {
+      free(root);
+      goto error;
+    }
+  }
+
+  // The threads must not receive the signals meant for the shell
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (int i = 0; i < walker->nb_threads; i++) {
+    struct walk_thread *self = calloc(1, sizeof(struct walk_thread));
+    if (self) {
+      self->walker = walker;
+      self->id = i;
+      if (dir_reader_init(&self->reader, DIR_READER_BUF_SIZE, cmd_for) == -1) {
+        free(self);
+        self = NULL;
+      }
+    }
+    if (!self || pthread_create(&walker->threads[i], NULL, walker_thread, self)) {
+      if (self) dir_reader_free(&self->reader);
+      free(self);
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+      // Let the threads already started terminate before giving up
+      walker_finish(walker);
+      return NULL;
+    }
+    pthread_mutex_lock(&walker->out_lock);
+    walker->nb_started++;
+    walker->running++;
+    pthread_mutex_unlock(&walker->out_lock);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return walker;
+
+  error:
+  walker_finish(walker);
+  return NULL;
+}
+
+/**
+ * Waits for the next entry found by the walker. The path of the entry must be
+ * freed by the caller.
+ *
+ * @return 1 if an entry was stored in `entry`, 0 when the walk is over or was
+ *         interrupted by SIGINT.
+ */
+int walker_next(struct walker *walker, struct walk_entry *entry) {
+  struct walk_batch *batch = walker->current;
+  if (batch && batch->pos < batch->count) {
+    *entry = batch->entries[batch->pos++];
+    return 1;
+  }
+  free(batch);
+  walker->current = NULL;
+
+  pthread_mutex_lock(&walker->out_lock);
+  while (!walker->out_head && walker->running && !g_sig_received) {
+    // Wake up regularly to notice a SIGINT, as it does not interrupt the wait
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&walker->out_cond, &walker->out_lock, &deadline);
+  }
+  batch = walker->out_head;
+  if (batch && !g_sig_received) {
+    walker->out_head = batch->next;
+    if (!walker->out_head) walker->out_tail = NULL;
+    walker->out_count--;
+    pthread_cond_signal(&walker->space_cond);
+  } else {
+    batch = NULL;
+  }
+  pthread_mutex_unlock(&walker->out_lock);
+
+  if (!batch) return 0;
+  walker->current = batch;
+  *entry = batch->entries[batch->pos++];
+  return 1;
+}
+
+/**
+ * Stops the walker if it is still running, waits for its threads and frees
+ * everything it holds, including the entries that were not consumed.
+ *
+ * @return EXIT_SUCCESS if every directory could be read, EXIT_FAILURE otherwise.
+ */
+int walker_finish(struct walker *walker) {
+  pthread_mutex_lock(&walker->lock);
+  walker->stop = 1;
+  pthread_cond_broadcast(&walker->work_cond);
+  pthread_mutex_unlock(&walker->lock);
+  pthread_mutex_lock(&walker->out_lock);
+  walker->stop = 1;
+  pthread_cond_broadcast(&walker->space_cond);
+  pthread_mutex_unlock(&walker->out_lock);
+
+  for (int i = 0; i < walker->nb_started; i++)
+    pthread_join(walker->threads[i], NULL);
+
+  struct walk_batch *batch = walker->current, *next;
+  if (batch) batch->next = walker->out_head;
+  else batch = walker->out_head;
+  for (; batch; batch = next) {
+    next = batch->next;
+    for (int i = batch->pos; i < batch->count; i++) free(batch->entries[i].path);
+    free(batch);
+  }
+
+  char *dir;
+  if (walker->deques) {
+    for (int i = 0; i < walker->nb_threads; i++) {
+      while ((dir = deque_pop(&walker->deques[i], 0))) free(dir);
+      free(walker->deques[i].dirs);
+      pthread_mutex_destroy(&walker->deques[i].lock);
+    }
+  }
+
+  int ret = walker->error ? EXIT_FAILURE : EXIT_SUCCESS;
+  free(walker->threads);
+  free(walker->deques);
+  pthread_mutex_destroy(&walker->lock);
+  pthread_cond_destroy(&walker->work_cond);
+  pthread_mutex_destroy(&walker->out_lock);
+  pthread_cond_destroy(&walker->out_cond);
+  pthread_cond_destroy(&walker->space_cond);
+  free(walker);
+  return ret;
+}
@@ -0,0 +1,346 @@
+#include "workers.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "execution.h"
+#include "fsh.h"
+#include "jobserver.h"
+#include "stats.h"
+#include "trace.h"
+
+/* WORKER POOL:
+Instead of forking a new subshell for every iteration, a parallel loop starts up
+to `-p MAX` long-lived subshells, the workers, as it needs them. Each worker is
+connected to the shell by a socket pair: the shell sends it the value of the
+loop variable for an iteration (a length, then the bytes of the value), the
+worker executes the body with it, and sends back its return value (as the exit
+status of the subshell would have been). Only the shell writes to a worker
+when it is idle, and only the worker writes when it is busy.
+
+When every worker is busy and there are already MAX of them, the shell waits
+for the result of any of them with poll, like it waited for any subshell with
+waitpid. A worker that dies (because of `exit`, or of a signal like SIGINT)
+closes its socket: the shell then reaps it with wait_cmd, which gives the
+result of its last iteration and forwards SIGINT like for any subshell. At the
+end of the loop, the sockets are closed and the workers exit.
+
+When the shell is part of a jobserver (see jobserver.c), the limit of MAX busy
+workers is not the only one: the first busy worker of a pool runs under the
+token the shell implicitly owns (the one of the loop itself, when the loop is
+nested in another one or in a job of make), and each other one needs a token of
+the jobserver, that is given back when its iteration is over. While waiting for
+a token, the shell also waits for the result of its busy workers.
+
+As a worker is reused for several iterations, it restores after each one the
+state of the shell that the body could have changed: working directory and
+umask.
+*/
+
+
+// Returned by worker_pool_wait when a token of the jobserver is available
+#define TOKEN_READY 257
+
+// Reads exactly `len` bytes, unless the end of file is reached first
+// @return the number of bytes read, or -1 on failure
+ssize_t read_full(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *) buf + done, len - done);
+    if (n == -1 && errno == EINTR && !g_sig_received) continue;
+    if (n == -1) return -1;
+    if (n == 0) break;
+    done += n;
+  }
+  return done;
+}
+
+// Sends exactly `len` bytes, without raising SIGPIPE if the peer is gone
+// @return 0 on success, -1 on failure
+int send_full(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = send(fd, (char *) buf + done, len - done, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+// Main loop of a worker, never returns
+void worker_main(struct worker_pool *pool, int fd) {
+  char *value = NULL;
+  uint32_t len, cap = 0;
+  int32_t status;
+
+  // state restored after each iteration
+  char *cwd = strdup(g_cwd);
+  char *prev_wd = g_prev_wd ? strdup(g_prev_wd) : NULL;
+  char *cwd_ptr = g_cwd;
+  // O_PATH is enough for fchdir, and works in a directory that can not be read
+  int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwd_fd == -1 || !cwd) {
+    // without them, a cd in the body would leak into the next iterations
+    perror("fsh: worker");
+    exit(EXIT_FAILURE);
+  }
+  mode_t mask = umask(0);
+  umask(mask);
+
+  while (1) {
+    ssize_t n = read_full(fd, &len, sizeof(len));
+    if (n != sizeof(len)) break; // end of the loop, or SIGINT while idle
+    if (len + 1 > cap) {
+      cap = len + 1;
+      free(value);
+      value = malloc(cap);
+      if (!value) exit(EXIT_FAILURE);
+    }
+    if (read_full(fd, value, len) != len) break;
+    value[len] = '\0';
+
+    struct arena_mark mark = arena_mark(&g_scratch);
+    pool->vars[(int) pool->var_name] = value;
+    TRACE('B', "iteration", "path", value);
+    int ret = exec_cmd_chain(pool->body, pool->vars);
+    TRACE_INT('E', "iteration", "status", ret);
+    arena_release(&g_scratch, mark);
+    if (g_sig_received) raise_sigint();
+
+    if (g_cwd != cwd_ptr) { // cd
+      if (fchdir(cwd_fd) == -1) exit(EXIT_FAILURE);
+      free(g_cwd);
+      free(g_prev_wd);
+      g_cwd = strdup(cwd);
+      g_prev_wd = prev_wd ? strdup(prev_wd) : NULL;
+      if (!g_cwd) exit(EXIT_FAILURE);
+      cwd_ptr = g_cwd;
+    }
+    umask(mask);
+
+    status = ret & 0xff; // what the exit status of a subshell would have been
+    if (send_full(fd, &status, sizeof(status)) == -1) break;
+  }
+
+  if (g_sig_received) raise_sigint();
+  exit(EXIT_SUCCESS);
+}
+
+/**
+ * Prepares a pool that executes `body` with the variable `var_name` set to
+ * the values given to worker_pool_run, in at most `max` workers at the same
+ * time (without limit if `max` is negative). No worker is started yet.
+ */
+void worker_pool_init(struct worker_pool *pool, int max, struct cmd *body,
+                      char var_name, char **vars) {
+  memset(pool, 0, sizeof(struct worker_pool));
+  pool->max = max > 0 ? max : INT_MAX;
+  pool->body = body;
+  pool->var_name = var_name;
+  pool->vars = vars;
+}
+
+// Starts a new worker
+// @return the new worker, or NULL on failure
+struct worker *worker_spawn(struct worker_pool *pool) {
+  if (pool->nb_workers == pool->cap) {
+    int cap = pool->cap ? pool->cap * 2 : 16;
+    struct worker *workers = realloc(pool->workers, cap * sizeof(struct worker));
+    if (!workers) return NULL;
+    pool->workers = workers;
+    pool->cap = cap;
+  }
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    perror("socketpair");
+    return NULL;
+  }
+  TRACE('B', "fork worker", NULL, NULL);
+  int pid = fork();
+  if (pid != 0) TRACE_INT('E', "fork worker", "pid", pid);
+  if (pid > 0) g_forks++;
+  switch (pid) {
+    case -1:
+      perror("fork");
+      close(sv[0]);
+      close(sv[1]);
+      return NULL;
+    case 0:
+      // the other workers must see the end of file when the shell closes them
+      for (int i = 0; i < pool->nb_workers; i++) close(pool->workers[i].fd);
+      close(sv[0]);
+      worker_main(pool, sv[1]);
+  }
+  close(sv[1]);
+
+  struct worker *worker = &pool->workers[pool->nb_workers++];
+  worker->pid = pid;
+  worker->fd = sv[0];
+  worker->busy = 0;
+  worker->has_token = 0;
+  return worker;
+}
+
+// Marks the iteration of a worker as finished, and gives back its token
+void worker_done(struct worker_pool *pool, struct worker *worker) {
+  worker->busy = 0;
+  pool->nb_busy--;
+  if (worker->has_token) {
+    jobserver_release(worker->token);
+    worker->has_token = 0;
+    pool->nb_tokens--;
+  }
+}
+
+// Reaps a worker whose socket was closed, and removes it from the pool
+// @return the result of wait_cmd on the worker
+int worker_reap(struct worker_pool *pool, struct worker *worker) {
+  close(worker->fd);
+  int ret = wait_cmd(worker->pid);
+  if (worker->busy) worker_done(pool, worker);
+  *worker = pool->workers[--pool->nb_workers];
+  return ret;
+}
+
+/**
+ * Waits for any busy worker to finish its iteration, or, if `token_fd` is not
+ * -1, for a token to be available on it.
+ *
+ * @return the return value of the iteration, -1 if its worker was terminated
+ *         by a signal, 256 on failure (like wait_cmd), or TOKEN_READY if a
+ *         token can be read.
+ */
+int worker_pool_wait(struct worker_pool *pool, int token_fd) {
+  struct pollfd fds[pool->nb_workers + 1];
+  int i, n;
+  for (i = 0; i < pool->nb_workers; i++) {
+    fds[i].fd = pool->workers[i].busy ? pool->workers[i].fd : -1;
+    fds[i].events = POLLIN;
+  }
+  fds[i].fd = token_fd;
+  fds[i].events = POLLIN;
+
+  TRACE_INT('B', "slot wait", "busy", pool->nb_busy);
+  long start = stats_now();
+  do {
+    n = poll(fds, pool->nb_workers + 1, -1);
+  } while (n == -1 && errno == EINTR);
+  g_stats.slot_waits++;
+  g_stats.slot_wait_ns += stats_now() - start;
+  TRACE('E', "slot wait", NULL, NULL);
+  if (n == -1) return 256;
+
+  for (i = 0; i < pool->nb_workers; i++) {
+    if (!fds[i].revents) continue;
+    struct worker *worker = &pool->workers[i];
+    int32_t status;
+    if (read_full(worker->fd, &status, sizeof(status)) == sizeof(status)) {
+      worker_done(pool, worker);
+      return status;
+    }
+    // the worker died during the iteration
+    return worker_reap(pool, worker);
+  }
+  return fds[i].revents ? TOKEN_READY : 256;
+}
+
+/**
+ * Executes the body of the pool in a worker, with the variable of the pool set
+ * to `value`. If the limit of workers is reached and they are all busy, or if
+ * the jobserver has no token left, waits for one of them to finish its
+ * iteration first.
+ *
+ * @return the return value of the iteration that was waited for, 0 if none
+ *         was, or EXIT_FAILURE on failure.
+ */
+int worker_pool_run(struct worker_pool *pool, char *value) {
+  int ret = 0, i, tmp_ret, has_token = 0;
+  uint32_t len = strlen(value);
+  char token = 0;
+
+  while (1) {
+    if (has_token && pool->nb_busy == pool->nb_tokens) {
+      // a worker finished while waiting, its token is enough
+      jobserver_release(token);
+      has_token = 0;
+    }
+    if (pool->nb_busy == pool->max) {
+      tmp_ret = worker_pool_wait(pool, -1);
+      if (tmp_ret == 256) break;
+      ret = max_or_neg(ret, tmp_ret);
+      continue;
+    }
+    if (!has_token && pool->nb_busy > pool->nb_tokens) { // implicit token in use
+      switch (jobserver_acquire(&token)) {
+        case 1:
+          has_token = 1;
+          break;
+        case 0:
+          tmp_ret = worker_pool_wait(pool, jobserver_fd());
+          if (tmp_ret == 256) return EXIT_FAILURE; // no token is held yet
+          if (tmp_ret != TOKEN_READY) ret = max_or_neg(ret, tmp_ret);
+          continue;
+      }
+    }
+
+    struct worker *worker = NULL;
+    for (i = 0; i < pool->nb_workers && !worker; i++) {
+      if (!pool->workers[i].busy) worker = &pool->workers[i];
+    }
+    if (!worker) worker = worker_spawn(pool);
+    if (!worker) break;
+
+    if (send_full(worker->fd, &len, sizeof(len)) == 0 &&
+        send_full(worker->fd, value, len) == 0) {
+      worker->busy = 1;
+      worker->has_token = has_token;
+      worker->token = token;
+      pool->nb_busy++;
+      pool->nb_tokens += has_token;
+      return ret;
+    }
+    // the worker died while idle, try again with another one
+    ret = max_or_neg(ret, worker_reap(pool, worker));
+  }
+
+  if (has_token) jobserver_release(token);
+  return EXIT_FAILURE;
+}
+
+/**
+ * Waits for every iteration to finish, then stops the workers.
+ *
+ * @return the highest return value of the iterations (see max_or_neg).
+ */
+int worker_pool_finish(struct worker_pool *pool) {
+  int ret = 0, tmp_ret;
+  while (pool->nb_busy) {
+    tmp_ret = worker_pool_wait(pool, -1);
+    if (tmp_ret == 256) {
+      ret = EXIT_FAILURE;
+      break;
+    }
+    ret = max_or_neg(ret, tmp_ret);
+  }
+
+  // closing the sockets makes the workers exit
+  while (pool->nb_workers) {
+    tmp_ret = worker_reap(pool, &pool->workers[0]);
+    if (tmp_ret != 256) ret = max_or_neg(ret, tmp_ret);
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->cap = 0;
+  return ret;
+}